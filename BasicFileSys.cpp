@@ -2,109 +2,702 @@
 // Implements low-level file system functionality that interfaces with
 // the disk.
 
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <algorithm>
+using namespace std;
+
 #include "Disk.h"
 #include "Blocks.h"
 #include "BasicFileSys.h"
 
+// Returns the number of blocks in the reference count table of a disk of
+// num_blocks blocks.
+static int refcount_blocks(int num_blocks)
+{
+  return (num_blocks + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Creates the file system with its block cache in front of the disk.
+BasicFileSys::BasicFileSys() : cache(&disk), journal(&disk, &cache),
+                               frees_wanted(false)
+{
+}
+
 // Mounts the simulated disk file. If a disk file is created, this
-// routines also "formats" the disk by initializing special blocks
-// 0 (superblock) and 1 (root directory).
-void BasicFileSys::mount()
+// routines also "formats" the disk by initializing the superblock, the
+// root directory, the free block bitmap and the journal. The geometry of
+// the disk is read from the superblock, transactions left in the journal
+// are replayed, and disks in an older format are upgraded. Returns the
+// format version the disk had when mounted.
+unsigned int BasicFileSys::mount(const MountOptions &options)
 {
   // mount the disk
-  bool new_disk = disk.mount("DISK");
+  bool new_disk = disk.mount("DISK", options.disk_mode, options.num_blocks,
+                             options.use_uring);
+
+  // the disk is formatted directly, so enable the cache afterwards
+  if (new_disk) {
+    format(options.num_blocks, options.journal_blocks);
+  }
+  cache.set_capacity(options.cache_blocks);
+
+  // read and check the geometry, past the cache since replay writes
+  // straight to the disk
+  disk.read_block(SUPER_BLOCK, (void *) &super_block);
+  if (super_block.magic != SUPER_MAGIC_NUM ||
+      super_block.version < FS_MIN_VERSION || super_block.version > FS_VERSION) {
+    cerr << "Disk has an unsupported format" << endl;
+    exit(-1);
+  }
+  if (super_block.block_size != BLOCK_SIZE) {
+    cerr << "Disk block size " << super_block.block_size;
+    cerr << " does not match " << BLOCK_SIZE << endl;
+    exit(-1);
+  }
+  if ((int) super_block.num_blocks > disk.get_num_blocks()) {
+    cerr << "Disk is smaller than its superblock" << endl;
+    exit(-1);
+  }
+
+  // bring the disk up to date before anything else is read from it
+  journal.mount(super_block.journal_start, super_block.journal_blocks,
+                options.commit_ops, options.journal_data);
+  disk.read_block(SUPER_BLOCK, (void *) &super_block);
 
-  // if the disk exists, return as no further initialization is needed
-  if (!new_disk) return;
+  // keep the free block bitmap in memory while mounted
+  int bitmap_blocks = super_block.bitmap_blocks;
+  vector<bitmapblock_t> bitmap(bitmap_blocks);
+  vector<blocknum_t> block_nums(bitmap_blocks);
+  vector<void *> buffers(bitmap_blocks);
+  for (int i = 0; i < bitmap_blocks; i++) {
+    block_nums[i] = super_block.bitmap_start + i;
+    buffers[i] = (void *) &bitmap[i];
+  }
+  disk.read_blocks(block_nums.data(), buffers.data(), bitmap_blocks);
+  allocator.load((unsigned char *) bitmap.data(), super_block.num_blocks);
+
+  // and the reference counts of the blocks shared with snapshots
+  if (super_block.refcount_start != 0) {
+    int table_blocks = refcount_blocks(super_block.num_blocks);
+    vector<refcountblock_t> table(table_blocks);
+    block_nums.resize(table_blocks);
+    buffers.resize(table_blocks);
+    for (int i = 0; i < table_blocks; i++) {
+      block_nums[i] = super_block.refcount_start + i;
+      buffers[i] = (void *) &table[i];
+    }
+    disk.read_blocks(block_nums.data(), buffers.data(), table_blocks);
+    refs.load((unsigned char *) table.data(), super_block.num_blocks);
+  } else {
+    refs.load(NULL, super_block.num_blocks);
+  }
+
+  // older formats are read as they are, so only the version changes
+  unsigned int version = super_block.version;
+  if (version < FS_VERSION) {
+    super_block.version = FS_VERSION;
+    cache.write_block(SUPER_BLOCK, (void *) &super_block);
+  }
+  return version;
+}
+
+// Formats a new disk of num_blocks blocks by initializing the
+// superblock, the root directory, the start of the bitmap and a journal
+// of journal_blocks blocks. The disk file is sparse, so all other blocks
+// already read as zeros.
+void BasicFileSys::format(int num_blocks, int journal_blocks)
+{
+  int bitmap_blocks = (num_blocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK;
+  if (journal_blocks < 0) {
+    journal_blocks = max(MIN_JOURNAL_BLOCKS, num_blocks / 16);
+  }
+  if (journal_blocks > 0 && journal_blocks < MIN_JOURNAL_BLOCKS) {
+    cerr << "Journal is too small" << endl;
+    exit(-1);
+  }
+
+  // the journal follows the bitmap
+  int journal_start = BITMAP_START + bitmap_blocks;
+  int first_data_block = journal_start + journal_blocks;
+  if (num_blocks <= first_data_block) {
+    cerr << "Disk is too small" << endl;
+    exit(-1);
+  }
 
   // initialize the superblock
   struct superblock_t super_block;
-  super_block.bitmap[0] = 0x3;		// mark blocks 0 and 1 as used
-  for (int i = 1; i < BLOCK_SIZE; i++) {
-    super_block.bitmap[i] = 0;
+  memset(&super_block, 0, sizeof(super_block));
+  super_block.magic = SUPER_MAGIC_NUM;
+  super_block.version = FS_VERSION;
+  super_block.block_size = BLOCK_SIZE;
+  super_block.num_blocks = num_blocks;
+  super_block.bitmap_start = BITMAP_START;
+  super_block.bitmap_blocks = bitmap_blocks;
+  super_block.root_block = ROOT_BLOCK;
+  if (journal_blocks > 0) {
+    super_block.journal_start = journal_start;
+    super_block.journal_blocks = journal_blocks;
   }
-  disk.write_block(0, (void *) &super_block);
+  disk.write_block(SUPER_BLOCK, (void *) &super_block);
 
-  // initialize the root directory
+  // initialize the root directory with a single empty bucket
   struct dirblock_t dir_block;
+  memset(&dir_block, 0, sizeof(dir_block));
   dir_block.magic = DIR_MAGIC_NUM;
-  dir_block.num_entries = 0;
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-    dir_block.dir_entries[i].block_num = 0;
-  }
-  disk.write_block(1, (void *) &dir_block);
+  dir_block.num_buckets = 1;
+  dir_block.parent = ROOT_BLOCK;
+  disk.write_block(ROOT_BLOCK, (void *) &dir_block);
 
-  // write a zeroed-out data block to all other blocks on disk
-  struct datablock_t data_block;
-  for (int i = 0; i < BLOCK_SIZE; i++) {
-    data_block.data[i] = 0;
+  // start with an empty journal
+  if (journal_blocks > 0) {
+    Journal::format(&disk, journal_start);
   }
-  for (int i = 2; i < NUM_BLOCKS; i++) {
-    disk.write_block(i, (void *) &data_block);
+
+  // mark the superblock, root directory, bitmap and journal blocks as
+  // used. Only the bitmap blocks covering them are written; the rest of
+  // the bitmap and every data block are left as zeros in the sparse disk
+  // file, and blocks are initialized by whoever allocates them
+  for (int i = 0; i * BITS_PER_BITMAP_BLOCK < first_data_block; i++) {
+    struct bitmapblock_t bitmap_block;
+    memset(&bitmap_block, 0, sizeof(bitmap_block));
+    for (int b = 0; b < BITS_PER_BITMAP_BLOCK; b++) {
+      if (i * BITS_PER_BITMAP_BLOCK + b < first_data_block) {
+        bitmap_block.bitmap[b / 8] |= 1 << (b % 8);
+      }
+    }
+    disk.write_block(BITMAP_START + i, (void *) &bitmap_block);
   }
 }
 
-// Unmounts the disk
+// Unmounts the disk. Pending changes are committed and dirty cached
+// blocks are written back first.
 void BasicFileSys::unmount()
 {
+  commit();
+  journal.checkpoint();
+  freed.clear();
+  frees_wanted = false;
+  cache.clear();
   disk.unmount();
 }
 
-// Gets a free block from the disk.
-short BasicFileSys::get_free_block()
+// Commits pending changes, writes all dirty cached blocks back to the
+// disk and forces them to stable storage.
+void BasicFileSys::sync()
 {
-  // get superblock
-  struct superblock_t super_block;
-  disk.read_block(0, (void *) &super_block);
-  
-  // look for first available block
-  for (int byte = 0; byte < BLOCK_SIZE; byte++) {
-
-    // check to see if byte has available slot
-    if (super_block.bitmap[byte] != 0xFF) {
- 
-      // loop to check each bit
-      for (int bit = 0; bit < 8; bit++) {
-        int mask = 1 << bit;
-	if (mask & ~super_block.bitmap[byte]) {
-
-          // Available block is found: set bit in bitmap, write result back
-	  // to superblock, and return block number.
-	  super_block.bitmap[byte] |= mask;
-	  disk.write_block(0, (void *) &super_block);
-	  return (byte * 8) + bit;
-	}
-      }
+  commit();
+  journal.checkpoint();
+}
+
+// Marks the start of a file system operation that changes at most blocks
+// blocks, waiting for a commit in progress to finish or for the journal
+// to have room for it. Blocks waiting for their frees to commit are
+// handed back first if the disk ran short of them. Returns false,
+// starting nothing, if the operation would not fit in the journal.
+bool BasicFileSys::begin_op(int blocks)
+{
+  // between operations no half done change can be committed with them
+  unique_lock<mutex> guard(alloc_lock);
+  bool short_of_blocks = !freed.empty() &&
+    (frees_wanted || allocator.num_free() < (int) freed.size());
+  guard.unlock();
+  if (short_of_blocks) {
+    commit();
+  }
+
+  // making room may commit the group, freeing blocks
+  unsigned int sequence = journal.running_sequence();
+  if (!journal.begin_op(blocks)) {
+    return false;
+  }
+  if (journal.running_sequence() != sequence) {
+    guard.lock();
+    release_freed();
+  }
+  return true;
+}
+
+// Reserves room in the journal for blocks more blocks changed by the
+// operation in progress, if there is room now. Returns false if not.
+bool BasicFileSys::extend_op(int blocks)
+{
+  return journal.extend_op(blocks);
+}
+
+// Returns the most bitmap and reference count blocks that allocating,
+// sharing or reclaiming n blocks changes.
+int BasicFileSys::bitmap_op_blocks(int n)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  int blocks = min(n, (int) super_block.bitmap_blocks);
+  if (super_block.refcount_start != 0) {
+    blocks += min(n, refcount_blocks(super_block.num_blocks));
+  }
+  return blocks;
+}
+
+// Returns the number of blocks enable_snapshots changes: the reference
+// count table, the superblock and the bitmap.
+int BasicFileSys::snapshot_op_blocks()
+{
+  int table_blocks = refcount_blocks(super_block.num_blocks);
+  return table_blocks + 1 + min(table_blocks, (int) super_block.bitmap_blocks);
+}
+
+// Marks the end of a file system operation. The changes of a group of
+// operations are committed to the journal together.
+void BasicFileSys::end_op()
+{
+  if (journal.end_op()) {
+    lock_guard<mutex> guard(alloc_lock);
+    release_freed();
+  }
+}
+
+// Commits pending changes to the journal and hands the blocks they free
+// back to the allocator.
+void BasicFileSys::commit()
+{
+  journal.commit();
+  lock_guard<mutex> guard(alloc_lock);
+  release_freed();
+}
+
+// Returns the blocks freed by committed transactions to the allocator.
+// Until the frees are committed a crash could bring the blocks back into
+// use, so they must not be handed out and written in place before then.
+// Their bits were already written as free with the commit. alloc_lock
+// must be held.
+void BasicFileSys::release_freed()
+{
+  // operations that began after the commit may have freed more since
+  unsigned int sequence = journal.running_sequence();
+  vector<blocknum_t> blocks;
+  size_t kept = 0;
+  for (size_t i = 0; i < freed.size(); i++) {
+    if (freed[i].first < sequence) {
+      blocks.push_back(freed[i].second);
+    } else {
+      freed[kept++] = freed[i];
     }
   }
+  if (blocks.empty()) {
+    return;
+  }
+  freed.resize(kept);
+  frees_wanted = false;
+  allocator.release(blocks.data(), blocks.size());
+  allocator.clear_dirty();
+}
+
+// Notes that an allocation failed while blocks wait for their frees to
+// commit, so the next operation commits before it begins. alloc_lock
+// must be held.
+void BasicFileSys::want_frees()
+{
+  if (!freed.empty()) {
+    frees_wanted = true;
+  }
+}
 
-  // disk is full
-  return 0;
+// Returns the number of free blocks on the disk.
+int BasicFileSys::num_free_blocks()
+{
+  lock_guard<mutex> guard(alloc_lock);
+  return allocator.num_free();
+}
+
+// Gets a free block from the disk, as close after goal as possible.
+blocknum_t BasicFileSys::get_free_block(blocknum_t goal)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  blocknum_t block_num = allocator.allocate(goal);
+  if (block_num == 0) {
+    want_frees();
+    return 0;
+  }
+  save_bitmap();
+  return block_num;
+}
+
+// Gets n free blocks from the disk and stores them in blocks, starting
+// at goal if it is free and placed by policy otherwise. Either all n
+// blocks are allocated or none are. Returns false if the disk does not
+// have n free blocks.
+bool BasicFileSys::get_free_blocks(int n, blocknum_t *blocks, blocknum_t goal,
+                                   AllocPolicy policy)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  if (!allocator.allocate(n, blocks, goal, policy)) {
+    want_frees();
+    return false;
+  }
+  save_bitmap();
+  return true;
 }
   
+// Gets n free blocks like get_free_blocks, from outside any operation,
+// and holds them for the caller without recording them in the bitmap, so
+// that a crash leaves them free. Returns false if the disk does not have n
+// free blocks.
+bool BasicFileSys::reserve_blocks(int n, blocknum_t *blocks, blocknum_t goal,
+                                  AllocPolicy policy)
+{
+  unique_lock<mutex> guard(alloc_lock);
+  if (!allocator.allocate(n, blocks, goal, policy)) {
+    // blocks waiting for their frees to commit can be had by committing,
+    // which no operation of the caller's holds up
+    if (freed.empty()) {
+      return false;
+    }
+    guard.unlock();
+    commit();
+    guard.lock();
+    if (!allocator.allocate(n, blocks, goal, policy)) {
+      return false;
+    }
+  }
+
+  // the bitmap on disk keeps them free until they are claimed; record
+  // each run of adjacent blocks
+  allocator.clear_dirty();
+  int i = 0;
+  while (i < n) {
+    int run = 1;
+    while (i + run < n && blocks[i + run] == blocks[i + run - 1] + 1) {
+      run++;
+    }
+    reserved[blocks[i]] = blocks[i] + run;
+    i += run;
+  }
+  return true;
+}
+
+// Records the n reserved blocks in blocks in the bitmap, within the
+// operation that links them into a file.
+void BasicFileSys::claim_blocks(const blocknum_t *blocks, int n)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  drop_reserved(blocks, n);
+  save_bitmap(blocks, n);
+}
+
+// Gives back the n reserved blocks in blocks. They were never recorded in
+// the bitmap, so it has nothing to write.
+void BasicFileSys::unreserve_blocks(const blocknum_t *blocks, int n)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  drop_reserved(blocks, n);
+  allocator.release(blocks, n);
+  allocator.clear_dirty();
+}
+
+// Removes the n blocks in blocks from the reserved runs, splitting the
+// runs they cover part of. alloc_lock must be held.
+void BasicFileSys::drop_reserved(const blocknum_t *blocks, int n)
+{
+  int i = 0;
+  while (i < n) {
+    int run = 1;
+    while (i + run < n && blocks[i + run] == blocks[i + run - 1] + 1) {
+      run++;
+    }
+    blocknum_t start = blocks[i];
+    blocknum_t stop = blocks[i] + run;
+    i += run;
+
+    // every reserved run overlapping start to stop loses the overlap
+    map<blocknum_t, blocknum_t>::iterator it = reserved.upper_bound(start);
+    if (it != reserved.begin()) {
+      it--;
+      if (it->second <= start) {
+        it++;
+      }
+    }
+    while (it != reserved.end() && it->first < stop) {
+      blocknum_t first = it->first;
+      blocknum_t end = it->second;
+      reserved.erase(it++);
+      if (first < start) {
+        reserved[first] = start;
+      }
+      if (end > stop) {
+        reserved[stop] = end;
+      }
+    }
+  }
+}
+
 // Reclaims block making it available for future use.
-void BasicFileSys::reclaim_block(short block_num)
+void BasicFileSys::reclaim_block(blocknum_t block_num)
 {
-  // get superblock
-  struct superblock_t super_block;
-  disk.read_block(0, (void *) &super_block);
+  reclaim_blocks(&block_num, 1);
+}
+
+// Reclaims the n blocks in blocks. Blocks shared with snapshots only lose
+// a reference. With a journal the others are written as free at once but
+// only reused after the next commit.
+void BasicFileSys::reclaim_blocks(const blocknum_t *blocks, int n)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  vector<blocknum_t> unshared;
+  if (refs.num_shared() > 0) {
+    for (int i = 0; i < n; i++) {
+      if (!refs.drop(blocks[i])) {
+        unshared.push_back(blocks[i]);
+      }
+    }
+    save_refs();
+    blocks = unshared.data();
+    n = unshared.size();
+  }
+
+  if (journal.enabled()) {
+    unsigned int sequence = journal.running_sequence();
+    for (int i = 0; i < n; i++) {
+      freed.push_back(make_pair(sequence, blocks[i]));
+    }
+    save_bitmap(blocks, n);
+    return;
+  }
+  allocator.release(blocks, n);
+  save_bitmap();
+}
+
+// Makes snapshot_dir the directory listing the snapshots and creates the
+// reference count table, before the first snapshot is taken. Returns
+// false if the disk has no room for the table.
+bool BasicFileSys::enable_snapshots(blocknum_t snapshot_dir)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  int table_blocks = refcount_blocks(super_block.num_blocks);
+  blocknum_t start;
+  if (!allocator.allocate_run(table_blocks, start)) {
+    want_frees();
+    return false;
+  }
+  save_bitmap();
+
+  // every count starts at zero
+  vector<refcountblock_t> table(table_blocks);
+  memset(table.data(), 0, table_blocks * sizeof(refcountblock_t));
+  vector<blocknum_t> block_nums(table_blocks);
+  vector<void *> buffers(table_blocks);
+  for (int i = 0; i < table_blocks; i++) {
+    block_nums[i] = start + i;
+    buffers[i] = (void *) &table[i];
+  }
+  write_blocks(block_nums.data(), buffers.data(), table_blocks);
+
+  super_block.snapshot_dir = snapshot_dir;
+  super_block.refcount_start = start;
+  write_block(SUPER_BLOCK, (void *) &super_block);
+  return true;
+}
+
+// Adds a reference to each of the n blocks in blocks, which a snapshot
+// now shares.
+void BasicFileSys::share_blocks(const blocknum_t *blocks, int n)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  refs.add(blocks, n);
+  save_refs();
+}
+
+// Returns true if a snapshot shares block_num, so that it must be copied
+// rather than written in place.
+bool BasicFileSys::is_shared(blocknum_t block_num)
+{
+  lock_guard<mutex> guard(alloc_lock);
+  return refs.is_shared(block_num);
+}
+
+// Returns the number of blocks shared with snapshots.
+int BasicFileSys::num_shared_blocks()
+{
+  lock_guard<mutex> guard(alloc_lock);
+  return refs.num_shared();
+}
 
-  // clear bit
-  int byte = block_num / 8;		// byte number
-  int bit = block_num % 8;		// bit number
-  unsigned char mask = ~(1 << bit);	// mask to clear bit
-  super_block.bitmap[byte] &= mask;
+// Sends len bytes of the n blocks in block_nums, starting offset bytes
+// into the first, to out_fd straight from the disk file. Cached changes
+// to the blocks are written back first. Returns false, having written
+// nothing, if out_fd is not a regular file or the blocks have changes not
+// yet committed to the journal.
+bool BasicFileSys::send_blocks(int out_fd, const blocknum_t *block_nums, int n,
+                               unsigned int offset, unsigned int len)
+{
+  if (journal.holds(block_nums, n)) {
+    return false;
+  }
+  cache.write_back(block_nums, n);
 
-  // write back superblock
-  disk.write_block(0, (void *) &super_block);
+  // send each run of adjacent blocks with one call
+  int i = 0;
+  while (i < n && len > 0) {
+    int run = 1;
+    while (i + run < n && block_nums[i + run] == block_nums[i + run - 1] + 1) {
+      run++;
+    }
+    unsigned int run_len = min(len, run * BLOCK_SIZE - offset);
+    if (!disk.send(out_fd, block_nums[i], offset, run_len)) {
+      return false;
+    }
+    len -= run_len;
+    offset = 0;
+    i += run;
+  }
+  return true;
+}
+
+// Writes the bitmap blocks changed in memory, and those covering the n
+// blocks in reclaimed, back to the disk. Blocks freed since the last
+// commit and reserved blocks are written as free. alloc_lock must be
+// held.
+void BasicFileSys::save_bitmap(const blocknum_t *reclaimed, int n)
+{
+  set<int> dirty = allocator.dirty();
+  for (int i = 0; i < n; i++) {
+    dirty.insert(reclaimed[i] / BITS_PER_BITMAP_BLOCK);
+  }
+
+  vector<bitmapblock_t> bitmap(dirty.size());
+  vector<blocknum_t> block_nums;
+  vector<void *> buffers;
+  for (set<int>::const_iterator it = dirty.begin(); it != dirty.end(); it++) {
+    bitmapblock_t &bitmap_block = bitmap[block_nums.size()];
+    allocator.store(*it, &bitmap_block);
+    for (size_t i = 0; i < freed.size(); i++) {
+      int bit = freed[i].second - *it * BITS_PER_BITMAP_BLOCK;
+      if (bit >= 0 && bit < BITS_PER_BITMAP_BLOCK) {
+        bitmap_block.bitmap[bit / 8] &= ~(1 << (bit % 8));
+      }
+    }
+    blocknum_t first = *it * BITS_PER_BITMAP_BLOCK;
+    blocknum_t last = first + BITS_PER_BITMAP_BLOCK;
+    map<blocknum_t, blocknum_t>::const_iterator run = reserved.upper_bound(first);
+    if (run != reserved.begin()) {
+      run--;
+    }
+    for (; run != reserved.end() && run->first < last; run++) {
+      for (blocknum_t b = max(run->first, first); b < min(run->second, last); b++) {
+        int bit = b - first;
+        bitmap_block.bitmap[bit / 8] &= ~(1 << (bit % 8));
+      }
+    }
+    buffers.push_back((void *) &bitmap_block);
+    block_nums.push_back(super_block.bitmap_start + *it);
+  }
+  write_blocks(block_nums.data(), buffers.data(), block_nums.size());
+  allocator.clear_dirty();
 }
   
+// Writes the blocks of the reference count table changed in memory back
+// to the disk. alloc_lock must be held.
+void BasicFileSys::save_refs()
+{
+  const set<int> &dirty = refs.dirty();
+  vector<refcountblock_t> table(dirty.size());
+  vector<blocknum_t> block_nums;
+  vector<void *> buffers;
+  for (set<int>::const_iterator it = dirty.begin(); it != dirty.end(); it++) {
+    refcountblock_t &table_block = table[block_nums.size()];
+    refs.store(*it, &table_block);
+    buffers.push_back((void *) &table_block);
+    block_nums.push_back(super_block.refcount_start + *it);
+  }
+  write_blocks(block_nums.data(), buffers.data(), block_nums.size());
+  refs.clear_dirty();
+}
+
 // Reads block from disk. Output parameter block points to new block.
-void BasicFileSys::read_block(short block_num, void *block) {
-  disk.read_block(block_num, block);
+void BasicFileSys::read_block(blocknum_t block_num, void *block) {
+  if (!journal.read_block(block_num, block)) {
+    cache.read_block(block_num, block);
+  }
 }
 
 // Writes block to disk. Input block points to block to write.
-void BasicFileSys::write_block(short block_num, void *block) {
-  disk.write_block(block_num, block);
+void BasicFileSys::write_block(blocknum_t block_num, void *block) {
+  if (journal.enabled()) {
+    journal.write_block(block_num, block);
+  } else {
+    cache.write_block(block_num, block);
+  }
+}
+
+// Reads the n blocks in block_nums into the matching buffers in
+// blocks, coalescing adjacent blocks into single disk requests.
+void BasicFileSys::read_blocks(const blocknum_t *block_nums, void *const *blocks, int n) {
+  ReadBatch batch;
+  start_read_blocks(batch, block_nums, blocks, n);
+  finish_read_blocks(batch);
+}
+
+// Starts reading the n blocks in block_nums into the matching buffers in
+// blocks like read_blocks, without waiting for the disk, so that the
+// caller can go on meanwhile. finish_read_blocks must be called with
+// batch before the buffers are used.
+void BasicFileSys::start_read_blocks(ReadBatch &batch, const blocknum_t *block_nums,
+                                     void *const *blocks, int n) {
+  // the journal goes first: a commit writes its blocks to the cache before
+  // letting go of them
+  unique_ptr<bool[]> found(new bool[n]);
+  int hits = journal.read_blocks(block_nums, blocks, n, found.get());
+  if (hits == 0) {
+    cache.start_read(batch, block_nums, blocks, n);
+  } else if (hits < n) {
+    vector<blocknum_t> miss_nums;
+    vector<void *> miss_blocks;
+    for (int i = 0; i < n; i++) {
+      if (!found[i]) {
+        miss_nums.push_back(block_nums[i]);
+        miss_blocks.push_back(blocks[i]);
+      }
+    }
+    cache.start_read(batch, miss_nums.data(), miss_blocks.data(), miss_nums.size());
+  }
+}
+
+// Waits for the reads started in batch to complete.
+void BasicFileSys::finish_read_blocks(ReadBatch &batch) {
+  cache.finish_read(batch);
+}
+
+// Writes the n buffers in blocks to the matching blocks in block_nums,
+// coalescing adjacent blocks into single disk requests.
+void BasicFileSys::write_blocks(const blocknum_t *block_nums, void *const *blocks, int n) {
+  if (!journal.enabled()) {
+    cache.write_blocks(block_nums, blocks, n);
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    journal.write_block(block_nums[i], blocks[i]);
+  }
+}
+
+// Writes file data like write_blocks. Unless file data is journaled, the
+// blocks bypass the journal and are written in place.
+void BasicFileSys::write_data_blocks(const blocknum_t *block_nums, void *const *blocks, int n) {
+  if (journal.journals_data()) {
+    write_blocks(block_nums, blocks, n);
+    return;
+  }
+  journal.ordered_write(block_nums, n);
+  cache.write_blocks(block_nums, blocks, n);
+}
+
+// Writes file data to the n reserved blocks in block_nums in place,
+// outside any operation. Nothing refers to them until they are claimed,
+// and they are written back before the commit that does, so even
+// journaled data need not go through the journal.
+void BasicFileSys::write_reserved_blocks(const blocknum_t *block_nums, void *const *blocks, int n) {
+  journal.ordered_write(block_nums, n);
+  cache.write_blocks(block_nums, blocks, n);
 }
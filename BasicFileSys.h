@@ -1,37 +1,247 @@
 // Computing Systems: Basic File System
 // Implements low-level file system functionality that interfaces with
-// the disk.
+// the disk. Every method may be called from several threads at once.
 
 #ifndef BASIC_FILESYS_H
 #define BASIC_FILESYS_H
 
+#include <vector>
+#include <map>
+#include <mutex>
+#include <utility>
 #include "Disk.h"
+#include "BlockCache.h"
+#include "BlockAllocator.h"
+#include "Journal.h"
+#include "RefCounts.h"
+#include "Blocks.h"
+
+// Settings used when mounting the file system
+struct MountOptions {
+  int cache_blocks;	// size of the block cache in blocks (0 disables it)
+  DiskMode disk_mode;	// how the disk file is accessed
+  int num_blocks;	// size in blocks of a newly created disk
+  int journal_blocks;	// journal size of a newly created disk (0 - none,
+			// -1 - a sixteenth of the disk)
+  int commit_ops;	// operations committed to the journal together
+  bool journal_data;	// journal file data as well as metadata
+  bool use_uring;	// move blocks with io_uring where the kernel has it
+  const char *snapshot;	// snapshot to mount read-only (NULL - the live
+			// file system)
+
+  MountOptions()
+    : cache_blocks(DEFAULT_CACHE_BLOCKS), disk_mode(DISK_MODE_IO),
+      num_blocks(DEFAULT_NUM_BLOCKS), journal_blocks(-1),
+      commit_ops(DEFAULT_COMMIT_OPS), journal_data(false),
+      use_uring(true), snapshot(NULL) {}
+};
 
 // Basic File 
 class BasicFileSys {
 
   public:
+    // Creates the file system with its block cache in front of the disk.
+    BasicFileSys();
+
     // Mounts the disk.  If the disk is new, it formats the disk by
-    // initializing special blocks 0 (superblock) and 1 (root directory). 
-    void mount();
+    // initializing special blocks 0 (superblock), 1 (root directory), the
+    // free block bitmap that follows them and the journal. Transactions
+    // left in the journal are replayed, and disks in an older format are
+    // upgraded. Returns the format version the disk had when mounted.
+    unsigned int mount(const MountOptions &options = MountOptions());
 
-    // Unmounts the disk.
+    // Unmounts the disk. Pending changes are committed and dirty cached
+    // blocks are written back first.
     void unmount();
 
-    // Gets a free block from the disk.
-    short get_free_block();
+    // Commits pending changes, writes all dirty cached blocks back to the
+    // disk and forces them to stable storage.
+    void sync();
+
+    // Marks the start of a file system operation that changes at most
+    // blocks blocks, waiting for a commit in progress to finish or for the
+    // journal to have room for it. Blocks waiting for their frees to commit
+    // are handed back first if the disk ran short of them. Returns false,
+    // starting nothing, if the operation would not fit in the journal.
+    bool begin_op(int blocks = OP_JOURNAL_BLOCKS);
+
+    // Reserves room in the journal for blocks more blocks changed by the
+    // operation in progress, if there is room now. Returns false if not.
+    bool extend_op(int blocks);
+
+    // Returns the most bitmap and reference count blocks that allocating,
+    // sharing or reclaiming n blocks changes.
+    int bitmap_op_blocks(int n);
+
+    // Returns the number of blocks enable_snapshots changes.
+    int snapshot_op_blocks();
+
+    // Returns true if file data is journaled.
+    bool journals_data() const { return journal.journals_data(); }
+
+    // Marks the end of a file system operation. The changes of a group of
+    // operations are committed to the journal together.
+    void end_op();
+
+    // Gets a free block from the disk, as close after goal as possible.
+    blocknum_t get_free_block(blocknum_t goal = 0);
+
+    // Gets n free blocks from the disk and stores them in blocks, starting
+    // at goal if it is free and placed by policy otherwise. Either all n
+    // blocks are allocated or none are. Returns false if the disk does not
+    // have n free blocks.
+    bool get_free_blocks(int n, blocknum_t *blocks, blocknum_t goal = 0,
+                         AllocPolicy policy = ALLOC_NEAR);
   
+    // Gets n free blocks like get_free_blocks, from outside any operation,
+    // and holds them for the caller without recording them in the bitmap,
+    // so that a crash leaves them free. Returns false if the disk does not
+    // have n free blocks.
+    bool reserve_blocks(int n, blocknum_t *blocks, blocknum_t goal = 0,
+                        AllocPolicy policy = ALLOC_NEAR);
+
+    // Records the n reserved blocks in blocks in the bitmap, within the
+    // operation that links them into a file.
+    void claim_blocks(const blocknum_t *blocks, int n);
+
+    // Gives back the n reserved blocks in blocks.
+    void unreserve_blocks(const blocknum_t *blocks, int n);
+
     // Reclaims block making it available for future use.
-    void reclaim_block(short block_num);
+    void reclaim_block(blocknum_t block_num);
+
+    // Reclaims the n blocks in blocks. Blocks shared with snapshots only
+    // lose a reference.
+    void reclaim_blocks(const blocknum_t *blocks, int n);
+
+    // Returns the number of free blocks on the disk.
+    int num_free_blocks();
+
+    // Returns the block of the root directory.
+    blocknum_t root_dir() const { return super_block.root_block; }
+
+    // Returns the directory listing the snapshots, or 0 if none has been
+    // taken yet.
+    blocknum_t snapshot_dir() const { return super_block.snapshot_dir; }
+
+    // Makes snapshot_dir the directory listing the snapshots and creates
+    // the reference count table, before the first snapshot is taken.
+    // Returns false if the disk has no room for the table.
+    bool enable_snapshots(blocknum_t snapshot_dir);
+
+    // Adds a reference to each of the n blocks in blocks, which a snapshot
+    // now shares.
+    void share_blocks(const blocknum_t *blocks, int n);
+
+    // Returns true if a snapshot shares block_num, so that it must be
+    // copied rather than written in place.
+    bool is_shared(blocknum_t block_num);
+
+    // Returns the number of blocks shared with snapshots.
+    int num_shared_blocks();
 
     // Reads block from disk. Output parameter block points to new block.
-    void read_block(short block_num, void *block);
+    void read_block(blocknum_t block_num, void *block);
   
     // Writes block to disk. Input block points to block to write.
-    void write_block(short block_num, void *block);
+    void write_block(blocknum_t block_num, void *block);
+
+    // Reads the n blocks in block_nums into the matching buffers in
+    // blocks, coalescing adjacent blocks into single disk requests.
+    void read_blocks(const blocknum_t *block_nums, void *const *blocks, int n);
+
+    // Starts reading the n blocks in block_nums into the matching buffers
+    // in blocks like read_blocks, without waiting for the disk, so that
+    // the caller can go on meanwhile. finish_read_blocks must be called
+    // with batch before the buffers are used.
+    void start_read_blocks(ReadBatch &batch, const blocknum_t *block_nums,
+                           void *const *blocks, int n);
+
+    // Waits for the reads started in batch to complete.
+    void finish_read_blocks(ReadBatch &batch);
+
+    // Writes the n buffers in blocks to the matching blocks in block_nums,
+    // coalescing adjacent blocks into single disk requests.
+    void write_blocks(const blocknum_t *block_nums, void *const *blocks, int n);
+
+    // Writes file data like write_blocks. Unless file data is journaled,
+    // the blocks bypass the journal and are written in place.
+    void write_data_blocks(const blocknum_t *block_nums, void *const *blocks, int n);
+
+    // Writes file data to the n reserved blocks in block_nums in place,
+    // outside any operation. Nothing refers to them until they are
+    // claimed, and they are written back before the commit that does.
+    void write_reserved_blocks(const blocknum_t *block_nums, void *const *blocks, int n);
+
+    // Sends len bytes of the n blocks in block_nums, starting offset bytes
+    // into the first, to out_fd straight from the disk file. Cached
+    // changes to the blocks are written back first. Returns false, having
+    // written nothing, if out_fd is not a regular file or the blocks have
+    // changes not yet committed to the journal.
+    bool send_blocks(int out_fd, const blocknum_t *block_nums, int n,
+                     unsigned int offset, unsigned int len);
+
+    // Returns the block cache (for statistics).
+    const BlockCache &get_cache() const { return cache; }
+
+    // Returns the journal (for statistics).
+    const Journal &get_journal() const { return journal; }
+
+    // Returns the block allocator (for statistics).
+    const BlockAllocator &get_allocator() const { return allocator; }
+
+    // Returns the disk (for statistics).
+    const Disk &get_disk() const { return disk; }
+
+    // Returns how disk blocks are moved ("io_uring", "threads" or "mmap").
+    const char *io_engine() const { return disk.engine_name(); }
 
   private:
     Disk disk;
+    BlockCache cache;	// write-back cache in front of disk
+    Journal journal;	// write-ahead journal in front of cache
+    struct superblock_t super_block;	// geometry of the mounted disk
+    std::mutex alloc_lock;	// guards allocator, refs and freed
+    BlockAllocator allocator;	// in-memory copy of the free block bitmap
+    RefCounts refs;		// in-memory copy of the reference count table
+    std::vector<std::pair<unsigned int, blocknum_t> > freed; // blocks freed, by
+				// the transaction that frees them
+    std::map<blocknum_t, blocknum_t> reserved; // runs of reserved blocks, from
+				// the first to one past the last
+    bool frees_wanted;		// an allocation failed while frees wait
+
+    // Formats a new disk of num_blocks blocks by initializing the
+    // superblock, the root directory, the start of the bitmap and a
+    // journal of journal_blocks blocks. The disk file is sparse, so all
+    // other blocks already read as zeros.
+    void format(int num_blocks, int journal_blocks);
+
+    // Writes the bitmap blocks changed in memory, and those covering the n
+    // blocks in reclaimed, back to the disk. Blocks freed since the last
+    // commit and reserved blocks are written as free. alloc_lock must be
+    // held.
+    void save_bitmap(const blocknum_t *reclaimed = NULL, int n = 0);
+
+    // Removes the n blocks in blocks from the reserved runs. alloc_lock
+    // must be held.
+    void drop_reserved(const blocknum_t *blocks, int n);
+
+    // Writes the blocks of the reference count table changed in memory
+    // back to the disk. alloc_lock must be held.
+    void save_refs();
+
+    // Commits pending changes to the journal and hands the blocks they
+    // free back to the allocator.
+    void commit();
+
+    // Returns the blocks freed by committed transactions to the allocator.
+    // alloc_lock must be held.
+    void release_freed();
+
+    // Notes that an allocation failed while blocks wait for their frees
+    // to commit, so the next operation commits before it begins.
+    // alloc_lock must be held.
+    void want_frees();
 };
 
 #endif
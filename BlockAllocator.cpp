@@ -0,0 +1,291 @@
+// Computing Systems: Block Allocator
+// Keeps the free block bitmap in memory and hands out free blocks.
+
+#include <algorithm>
+using namespace std;
+
+#include "BlockAllocator.h"
+
+// Returns the first block at or after block_num whose bit is clear (if
+// want_free) or set, scanning a 64-bit word at a time and adding the
+// words looked at to scanned. Returns words.size() * 64 if there is none.
+static blocknum_t next_block(const vector<uint64_t> &words, blocknum_t block_num, bool want_free,
+                             unsigned long &scanned)
+{
+  size_t w = block_num / 64;
+  if (w >= words.size()) {
+    return words.size() * 64;
+  }
+  uint64_t word = want_free ? ~words[w] : words[w];
+  word &= ~(uint64_t) 0 << (block_num % 64);
+  scanned++;
+  while (word == 0) {
+    if (++w == words.size()) {
+      return words.size() * 64;
+    }
+    word = want_free ? ~words[w] : words[w];
+    scanned++;
+  }
+  return w * 64 + __builtin_ctzll(word);
+}
+
+BlockAllocator::BlockAllocator()
+  : num_blocks(0), free_count(0), num_allocations(0), num_allocated(0), num_releases(0),
+    num_released(0), num_extent_lookups(0), num_bitmap_scans(0), num_words_scanned(0)
+{
+}
+
+// Loads the allocator from an on-disk bitmap describing num_blocks
+// blocks. Bit i of byte j is set if block j * 8 + i is in use. The
+// tree of free extents is built from the bitmap.
+void BlockAllocator::load(const unsigned char *bitmap, int num_blocks)
+{
+  this->num_blocks = num_blocks;
+  words.assign((num_blocks + 63) / 64, 0);
+
+  for (int byte = 0; byte < (num_blocks + 7) / 8; byte++) {
+    words[byte / 8] |= (uint64_t) bitmap[byte] << ((byte % 8) * 8);
+  }
+
+  // blocks past the end of the disk are permanently in use
+  for (int block_num = num_blocks; block_num < (int) words.size() * 64; block_num++) {
+    words[block_num / 64] |= (uint64_t) 1 << (block_num % 64);
+  }
+
+  free_count = 0;
+  for (size_t w = 0; w < words.size(); w++) {
+    free_count += 64 - __builtin_popcountll(words[w]);
+  }
+  num_bitmap_scans++;
+  num_words_scanned += words.size();
+  dirty_blocks.clear();
+
+  // every run of clear bits is a free extent
+  free_extents.clear();
+  by_length.clear();
+  unsigned long scanned = 0;
+  blocknum_t start = next_block(words, 0, true, scanned);
+  while (start < num_blocks) {
+    blocknum_t end = next_block(words, start, false, scanned);
+    add_extent(start, end - start);
+    start = next_block(words, end, true, scanned);
+  }
+  num_words_scanned += scanned;
+}
+
+// Copies bitmap block index (the bits of blocks
+// index * BITS_PER_BITMAP_BLOCK onwards) into the on-disk format used
+// by load.
+void BlockAllocator::store(int index, bitmapblock_t *block) const
+{
+  int first_byte = index * BLOCK_SIZE;
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    int byte = first_byte + i;
+    if (byte < (int) words.size() * 8) {
+      block->bitmap[i] = (unsigned char) (words[byte / 8] >> ((byte % 8) * 8));
+    } else {
+      block->bitmap[i] = 0;
+    }
+  }
+}
+
+// Allocates the first free block at or after goal (wrapping around to
+// the start of the disk). Returns 0 if the disk is full.
+blocknum_t BlockAllocator::allocate(blocknum_t goal)
+{
+  blocknum_t block_num;
+  if (!allocate(1, &block_num, goal, ALLOC_NEAR)) {
+    return 0;
+  }
+  return block_num;
+}
+
+// Allocates n blocks and stores them in blocks, in order. Blocks are
+// taken contiguously starting at goal while it is free; otherwise
+// policy picks where the next run starts. Either all n blocks are
+// allocated or none are. Returns false if fewer than n blocks are
+// free.
+bool BlockAllocator::allocate(int n, blocknum_t *blocks, blocknum_t goal,
+                              AllocPolicy policy)
+{
+  num_allocations++;
+  if (n > free_count) {
+    return false;
+  }
+  if (goal < 0 || goal >= num_blocks) {
+    goal = 0;
+  }
+
+  int got = 0;
+  blocknum_t next = goal;
+  while (got < n) {
+    extent_iter it = find_extent(next);
+    num_extent_lookups++;
+    blocknum_t from = next;
+
+    if (it == free_extents.end()) {
+      if (policy == ALLOC_SPREAD) {
+        // start in the middle of the largest free extent, leaving room
+        // for whatever grows into its first half
+        it = free_extents.find(by_length.rbegin()->second);
+        from = it->first;
+        if (it->second / 2 >= n - got) {
+          from += it->second / 2;
+        }
+      } else {
+        // first free extent after next, wrapping around
+        it = free_extents.lower_bound(next);
+        if (it == free_extents.end()) {
+          it = free_extents.begin();
+        }
+        from = it->first;
+      }
+    }
+
+    int length = min(n - got, (int) (it->first + it->second - from));
+    take(it, from, length);
+    for (int i = 0; i < length; i++) {
+      blocks[got++] = from + i;
+    }
+    next = from + length;
+  }
+  num_allocated += n;
+  return true;
+}
+
+// Allocates a run of n adjacent blocks from the smallest free extent that
+// holds them and stores its first block in start. Returns false if no
+// free extent is that long.
+bool BlockAllocator::allocate_run(int n, blocknum_t &start)
+{
+  num_allocations++;
+  num_extent_lookups++;
+  set<pair<int, blocknum_t> >::iterator fit = by_length.lower_bound(make_pair(n, 0));
+  if (fit == by_length.end()) {
+    return false;
+  }
+  start = fit->second;
+  take(free_extents.find(start), start, n);
+  num_allocated += n;
+  return true;
+}
+
+// Marks block_num as free.
+void BlockAllocator::release(blocknum_t block_num)
+{
+  release(&block_num, 1);
+}
+
+// Marks the n blocks in blocks as free.
+void BlockAllocator::release(const blocknum_t *blocks, int n)
+{
+  num_releases++;
+  vector<blocknum_t> sorted(blocks, blocks + n);
+  sort(sorted.begin(), sorted.end());
+
+  // free each run of adjacent used blocks at once
+  size_t i = 0;
+  while (i < sorted.size()) {
+    if (is_free(sorted[i])) {
+      i++;
+      continue;
+    }
+    size_t j = i + 1;
+    while (j < sorted.size() && sorted[j] == sorted[j - 1] + 1 && !is_free(sorted[j])) {
+      j++;
+    }
+    free_run(sorted[i], j - i);
+    num_released += j - i;
+    i = j;
+  }
+}
+
+// Returns true if block_num is not in use.
+bool BlockAllocator::is_free(blocknum_t block_num) const
+{
+  return !(words[block_num / 64] & ((uint64_t) 1 << (block_num % 64)));
+}
+
+// Sets or clears the bits of length blocks starting at start and
+// records the change.
+void BlockAllocator::set_used(blocknum_t start, int length, bool used)
+{
+  for (blocknum_t block_num = start; block_num < start + length; block_num++) {
+    uint64_t mask = (uint64_t) 1 << (block_num % 64);
+    if (used) {
+      words[block_num / 64] |= mask;
+    } else {
+      words[block_num / 64] &= ~mask;
+    }
+    if (block_num == start || block_num % BITS_PER_BITMAP_BLOCK == 0) {
+      dirty_blocks.insert(block_num / BITS_PER_BITMAP_BLOCK);
+    }
+  }
+  free_count += used ? -length : length;
+}
+
+// Adds or removes a free extent in both indexes.
+void BlockAllocator::add_extent(blocknum_t start, int length)
+{
+  free_extents[start] = length;
+  by_length.insert(make_pair(length, start));
+}
+
+void BlockAllocator::remove_extent(extent_iter it)
+{
+  by_length.erase(make_pair(it->second, it->first));
+  free_extents.erase(it);
+}
+
+// Takes length blocks starting at start out of the free extent it.
+void BlockAllocator::take(extent_iter it, blocknum_t start, int length)
+{
+  blocknum_t extent_start = it->first;
+  blocknum_t extent_end = it->first + it->second;
+  remove_extent(it);
+
+  if (start > extent_start) {
+    add_extent(extent_start, start - extent_start);
+  }
+  if (start + length < extent_end) {
+    add_extent(start + length, extent_end - (start + length));
+  }
+  set_used(start, length, true);
+}
+
+// Frees the run of length blocks starting at start, merging it with
+// the free extents on either side.
+void BlockAllocator::free_run(blocknum_t start, int length)
+{
+  set_used(start, length, false);
+
+  extent_iter next = free_extents.lower_bound(start);
+  if (next != free_extents.begin()) {
+    extent_iter prev = next;
+    prev--;
+    if (prev->first + prev->second == start) {
+      start = prev->first;
+      length += prev->second;
+      remove_extent(prev);
+    }
+  }
+  if (next != free_extents.end() && next->first == start + length) {
+    length += next->second;
+    remove_extent(next);
+  }
+  add_extent(start, length);
+}
+
+// Returns the free extent holding block_num, or free_extents.end().
+BlockAllocator::extent_iter BlockAllocator::find_extent(blocknum_t block_num)
+{
+  extent_iter it = free_extents.upper_bound(block_num);
+  if (it == free_extents.begin()) {
+    return free_extents.end();
+  }
+  it--;
+  if (it->first + it->second > block_num) {
+    return it;
+  }
+  return free_extents.end();
+}
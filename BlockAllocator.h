@@ -0,0 +1,125 @@
+// Computing Systems: Block Allocator
+// Keeps the free block bitmap in memory and hands out free blocks.
+
+#ifndef BLOCK_ALLOCATOR_H
+#define BLOCK_ALLOCATOR_H
+
+#include <atomic>
+#include <vector>
+#include <map>
+#include <set>
+#include <utility>
+#include <stdint.h>
+#include <cstddef>
+#include "Blocks.h"
+
+// Where blocks are placed when the goal block is already in use
+enum AllocPolicy {
+  ALLOC_NEAR,		// the first free blocks after the goal
+  ALLOC_SPREAD		// a new run in the middle of the largest free extent
+};
+
+class BlockAllocator {
+
+  public:
+    BlockAllocator();
+
+    // Loads the allocator from an on-disk bitmap describing num_blocks
+    // blocks. Bit i of byte j is set if block j * 8 + i is in use. The
+    // tree of free extents is built from the bitmap.
+    void load(const unsigned char *bitmap, int num_blocks);
+
+    // Copies bitmap block index (the bits of blocks
+    // index * BITS_PER_BITMAP_BLOCK onwards) into the on-disk format used
+    // by load.
+    void store(int index, bitmapblock_t *block) const;
+
+    // Returns the bitmap blocks changed since the last call to
+    // clear_dirty.
+    const std::set<int> &dirty() const { return dirty_blocks; }
+
+    // Forgets which bitmap blocks have changed.
+    void clear_dirty() { dirty_blocks.clear(); }
+
+    // Allocates the first free block at or after goal (wrapping around to
+    // the start of the disk). Returns 0 if the disk is full.
+    blocknum_t allocate(blocknum_t goal = 0);
+
+    // Allocates n blocks and stores them in blocks, in order. Blocks are
+    // taken contiguously starting at goal while it is free; otherwise
+    // policy picks where the next run starts. Either all n blocks are
+    // allocated or none are. Returns false if fewer than n blocks are
+    // free.
+    bool allocate(int n, blocknum_t *blocks, blocknum_t goal = 0,
+                  AllocPolicy policy = ALLOC_NEAR);
+
+    // Allocates a run of n adjacent blocks from the smallest free extent
+    // that holds them and stores its first block in start. Returns false
+    // if no free extent is that long.
+    bool allocate_run(int n, blocknum_t &start);
+
+    // Marks block_num as free.
+    void release(blocknum_t block_num);
+
+    // Marks the n blocks in blocks as free.
+    void release(const blocknum_t *blocks, int n);
+
+    // Returns true if block_num is not in use.
+    bool is_free(blocknum_t block_num) const;
+
+    // Returns the number of free blocks.
+    int num_free() const { return free_count; }
+
+    // Returns the number of free extents.
+    int num_free_extents() const { return free_extents.size(); }
+
+    // Allocator statistics
+    unsigned long allocations() const { return num_allocations; }
+    unsigned long blocks_allocated() const { return num_allocated; }
+    unsigned long releases() const { return num_releases; }
+    unsigned long blocks_released() const { return num_released; }
+    unsigned long extent_lookups() const { return num_extent_lookups; }
+    unsigned long bitmap_scans() const { return num_bitmap_scans; }
+    unsigned long words_scanned() const { return num_words_scanned; }
+
+  private:
+    std::vector<uint64_t> words;	// bitmap, 64 blocks per word
+    int num_blocks;			// number of blocks described
+    int free_count;			// number of clear bits
+    std::set<int> dirty_blocks;		// bitmap blocks changed since stored
+
+    std::atomic<unsigned long> num_allocations;	// calls to allocate
+    std::atomic<unsigned long> num_allocated;	// blocks allocated
+    std::atomic<unsigned long> num_releases;		// calls to release
+    std::atomic<unsigned long> num_released;		// blocks released
+    std::atomic<unsigned long> num_extent_lookups;	// searches of the free extent tree
+    std::atomic<unsigned long> num_bitmap_scans;	// scans of the whole bitmap
+    std::atomic<unsigned long> num_words_scanned;	// bitmap words looked at by scans
+
+    // Free extents indexed by first block (the value is the length) and
+    // by length (to find the largest)
+    std::map<blocknum_t, int> free_extents;
+    std::set<std::pair<int, blocknum_t> > by_length;
+
+    typedef std::map<blocknum_t, int>::iterator extent_iter;
+
+    // Sets or clears the bits of length blocks starting at start and
+    // records the change.
+    void set_used(blocknum_t start, int length, bool used);
+
+    // Adds or removes a free extent in both indexes.
+    void add_extent(blocknum_t start, int length);
+    void remove_extent(extent_iter it);
+
+    // Takes length blocks starting at start out of the free extent it.
+    void take(extent_iter it, blocknum_t start, int length);
+
+    // Frees the run of length blocks starting at start, merging it with
+    // the free extents on either side.
+    void free_run(blocknum_t start, int length);
+
+    // Returns the free extent holding block_num, or free_extents.end().
+    extent_iter find_extent(blocknum_t block_num);
+};
+
+#endif
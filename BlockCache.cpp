@@ -0,0 +1,258 @@
+// Computing Systems: Block Cache
+// Implements an in-memory write-back cache of disk blocks that sits
+// between the basic file system and the disk.
+
+#include <cstring>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+using namespace std;
+
+#include "BlockCache.h"
+
+// Creates a cache in front of disk. The cache starts out disabled
+// (capacity 0) until set_capacity is called.
+BlockCache::BlockCache(Disk *disk)
+  : disk(disk), max_blocks(0), num_hits(0), num_misses(0), num_writebacks(0)
+{
+}
+
+// Sets the maximum number of blocks held in the cache. A capacity of
+// 0 disables caching and makes every access go to the disk. Dirty
+// blocks that no longer fit are written back.
+void BlockCache::set_capacity(int blocks)
+{
+  lock_guard<mutex> guard(lock);
+  max_blocks = (blocks < 0) ? 0 : blocks;
+  shrink(max_blocks);
+}
+
+// Reads block block_num, from the cache if present and from the disk
+// (filling the cache) otherwise.
+void BlockCache::read_block(int block_num, void *block)
+{
+  lock_guard<mutex> guard(lock);
+  Entry *entry = lookup(block_num);
+  if (entry != NULL) {
+    num_hits++;
+    memcpy(block, entry->data, BLOCK_SIZE);
+    return;
+  }
+
+  num_misses++;
+  disk->read_block(block_num, block);
+  if (max_blocks > 0) {
+    entry = insert(block_num);
+    memcpy(entry->data, block, BLOCK_SIZE);
+  }
+}
+
+// Writes block block_num into the cache and marks it dirty. The block
+// reaches the disk when it is evicted or flushed.
+void BlockCache::write_block(int block_num, void *block)
+{
+  lock_guard<mutex> guard(lock);
+  store(block_num, block);
+}
+
+// Reads the n blocks in block_nums into the matching buffers in blocks.
+// Blocks that are not cached are read from the disk together, each run of
+// adjacent blocks with one request.
+void BlockCache::read_blocks(const int *block_nums, void *const *blocks, int n)
+{
+  ReadBatch batch;
+  start_read(batch, block_nums, blocks, n);
+  finish_read(batch);
+}
+
+// Starts reading the n blocks in block_nums into the matching buffers in
+// blocks: cached blocks are copied right away and the others are
+// requested from the disk without waiting for them. finish_read must be
+// called with batch before the buffers are used.
+void BlockCache::start_read(ReadBatch &batch, const int *block_nums, void *const *blocks,
+                            int n)
+{
+  lock_guard<mutex> guard(lock);
+  size_t first_miss = batch.miss_nums.size();
+  for (int i = 0; i < n; i++) {
+    Entry *entry = lookup(block_nums[i]);
+    if (entry != NULL) {
+      num_hits++;
+      memcpy(blocks[i], entry->data, BLOCK_SIZE);
+    } else {
+      batch.miss_nums.push_back(block_nums[i]);
+      batch.miss_blocks.push_back(blocks[i]);
+    }
+  }
+  int misses = batch.miss_nums.size() - first_miss;
+  if (misses > 0) {
+    num_misses += misses;
+    disk->start_read(batch.io, batch.miss_nums.data() + first_miss,
+                     batch.miss_blocks.data() + first_miss, misses);
+  }
+}
+
+// Waits for the disk reads started in batch and caches the blocks read.
+void BlockCache::finish_read(ReadBatch &batch)
+{
+  // the cache is not locked meanwhile: the blocks are not being written
+  // (their readers hold the locks that keep writers out), so they can
+  // only have been cached by another reader in the meantime
+  disk->wait(batch.io);
+
+  lock_guard<mutex> guard(lock);
+  if (max_blocks > 0) {
+    for (size_t i = 0; i < batch.miss_nums.size(); i++) {
+      if (lookup(batch.miss_nums[i]) == NULL) {
+        Entry *entry = insert(batch.miss_nums[i]);
+        memcpy(entry->data, batch.miss_blocks[i], BLOCK_SIZE);
+      }
+    }
+  }
+  batch.miss_nums.clear();
+  batch.miss_blocks.clear();
+}
+
+// Writes the n buffers in blocks to the matching blocks in block_nums.
+void BlockCache::write_blocks(const int *block_nums, void *const *blocks, int n)
+{
+  lock_guard<mutex> guard(lock);
+  if (max_blocks == 0) {
+    disk->write_blocks(block_nums, blocks, n);
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    store(block_nums[i], blocks[i]);
+  }
+}
+
+// Writes any of the n blocks in block_nums that are dirty back to the
+// disk, all at once, so that the disk holds their latest contents. The
+// blocks stay cached.
+void BlockCache::write_back(const int *block_nums, int n)
+{
+  lock_guard<mutex> guard(lock);
+  vector<int> dirty_nums;
+  vector<void *> dirty_blocks;
+  for (int i = 0; i < n; i++) {
+    unordered_map<int, list<Entry>::iterator>::iterator it = index.find(block_nums[i]);
+    if (it != index.end() && it->second->dirty) {
+      dirty_nums.push_back(block_nums[i]);
+      dirty_blocks.push_back(it->second->data);
+      it->second->dirty = false;
+    }
+  }
+  if (!dirty_nums.empty()) {
+    disk->write_blocks(dirty_nums.data(), dirty_blocks.data(), dirty_nums.size());
+    num_writebacks += dirty_nums.size();
+  }
+}
+
+// Writes every dirty block back to the disk.
+void BlockCache::flush()
+{
+  lock_guard<mutex> guard(lock);
+  write_dirty();
+}
+
+// Flushes and drops every cached block.
+void BlockCache::clear()
+{
+  lock_guard<mutex> guard(lock);
+  write_dirty();
+  lru.clear();
+  index.clear();
+}
+
+// Returns the number of blocks cached.
+int BlockCache::size() const
+{
+  lock_guard<mutex> guard(lock);
+  return lru.size();
+}
+
+// Writes every dirty block back to the disk, in block order, with all the
+// requests in flight at once.
+void BlockCache::write_dirty()
+{
+  // write back in block order so adjacent blocks are coalesced
+  vector<Entry *> dirty;
+  for (list<Entry>::iterator it = lru.begin(); it != lru.end(); it++) {
+    if (it->dirty) {
+      dirty.push_back(&*it);
+    }
+  }
+  if (dirty.empty()) {
+    return;
+  }
+  sort(dirty.begin(), dirty.end(),
+       [](const Entry *a, const Entry *b) { return a->block_num < b->block_num; });
+
+  vector<int> block_nums(dirty.size());
+  vector<void *> blocks(dirty.size());
+  for (size_t i = 0; i < dirty.size(); i++) {
+    block_nums[i] = dirty[i]->block_num;
+    blocks[i] = dirty[i]->data;
+    dirty[i]->dirty = false;
+  }
+  disk->write_blocks(block_nums.data(), blocks.data(), dirty.size());
+  num_writebacks += dirty.size();
+}
+
+// Looks up block_num and moves it to the front of the LRU list.
+// Returns NULL if the block is not cached.
+BlockCache::Entry *BlockCache::lookup(int block_num)
+{
+  unordered_map<int, list<Entry>::iterator>::iterator it = index.find(block_num);
+  if (it == index.end()) {
+    return NULL;
+  }
+  lru.splice(lru.begin(), lru, it->second);
+  return &*it->second;
+}
+
+// Adds a new entry for block_num at the front of the LRU list,
+// evicting the least recently used block if the cache is full.
+BlockCache::Entry *BlockCache::insert(int block_num)
+{
+  shrink(max_blocks - 1);
+
+  lru.push_front(Entry());
+  Entry *entry = &lru.front();
+  entry->block_num = block_num;
+  entry->dirty = false;
+  index[block_num] = lru.begin();
+  return entry;
+}
+
+// Evicts least recently used blocks until at most n remain.
+void BlockCache::shrink(int n)
+{
+  while ((int) lru.size() > n && !lru.empty()) {
+    Entry &victim = lru.back();
+    if (victim.dirty) {
+      disk->write_block(victim.block_num, victim.data);
+      num_writebacks++;
+    }
+    index.erase(victim.block_num);
+    lru.pop_back();
+  }
+}
+
+// Writes block block_num into the cache and marks it dirty, or straight
+// to the disk with caching disabled.
+void BlockCache::store(int block_num, void *block)
+{
+  // with caching disabled behave as a write-through layer
+  if (max_blocks == 0) {
+    disk->write_block(block_num, block);
+    return;
+  }
+
+  Entry *entry = lookup(block_num);
+  if (entry == NULL) {
+    entry = insert(block_num);
+  }
+  memcpy(entry->data, block, BLOCK_SIZE);
+  entry->dirty = true;
+}
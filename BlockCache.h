@@ -0,0 +1,121 @@
+// Computing Systems: Block Cache
+// Implements an in-memory write-back cache of disk blocks that sits
+// between the basic file system and the disk. The cache may be used by
+// several threads at once.
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Disk.h"
+#include "Blocks.h"
+
+// Default number of blocks held by the cache
+const int DEFAULT_CACHE_BLOCKS = 128;
+
+// Block reads started by BlockCache::start_read and not yet finished
+struct ReadBatch {
+  IOBatch io;			// disk requests in flight
+  std::vector<int> miss_nums;	// blocks requested from the disk
+  std::vector<void *> miss_blocks;	// buffers they are read into
+};
+
+class BlockCache {
+
+  public:
+    // Creates a cache in front of disk. The cache starts out disabled
+    // (capacity 0) until set_capacity is called.
+    BlockCache(Disk *disk);
+
+    // Sets the maximum number of blocks held in the cache. A capacity of
+    // 0 disables caching and makes every access go to the disk. Dirty
+    // blocks that no longer fit are written back.
+    void set_capacity(int blocks);
+
+    // Reads block block_num, from the cache if present and from the disk
+    // (filling the cache) otherwise.
+    void read_block(int block_num, void *block);
+
+    // Writes block block_num into the cache and marks it dirty. The block
+    // reaches the disk when it is evicted or flushed.
+    void write_block(int block_num, void *block);
+
+    // Reads the n blocks in block_nums into the matching buffers in blocks.
+    // Blocks that are not cached are read from the disk together, each
+    // run of adjacent blocks with one request.
+    void read_blocks(const int *block_nums, void *const *blocks, int n);
+
+    // Starts reading the n blocks in block_nums into the matching buffers
+    // in blocks: cached blocks are copied right away and the others are
+    // requested from the disk without waiting for them. finish_read must
+    // be called with batch before the buffers are used.
+    void start_read(ReadBatch &batch, const int *block_nums, void *const *blocks, int n);
+
+    // Waits for the disk reads started in batch and caches the blocks
+    // read.
+    void finish_read(ReadBatch &batch);
+
+    // Writes the n buffers in blocks to the matching blocks in block_nums.
+    void write_blocks(const int *block_nums, void *const *blocks, int n);
+
+    // Writes any of the n blocks in block_nums that are dirty back to the
+    // disk, all at once, so that the disk holds their latest contents. The
+    // blocks stay cached.
+    void write_back(const int *block_nums, int n);
+
+    // Writes every dirty block back to the disk.
+    void flush();
+
+    // Flushes and drops every cached block.
+    void clear();
+
+    // Cache statistics
+    unsigned long hits() const { return num_hits; }
+    unsigned long misses() const { return num_misses; }
+    unsigned long writebacks() const { return num_writebacks; }
+    int size() const;
+    int capacity() const { return max_blocks; }
+
+  private:
+    // a cached copy of one disk block
+    struct Entry {
+      int block_num;		// block number on disk
+      bool dirty;		// true if the copy is newer than the disk
+      char data[BLOCK_SIZE];	// block contents
+    };
+
+    Disk *disk;			// disk the cache is backed by
+    mutable std::mutex lock;	// guards everything below
+    int max_blocks;		// capacity of the cache in blocks
+    std::list<Entry> lru;	// cached blocks, most recently used first
+    std::unordered_map<int, std::list<Entry>::iterator> index;
+
+    std::atomic<unsigned long> num_hits;	// reads served from the cache
+    std::atomic<unsigned long> num_misses;	// reads that went to the disk
+    std::atomic<unsigned long> num_writebacks;	// dirty blocks written to the disk
+
+    // Looks up block_num and moves it to the front of the LRU list.
+    // Returns NULL if the block is not cached.
+    Entry *lookup(int block_num);
+
+    // Adds a new entry for block_num at the front of the LRU list,
+    // evicting the least recently used block if the cache is full.
+    Entry *insert(int block_num);
+
+    // Evicts least recently used blocks until at most n remain.
+    void shrink(int n);
+
+    // Writes every dirty block back to the disk, in block order, with all
+    // the requests in flight at once.
+    void write_dirty();
+
+    // Writes block block_num into the cache and marks it dirty, or
+    // straight to the disk with caching disabled.
+    void store(int block_num, void *block);
+};
+
+#endif
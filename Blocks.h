@@ -5,51 +5,226 @@
 
 // CONSTANTS
 
-// Size of block - must be an even power of two 
-const int BLOCK_SIZE = 128;
+// Size of block - must be an even power of two (set at build time with
+// make BLOCK_SIZE=<bytes>)
+#ifndef FS_BLOCK_SIZE
+#define FS_BLOCK_SIZE 128
+#endif
+const int BLOCK_SIZE = FS_BLOCK_SIZE;
+
+// Block numbers are 32 bits on disk
+typedef int blocknum_t;
+
+// Default number of blocks for a new disk - one bitmap block's worth
+const int DEFAULT_NUM_BLOCKS = (BLOCK_SIZE * 8);
+
+// Number of blocks whose bits fit in one bitmap block
+const int BITS_PER_BITMAP_BLOCK = (BLOCK_SIZE * 8);
 
-// Number of blocks - set so a bitmap can fit in one block
-const int NUM_BLOCKS = (BLOCK_SIZE * 8);
+// Fixed block locations: the superblock, the root directory and the start
+// of the free block bitmap
+const blocknum_t SUPER_BLOCK = 0;
+const blocknum_t ROOT_BLOCK = 1;
+const blocknum_t BITMAP_START = 2;
 
 // Maximum filename size
 const int MAX_FNAME_SIZE = 9;
 
-// Maximum number of files in a directory
-const int MAX_DIR_ENTRIES = ((BLOCK_SIZE - 8) / 12);
+// Number of entries held in one directory block
+const int DIR_ENTRIES_PER_BLOCK = ((BLOCK_SIZE - 24) / 16);
+
+// Number of block numbers held in a directory index block
+const int DIR_INDEX_ENTRIES = ((BLOCK_SIZE - 4) / 4);
+
+// Maximum number of hash buckets in a directory (two levels of index
+// blocks). Past this, buckets grow longer chains instead of splitting.
+const int MAX_DIR_BUCKETS = (DIR_INDEX_ENTRIES * DIR_INDEX_ENTRIES);
+
+// Number of extents held directly in an inode
+const int INODE_EXTENTS = ((BLOCK_SIZE - 16) / 8);
 
-// Maximum number of blocks in a data file
-const int MAX_DATA_BLOCKS = ((BLOCK_SIZE - 8) / 2);
+// Number of bytes of data held in the inode of an inline file, in place
+// of its extents
+const int INODE_INLINE_SIZE = (INODE_EXTENTS * 8);
+
+// Number of extents held in an indirect extent block
+const int EXTENTS_PER_BLOCK = ((BLOCK_SIZE - 12) / 8);
 
 // Maximum file size for a data file
-const int MAX_FILE_SIZE	= (MAX_DATA_BLOCKS * BLOCK_SIZE);
+const unsigned int MAX_FILE_SIZE = 0xFFFFFFFF;
 
 // Magic numbers - used to distinguish between directory blocks and inodes
 const unsigned int DIR_MAGIC_NUM = 0xFFFFFFFF;
 const unsigned int INODE_MAGIC_NUM = 0xFFFFFFFE;
+const unsigned int EXTENT_MAGIC_NUM = 0xFFFFFFFD;
+const unsigned int DIR_BUCKET_MAGIC_NUM = 0xFFFFFFFC;
+const unsigned int DIR_INDEX_MAGIC_NUM = 0xFFFFFFFB;
+const unsigned int JOURNAL_MAGIC_NUM = 0xFFFFFFFA;
+const unsigned int JOURNAL_DESC_MAGIC_NUM = 0xFFFFFFF9;
+const unsigned int JOURNAL_COMMIT_MAGIC_NUM = 0xFFFFFFF8;
+const unsigned int INODE_INLINE_MAGIC_NUM = 0xFFFFFFF7;
+
+// Number of home block numbers listed in a journal descriptor block
+const int JOURNAL_DESC_ENTRIES = ((BLOCK_SIZE - 12) / 4);
+
+// Number of blocks a file system operation may change without reserving
+// more room in the journal
+const int OP_JOURNAL_BLOCKS = 16;
+
+// Smallest journal: the header and a transaction of twice
+// OP_JOURNAL_BLOCKS blocks, with its descriptors and commit block, so that
+// an operation has room for the blocks of a small write or removal too
+const int MIN_JOURNAL_BLOCKS = 1 + 2 * OP_JOURNAL_BLOCKS +
+  (2 * OP_JOURNAL_BLOCKS + JOURNAL_DESC_ENTRIES - 1) / JOURNAL_DESC_ENTRIES + 1;
+
+// Most snapshots a disk can hold, so that the references to a block
+// count in a byte
+const int MAX_SNAPSHOTS = 255;
+
+// Superblock magic number. Its first byte has bit 0 clear, so it never
+// matches an old-format disk whose block 0 is a bitmap with blocks 0 and
+// 1 marked as used.
+const unsigned int SUPER_MAGIC_NUM = 0x53465342;
+
+// On-disk format version, and the oldest version that can still be
+// mounted. Version 5 directory entries have no type; mounting upgrades
+// the disk to the current version and records the type of every entry. Disks from before version 7 have no journal and
+// keep running without one. Disks from before version 8 have no snapshots
+// until the first one is taken. Files on disks from before version 9 are
+// all block mapped; small files made since keep their data inline.
+const unsigned int FS_VERSION = 9;
+const unsigned int FS_MIN_VERSION = 5;
+
+// Directory entry types
+const unsigned char DIRENT_UNKNOWN = 0;	// not recorded (version 5 entries)
+const unsigned char DIRENT_FILE = 1;	// data file
+const unsigned char DIRENT_DIR = 2;	// directory
 
 // BLOCK TYPES
 
-// Superblock - keeps track of which blocks are used in the filesystem.
+// Superblock - records the geometry of the filesystem.
 // Block 0 is the only super block in the system.
 struct superblock_t {
+  unsigned int magic;		// magic number, must be SUPER_MAGIC_NUM
+  unsigned int version;		// on-disk format version, must be FS_VERSION
+  unsigned int block_size;	// size of a block in bytes
+  unsigned int num_blocks;	// number of blocks in the filesystem
+  unsigned int bitmap_start;	// first block of the free block bitmap
+  unsigned int bitmap_blocks;	// number of blocks in the bitmap
+  unsigned int root_block;	// block of the root directory
+  unsigned int journal_start;	// first block of the journal (0 - none)
+  unsigned int journal_blocks;	// number of blocks in the journal
+  unsigned int snapshot_dir;	// directory of snapshots (0 - none taken yet)
+  unsigned int refcount_start;	// first block of the reference count table
+				// (0 - none taken yet)
+  char unused[BLOCK_SIZE - 44];	// pads the superblock to a full block
+};
+
+// Bitmap block - keeps track of which blocks are used in the filesystem.
+// Bitmap block i covers blocks i * BITS_PER_BITMAP_BLOCK onwards.
+struct bitmapblock_t {
   unsigned char bitmap[BLOCK_SIZE]; // bitmap of free blocks
 };
 
-// Directory block - represents a directory
+// Reference count block - counts the references each block has beyond
+// the first, which it gains when snapshots share it with the live file
+// system. Reference count block i covers blocks i * BLOCK_SIZE onwards.
+struct refcountblock_t {
+  unsigned char refs[BLOCK_SIZE]; // extra references of each block
+};
+
+// Directory entry - a name, the type of file it names and the block it
+// refers to
+struct dirent_t {
+  char name[MAX_FNAME_SIZE + 1]; // file name (extra space for null)
+  unsigned char type;		 // DIRENT_FILE or DIRENT_DIR
+  unsigned char unused;		 // pads the entry to 16 bytes
+  blocknum_t block_num;		 // block number of file (0 - unused)
+};
+
+// Directory block - a block of directory entries. A directory is a hash
+// table of buckets, each a chain of directory blocks. The first block of
+// bucket 0 represents the directory itself: it has magic DIR_MAGIC_NUM
+// and holds the entry count, the bucket index and the parent directory.
+// Every other block has magic DIR_BUCKET_MAGIC_NUM.
 struct dirblock_t {
-  unsigned int magic;		// magic number, must be DIR_MAGIC_NUM
-  unsigned int num_entries;	// number of files in directory
-  struct {
-    char name[MAX_FNAME_SIZE + 1]; // file name (extra space for null)
-    short block_num;		   // block number of file (0 - unused)
-  } dir_entries[MAX_DIR_ENTRIES];  // list of directory entries
+  unsigned int magic;		// DIR_MAGIC_NUM or DIR_BUCKET_MAGIC_NUM
+  unsigned int num_entries;	// number of files in directory (first block)
+  blocknum_t next;		// next block of the same bucket (0 - last)
+  unsigned int num_buckets;	// number of hash buckets (first block)
+  blocknum_t index;		// top index block (0 - only bucket 0)
+  blocknum_t parent;		// parent directory (first block, root - itself)
+  dirent_t dir_entries[DIR_ENTRIES_PER_BLOCK]; // list of directory entries
+  char unused[BLOCK_SIZE - 24 - DIR_ENTRIES_PER_BLOCK * 16]; // pads to a full block
 };
 
-// Inode - index node for a data file
+// Directory index block - maps bucket numbers to their first blocks. The
+// top index block of a directory points to leaf index blocks; bucket i
+// is entry i % DIR_INDEX_ENTRIES of leaf i / DIR_INDEX_ENTRIES.
+struct dirindexblock_t {
+  unsigned int magic;		// magic number, must be DIR_INDEX_MAGIC_NUM
+  blocknum_t blocks[DIR_INDEX_ENTRIES]; // index blocks or bucket blocks
+};
+
+// Extent - a run of contiguous data blocks
+struct extent_t {
+  blocknum_t start;		// first block of the run
+  unsigned int length;		// number of blocks in the run
+};
+
+// Inode - index node for a data file. The data blocks are described by
+// extents in file order: first the ones in the inode, then the ones in
+// the chain of indirect extent blocks. A file of at most
+// INODE_INLINE_SIZE bytes may instead keep its data in the inode, in
+// place of the extents, marked by INODE_INLINE_MAGIC_NUM; it has no
+// extents and no indirect blocks, and the bytes past its end are zero.
 struct inode_t {
-  unsigned int magic;		 // magic number, must be INODE_MAGIC_NUM
+  unsigned int magic;		 // magic number, must be INODE_MAGIC_NUM or
+				 // INODE_INLINE_MAGIC_NUM
   unsigned int size;		 // file size in bytes
-  short blocks[MAX_DATA_BLOCKS]; // array of direct indices to data blocks
+  unsigned int num_extents;	 // number of extents in the whole file
+  blocknum_t indirect;		 // first indirect extent block (0 - none)
+  union {
+    extent_t extents[INODE_EXTENTS]; // first extents of the file
+    char data[INODE_INLINE_SIZE];    // data of an inline file
+  };
+};
+
+// Indirect extent block - holds extents that do not fit in the inode
+struct extentblock_t {
+  unsigned int magic;		// magic number, must be EXTENT_MAGIC_NUM
+  unsigned int num_extents;	// number of extents in this block
+  blocknum_t next;		// next indirect extent block (0 - last)
+  extent_t extents[EXTENTS_PER_BLOCK]; // extents continuing the file
+  char unused[BLOCK_SIZE - 12 - EXTENTS_PER_BLOCK * 8]; // pads to a full block
+};
+
+// Journal header - first block of the journal. Transactions are logged
+// in the blocks after it, the first one numbered sequence and each one
+// after it numbered one higher.
+struct journalheader_t {
+  unsigned int magic;		// magic number, must be JOURNAL_MAGIC_NUM
+  unsigned int sequence;	// sequence number of the first transaction
+  char unused[BLOCK_SIZE - 8];	// pads to a full block
+};
+
+// Journal descriptor block - starts a transaction or continues it. It is
+// followed by copies of the blocks it lists, in order.
+struct journaldescblock_t {
+  unsigned int magic;		// magic number, must be JOURNAL_DESC_MAGIC_NUM
+  unsigned int sequence;	// sequence number of the transaction
+  unsigned int num_blocks;	// number of block copies that follow
+  blocknum_t blocks[JOURNAL_DESC_ENTRIES]; // home block of each copy
+};
+
+// Journal commit block - ends a transaction. A transaction is replayed
+// only if its commit block is found and the checksum matches.
+struct journalcommitblock_t {
+  unsigned int magic;		// magic number, must be JOURNAL_COMMIT_MAGIC_NUM
+  unsigned int sequence;	// sequence number of the transaction
+  unsigned int num_blocks;	// number of block copies in the transaction
+  unsigned int checksum;	// checksum of its descriptors and copies
+  char unused[BLOCK_SIZE - 16];	// pads to a full block
 };
 
 // Data block - stores data for a data file
@@ -57,5 +232,19 @@ struct datablock_t {
   char data[BLOCK_SIZE];	// data (BLOCK_SIZE bytes)
 };
 
+// Every block type must fill exactly one block
+static_assert(sizeof(superblock_t) == BLOCK_SIZE, "superblock_t size");
+static_assert(sizeof(bitmapblock_t) == BLOCK_SIZE, "bitmapblock_t size");
+static_assert(sizeof(refcountblock_t) == BLOCK_SIZE, "refcountblock_t size");
+static_assert(sizeof(dirent_t) == 16, "dirent_t size");
+static_assert(sizeof(dirblock_t) == BLOCK_SIZE, "dirblock_t size");
+static_assert(sizeof(dirindexblock_t) == BLOCK_SIZE, "dirindexblock_t size");
+static_assert(sizeof(inode_t) == BLOCK_SIZE, "inode_t size");
+static_assert(sizeof(extentblock_t) == BLOCK_SIZE, "extentblock_t size");
+static_assert(sizeof(journalheader_t) == BLOCK_SIZE, "journalheader_t size");
+static_assert(sizeof(journaldescblock_t) == BLOCK_SIZE, "journaldescblock_t size");
+static_assert(sizeof(journalcommitblock_t) == BLOCK_SIZE, "journalcommitblock_t size");
+static_assert(sizeof(datablock_t) == BLOCK_SIZE, "datablock_t size");
+
 #endif
 
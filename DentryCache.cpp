@@ -0,0 +1,100 @@
+// Computing Systems: Dentry Cache
+// Remembers the results of looking up names in directories, including
+// names that do not exist, so paths resolve without re-reading every
+// directory along the way.
+
+#include <cstring>
+#include <mutex>
+using namespace std;
+
+#include "DentryCache.h"
+
+// Creates an empty cache holding at most capacity names.
+DentryCache::DentryCache(int capacity)
+  : max_entries(capacity), num_hits(0), num_misses(0)
+{
+}
+
+// Looks up name in directory dir. Returns false if the name is not
+// cached. Otherwise block_num is set to the block the name refers to (0
+// if it is known not to exist) and is_dir to whether that block is a
+// directory.
+bool DentryCache::lookup(blocknum_t dir, const string &name, blocknum_t &block_num, bool &is_dir)
+{
+  lock_guard<mutex> guard(lock);
+  unordered_map<string, list<Entry>::iterator>::iterator it = index.find(key(dir, name));
+  if (it == index.end()) {
+    num_misses++;
+    return false;
+  }
+
+  num_hits++;
+  lru.splice(lru.begin(), lru, it->second);
+  block_num = it->second->block_num;
+  is_dir = it->second->is_dir;
+  return true;
+}
+
+// Records that name in directory dir refers to block_num (0 - does not
+// exist), replacing anything cached for it.
+void DentryCache::insert(blocknum_t dir, const string &name, blocknum_t block_num, bool is_dir)
+{
+  lock_guard<mutex> guard(lock);
+  if (max_entries <= 0) {
+    return;
+  }
+
+  string k = key(dir, name);
+  unordered_map<string, list<Entry>::iterator>::iterator it = index.find(k);
+  if (it != index.end()) {
+    lru.splice(lru.begin(), lru, it->second);
+    it->second->block_num = block_num;
+    it->second->is_dir = is_dir;
+    return;
+  }
+
+  // evict the least recently used name if the cache is full
+  if ((int) lru.size() >= max_entries) {
+    index.erase(key(lru.back().dir, lru.back().name));
+    lru.pop_back();
+  }
+
+  Entry entry;
+  entry.dir = dir;
+  entry.name = name;
+  entry.block_num = block_num;
+  entry.is_dir = is_dir;
+  lru.push_front(entry);
+  index[k] = lru.begin();
+}
+
+// Forgets every name cached for directory dir.
+void DentryCache::forget_dir(blocknum_t dir)
+{
+  lock_guard<mutex> guard(lock);
+  list<Entry>::iterator it = lru.begin();
+  while (it != lru.end()) {
+    if (it->dir == dir) {
+      index.erase(key(it->dir, it->name));
+      it = lru.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+// Forgets every cached name.
+void DentryCache::clear()
+{
+  lock_guard<mutex> guard(lock);
+  lru.clear();
+  index.clear();
+}
+
+// Returns the index key of name in directory dir.
+string DentryCache::key(blocknum_t dir, const string &name)
+{
+  string k(sizeof(dir), '\0');
+  memcpy(&k[0], &dir, sizeof(dir));
+  return k + name;
+}
@@ -0,0 +1,66 @@
+// Computing Systems: Dentry Cache
+// Remembers the results of looking up names in directories, including
+// names that do not exist, so paths resolve without re-reading every
+// directory along the way. The cache may be used by several threads at
+// once.
+
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "Blocks.h"
+
+// Default number of names held in the dentry cache
+const int DEFAULT_DENTRY_CACHE_SIZE = 1024;
+
+class DentryCache {
+
+  public:
+    // Creates an empty cache holding at most capacity names.
+    DentryCache(int capacity = DEFAULT_DENTRY_CACHE_SIZE);
+
+    // Looks up name in directory dir. Returns false if the name is not
+    // cached. Otherwise block_num is set to the block the name refers to
+    // (0 if it is known not to exist) and is_dir to whether that block is
+    // a directory.
+    bool lookup(blocknum_t dir, const std::string &name, blocknum_t &block_num, bool &is_dir);
+
+    // Records that name in directory dir refers to block_num (0 - does not
+    // exist), replacing anything cached for it.
+    void insert(blocknum_t dir, const std::string &name, blocknum_t block_num, bool is_dir);
+
+    // Forgets every name cached for directory dir.
+    void forget_dir(blocknum_t dir);
+
+    // Forgets every cached name.
+    void clear();
+
+    // Statistics
+    unsigned long hits() const { return num_hits; }
+    unsigned long misses() const { return num_misses; }
+
+  private:
+    // A cached name
+    struct Entry {
+      blocknum_t dir;		// directory holding the name
+      std::string name;		// name within the directory
+      blocknum_t block_num;	// block the name refers to (0 - none)
+      bool is_dir;		// true if block_num is a directory
+    };
+
+    std::mutex lock;		// guards everything below
+    int max_entries;		// maximum number of entries held
+    std::list<Entry> lru;	// entries, most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index; // key to entry
+    std::atomic<unsigned long> num_hits;	// lookups answered from the cache
+    std::atomic<unsigned long> num_misses;	// lookups not in the cache
+
+    // Returns the index key of name in directory dir.
+    static std::string key(blocknum_t dir, const std::string &name);
+};
+
+#endif
@@ -0,0 +1,409 @@
+// Computing Systems: Directory
+// Stores the entries of a directory in a linear hash table whose
+// buckets are chains of directory blocks, so a directory can grow to
+// any number of entries with constant-time lookup, insert and delete.
+
+#include <cstring>
+#include <algorithm>
+using namespace std;
+
+#include "Directory.h"
+
+// Returns the FNV-1a hash of name.
+static unsigned int hash_name(const char *name)
+{
+  unsigned int hash = 2166136261u;
+  for (const char *c = name; *c != '\0'; c++) {
+    hash ^= (unsigned char) *c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Returns the largest power of two that is at most n.
+static unsigned int low_power(unsigned int n)
+{
+  unsigned int low = 1;
+  while (low * 2 <= n) {
+    low *= 2;
+  }
+  return low;
+}
+
+// Initializes dir_block as an empty block of a bucket chain.
+static void init_bucket_block(dirblock_t &dir_block)
+{
+  memset(&dir_block, 0, sizeof(dir_block));
+  dir_block.magic = DIR_BUCKET_MAGIC_NUM;
+}
+
+// Opens the directory whose first block is block_num.
+Directory::Directory(BasicFileSys &bfs, blocknum_t block_num)
+  : bfs(bfs), head_block(block_num)
+{
+  bfs.read_block(head_block, (void *) &head);
+}
+
+// Writes an empty directory with a single bucket to block_num, as a
+// child of directory parent.
+void Directory::init(BasicFileSys &bfs, blocknum_t block_num, blocknum_t parent)
+{
+  struct dirblock_t dir_block;
+  memset(&dir_block, 0, sizeof(dir_block));
+  dir_block.magic = DIR_MAGIC_NUM;
+  dir_block.num_buckets = 1;
+  dir_block.parent = parent;
+  bfs.write_block(block_num, (void *) &dir_block);
+}
+
+// Returns the block of the entry called name, or 0 if there is none,
+// and sets type to the type recorded in the entry.
+blocknum_t Directory::lookup(const char *name, unsigned char &type)
+{
+  struct dirblock_t dir_block;
+  blocknum_t block_num;
+  int slot;
+  if (!find(name, block_num, slot, dir_block)) {
+    return 0;
+  }
+  type = dir_block.dir_entries[slot].type;
+  return dir_block.dir_entries[slot].block_num;
+}
+
+// Adds an entry called name of type type for block_num. The name must
+// not already be in the directory. Returns false if the disk has no room for
+// another directory block.
+bool Directory::add(const char *name, blocknum_t block_num, unsigned char type)
+{
+  // take the first free slot in the bucket's chain
+  struct dirblock_t dir_block;
+  blocknum_t b = bucket_block(bucket_of(name));
+  int slot = -1;
+  while (true) {
+    read_dir_block(b, dir_block);
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK && slot < 0; i++) {
+      if (dir_block.dir_entries[i].block_num == 0) {
+        slot = i;
+      }
+    }
+    if (slot >= 0 || dir_block.next == 0) {
+      break;
+    }
+    b = dir_block.next;
+  }
+
+  // every slot is taken, so extend the chain by a block
+  if (slot < 0) {
+    blocknum_t new_block = bfs.get_free_block(b);
+    if (new_block == 0) {
+      return false;
+    }
+    dir_block.next = new_block;
+    write_dir_block(b, dir_block);
+
+    init_bucket_block(dir_block);
+    b = new_block;
+    slot = 0;
+  }
+
+  strcpy(dir_block.dir_entries[slot].name, name);
+  dir_block.dir_entries[slot].type = type;
+  dir_block.dir_entries[slot].block_num = block_num;
+  write_dir_block(b, dir_block);
+
+  head.num_entries++;
+  write_dir_block(head_block, head);
+
+  // keep about one block of entries per bucket
+  if (head.num_entries > head.num_buckets * DIR_ENTRIES_PER_BLOCK &&
+      head.num_buckets < (unsigned int) MAX_DIR_BUCKETS) {
+    split();
+  }
+  return true;
+}
+
+// Records the type of the entry called name, for entries written before
+// types were recorded.
+void Directory::set_type(const char *name, unsigned char type)
+{
+  struct dirblock_t dir_block;
+  blocknum_t b;
+  int slot;
+  if (find(name, b, slot, dir_block)) {
+    dir_block.dir_entries[slot].type = type;
+    write_dir_block(b, dir_block);
+  }
+}
+
+// Removes the entry called name, leaving its slot free for reuse.
+// Returns the block of the entry, or 0 if there is none.
+blocknum_t Directory::remove(const char *name)
+{
+  struct dirblock_t dir_block;
+  blocknum_t b;
+  int slot;
+  if (!find(name, b, slot, dir_block)) {
+    return 0;
+  }
+
+  blocknum_t block_num = dir_block.dir_entries[slot].block_num;
+  memset(&dir_block.dir_entries[slot], 0, sizeof(dirent_t));
+  write_dir_block(b, dir_block);
+
+  head.num_entries--;
+  write_dir_block(head_block, head);
+  return block_num;
+}
+
+// Appends every entry, in hash order, to entries.
+void Directory::entries(vector<dirent_t> &entries)
+{
+  vector<blocknum_t> buckets;
+  bucket_blocks(buckets);
+
+  for (size_t i = 0; i < buckets.size(); i++) {
+    for (blocknum_t b = buckets[i]; b != 0; ) {
+      struct dirblock_t dir_block;
+      read_dir_block(b, dir_block);
+      for (int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+        if (dir_block.dir_entries[j].block_num != 0) {
+          entries.push_back(dir_block.dir_entries[j]);
+        }
+      }
+      b = dir_block.next;
+    }
+  }
+}
+
+// Appends every block used by the directory, bucket blocks and index
+// blocks, to blocks.
+void Directory::all_blocks(vector<blocknum_t> &blocks)
+{
+  vector<blocknum_t> buckets;
+  bucket_blocks(buckets);
+
+  for (size_t i = 0; i < buckets.size(); i++) {
+    for (blocknum_t b = buckets[i]; b != 0; ) {
+      struct dirblock_t dir_block;
+      read_dir_block(b, dir_block);
+      blocks.push_back(b);
+      b = dir_block.next;
+    }
+  }
+
+  if (head.index != 0) {
+    struct dirindexblock_t top;
+    bfs.read_block(head.index, (void *) &top);
+    int num_leaves = (head.num_buckets + DIR_INDEX_ENTRIES - 1) / DIR_INDEX_ENTRIES;
+    blocks.insert(blocks.end(), top.blocks, top.blocks + num_leaves);
+    blocks.push_back(head.index);
+  }
+}
+
+// Marks the directory as removed, so that a thread that found it just
+// before it was removed sees that it is gone.
+void Directory::invalidate()
+{
+  struct dirblock_t dir_block = head;
+  dir_block.magic = 0;
+  bfs.write_block(head_block, (void *) &dir_block);
+}
+
+// Returns the bucket that holds name. Buckets below the split point
+// have already been split, so they use one more bit of the hash.
+unsigned int Directory::bucket_of(const char *name) const
+{
+  unsigned int hash = hash_name(name);
+  unsigned int low = low_power(head.num_buckets);
+  unsigned int bucket = hash % low;
+  if (bucket < head.num_buckets - low) {
+    bucket = hash % (2 * low);
+  }
+  return bucket;
+}
+
+// Returns the first block of bucket.
+blocknum_t Directory::bucket_block(unsigned int bucket)
+{
+  if (head.index == 0) {
+    return head_block;
+  }
+
+  struct dirindexblock_t index_block;
+  bfs.read_block(head.index, (void *) &index_block);
+  bfs.read_block(index_block.blocks[bucket / DIR_INDEX_ENTRIES], (void *) &index_block);
+  return index_block.blocks[bucket % DIR_INDEX_ENTRIES];
+}
+
+// Appends the first block of every bucket, in bucket order, to blocks.
+void Directory::bucket_blocks(vector<blocknum_t> &blocks)
+{
+  if (head.index == 0) {
+    blocks.push_back(head_block);
+    return;
+  }
+
+  struct dirindexblock_t top;
+  bfs.read_block(head.index, (void *) &top);
+  for (unsigned int first = 0; first < head.num_buckets; first += DIR_INDEX_ENTRIES) {
+    struct dirindexblock_t leaf;
+    bfs.read_block(top.blocks[first / DIR_INDEX_ENTRIES], (void *) &leaf);
+    unsigned int count = min(head.num_buckets - first, (unsigned int) DIR_INDEX_ENTRIES);
+    blocks.insert(blocks.end(), leaf.blocks, leaf.blocks + count);
+  }
+}
+
+// Finds the entry called name. On success the block holding it is left
+// in dir_block and its number and slot are stored in block_num and
+// slot.
+bool Directory::find(const char *name, blocknum_t &block_num, int &slot, dirblock_t &dir_block)
+{
+  for (blocknum_t b = bucket_block(bucket_of(name)); b != 0; b = dir_block.next) {
+    read_dir_block(b, dir_block);
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+      if (dir_block.dir_entries[i].block_num != 0 &&
+          strcmp(dir_block.dir_entries[i].name, name) == 0) {
+        block_num = b;
+        slot = i;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Reads or writes a directory block, keeping the copy of the first
+// block up to date.
+void Directory::read_dir_block(blocknum_t block_num, dirblock_t &dir_block)
+{
+  if (block_num == head_block) {
+    dir_block = head;
+  } else {
+    bfs.read_block(block_num, (void *) &dir_block);
+  }
+}
+
+void Directory::write_dir_block(blocknum_t block_num, dirblock_t &dir_block)
+{
+  if (block_num == head_block && &dir_block != &head) {
+    head = dir_block;
+  }
+  bfs.write_block(block_num, (void *) &dir_block);
+}
+
+// Adds a bucket by splitting the next bucket in turn. The directory is
+// left as it is if the disk is full or the journal has no room for the
+// split now; a later add tries again.
+void Directory::split()
+{
+  // bucket from is split into itself and the new bucket, using one more
+  // bit of the hash
+  unsigned int new_bucket = head.num_buckets;
+  unsigned int low = low_power(new_bucket);
+  unsigned int from = new_bucket - low;
+
+  // read the chain being split and sort its entries
+  vector<blocknum_t> chain;
+  vector<dirent_t> stay, move;
+  struct dirblock_t dir_block;
+  for (blocknum_t b = bucket_block(from); b != 0; b = dir_block.next) {
+    read_dir_block(b, dir_block);
+    chain.push_back(b);
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+      dirent_t &entry = dir_block.dir_entries[i];
+      if (entry.block_num == 0) {
+        continue;
+      }
+      if (hash_name(entry.name) % (2 * low) == new_bucket) {
+        move.push_back(entry);
+      } else {
+        stay.push_back(entry);
+      }
+    }
+  }
+
+  // allocate the new chain and any index blocks it needs in one go
+  int new_blocks = max((size_t) 1, (move.size() + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK);
+  int index_blocks = 0;
+  if (head.index == 0) {
+    index_blocks = 2;
+  } else if (new_bucket % DIR_INDEX_ENTRIES == 0) {
+    index_blocks = 1;
+  }
+  // the old chain, the new one, the index, the head and the bitmap change
+  int changes = chain.size() + new_blocks + index_blocks + 2 +
+                bfs.bitmap_op_blocks(chain.size() + new_blocks + index_blocks);
+  if (!bfs.extend_op(changes)) {
+    return;
+  }
+  vector<blocknum_t> blocks(new_blocks + index_blocks);
+  if (!bfs.get_free_blocks(blocks.size(), blocks.data(), chain.back())) {
+    return;
+  }
+
+  // write the new chain
+  for (int b = 0; b < new_blocks; b++) {
+    init_bucket_block(dir_block);
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+      size_t e = b * DIR_ENTRIES_PER_BLOCK + i;
+      if (e < move.size()) {
+        dir_block.dir_entries[i] = move[e];
+      }
+    }
+    dir_block.next = (b + 1 < new_blocks) ? blocks[b + 1] : 0;
+    write_dir_block(blocks[b], dir_block);
+  }
+
+  // rewrite the old chain with the remaining entries packed at the front
+  // and give back the blocks it no longer needs
+  size_t keep = max((size_t) 1, (stay.size() + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK);
+  for (size_t b = 0; b < keep; b++) {
+    read_dir_block(chain[b], dir_block);
+    memset(dir_block.dir_entries, 0, sizeof(dir_block.dir_entries));
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+      size_t e = b * DIR_ENTRIES_PER_BLOCK + i;
+      if (e < stay.size()) {
+        dir_block.dir_entries[i] = stay[e];
+      }
+    }
+    dir_block.next = (b + 1 < keep) ? chain[b + 1] : 0;
+    write_dir_block(chain[b], dir_block);
+  }
+  if (chain.size() > keep) {
+    bfs.reclaim_blocks(chain.data() + keep, chain.size() - keep);
+  }
+
+  // record the new bucket in the index, creating the top and first leaf
+  // when the directory first grows past one bucket
+  struct dirindexblock_t top, leaf;
+  blocknum_t leaf_block;
+  if (head.index == 0) {
+    memset(&top, 0, sizeof(top));
+    top.magic = DIR_INDEX_MAGIC_NUM;
+    leaf_block = blocks[new_blocks + 1];
+    top.blocks[0] = leaf_block;
+    bfs.write_block(blocks[new_blocks], (void *) &top);
+    head.index = blocks[new_blocks];
+
+    memset(&leaf, 0, sizeof(leaf));
+    leaf.magic = DIR_INDEX_MAGIC_NUM;
+    leaf.blocks[0] = head_block;
+  } else if (index_blocks == 1) {
+    bfs.read_block(head.index, (void *) &top);
+    leaf_block = blocks[new_blocks];
+    top.blocks[new_bucket / DIR_INDEX_ENTRIES] = leaf_block;
+    bfs.write_block(head.index, (void *) &top);
+
+    memset(&leaf, 0, sizeof(leaf));
+    leaf.magic = DIR_INDEX_MAGIC_NUM;
+  } else {
+    bfs.read_block(head.index, (void *) &top);
+    leaf_block = top.blocks[new_bucket / DIR_INDEX_ENTRIES];
+    bfs.read_block(leaf_block, (void *) &leaf);
+  }
+  leaf.blocks[new_bucket % DIR_INDEX_ENTRIES] = blocks[0];
+  bfs.write_block(leaf_block, (void *) &leaf);
+
+  head.num_buckets++;
+  write_dir_block(head_block, head);
+}
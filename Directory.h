@@ -0,0 +1,88 @@
+// Computing Systems: Directory
+// Stores the entries of a directory in a linear hash table whose
+// buckets are chains of directory blocks, so a directory can grow to
+// any number of entries with constant-time lookup, insert and delete.
+
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <vector>
+#include "BasicFileSys.h"
+#include "Blocks.h"
+
+class Directory {
+
+  public:
+    // Opens the directory whose first block is block_num.
+    Directory(BasicFileSys &bfs, blocknum_t block_num);
+
+    // Writes an empty directory with a single bucket to block_num, as a
+    // child of directory parent.
+    static void init(BasicFileSys &bfs, blocknum_t block_num, blocknum_t parent);
+
+    // Returns the number of entries in the directory.
+    unsigned int size() const { return head.num_entries; }
+
+    // Returns the parent directory (the root directory is its own parent).
+    blocknum_t parent() const { return head.parent; }
+
+    // Returns the block of the entry called name, or 0 if there is none,
+    // and sets type to the type recorded in the entry.
+    blocknum_t lookup(const char *name, unsigned char &type);
+
+    // Adds an entry called name of type type for block_num. The name must
+    // not already be in the directory. Returns false if the disk has no room for
+    // another directory block.
+    bool add(const char *name, blocknum_t block_num, unsigned char type);
+
+    // Records the type of the entry called name, for entries written before
+    // types were recorded.
+    void set_type(const char *name, unsigned char type);
+
+    // Removes the entry called name, leaving its slot free for reuse.
+    // Returns the block of the entry, or 0 if there is none.
+    blocknum_t remove(const char *name);
+
+    // Appends every entry, in hash order, to entries.
+    void entries(std::vector<dirent_t> &entries);
+
+    // Appends every block used by the directory, bucket blocks and index
+    // blocks, to blocks.
+    void all_blocks(std::vector<blocknum_t> &blocks);
+
+    // Marks the directory as removed, so that a thread that found it just
+    // before it was removed sees that it is gone.
+    void invalidate();
+
+  private:
+    BasicFileSys &bfs;		// basic file system
+    blocknum_t head_block;	// first block of the directory
+    dirblock_t head;		// copy of the first block
+
+    // Returns the bucket that holds name.
+    unsigned int bucket_of(const char *name) const;
+
+    // Returns the first block of bucket.
+    blocknum_t bucket_block(unsigned int bucket);
+
+    // Appends the first block of every bucket, in bucket order, to
+    // blocks.
+    void bucket_blocks(std::vector<blocknum_t> &blocks);
+
+    // Finds the entry called name. On success the block holding it is
+    // left in dir_block and its number and slot are stored in block_num
+    // and slot.
+    bool find(const char *name, blocknum_t &block_num, int &slot, dirblock_t &dir_block);
+
+    // Reads or writes a directory block, keeping the copy of the first
+    // block up to date.
+    void read_dir_block(blocknum_t block_num, dirblock_t &dir_block);
+    void write_dir_block(blocknum_t block_num, dirblock_t &dir_block);
+
+    // Adds a bucket by splitting the next bucket in turn. The directory
+    // is left as it is if the disk is full or the journal has no room for
+    // the split now; a later add tries again.
+    void split();
+};
+
+#endif
@@ -3,58 +3,115 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <cerrno>
+#include <climits>
 #include <unistd.h>
 #include <fcntl.h>
+#include <cstring>
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
+#include <vector>
 using namespace std;
 
 #include "Disk.h"
 #include "Blocks.h"
 
+// Blocks read and written by each thread
+static thread_local unsigned long thread_reads = 0;
+static thread_local unsigned long thread_writes = 0;
+
+// Creates a disk that is not yet mounted.
+Disk::Disk() : fd(-1), mode(DISK_MODE_IO), map(NULL), num_blocks(0), engine(NULL),
+                 num_reads(0), num_writes(0)
+{
+}
+
 // Opens the file "file_name" that represents the disk.  If the file does
-// not exist, file is created. Returns true if a file is created and false if
-// the file parameter fd exists. Any other error aborts the program.
-bool Disk::mount(const char *file_name)
+// not exist, a sparse file is created with room for new_blocks blocks
+// (all of them reading as zeros). Returns true if a file is created
+// and false if the file parameter fd exists. Any other error aborts
+// the program. In DISK_MODE_MMAP the whole file is mapped into memory;
+// otherwise an I/O engine is started, using io_uring if use_uring is set
+// and the kernel supports it.
+bool Disk::mount(const char *file_name, DiskMode mode, int new_blocks, bool use_uring)
 {
-  fd = open(file_name, O_RDWR);
-  if (fd != -1) return false;
+  bool created = false;
+  this->mode = mode;
 
-  fd = open(file_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  fd = open(file_name, O_RDWR);
   if (fd == -1) {
-    cerr << "Could not create disk" << endl;
-    exit(-1);
+    fd = open(file_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      cerr << "Could not create disk" << endl;
+      exit(-1);
+    }
+    created = true;
   }
 
-  return true;
+  // an existing disk is as large as its file; a new one is sized
+  // without writing its blocks, leaving a sparse file that reads as zeros
+  if (created) {
+    num_blocks = new_blocks;
+    if (ftruncate(fd, (off_t) num_blocks * BLOCK_SIZE) == -1) {
+      cerr << "Could not size disk" << endl;
+      exit(-1);
+    }
+  } else {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      cerr << "Could not size disk" << endl;
+      exit(-1);
+    }
+    num_blocks = st.st_size / BLOCK_SIZE;
+  }
+
+  if (mode == DISK_MODE_MMAP) {
+    off_t disk_size = (off_t) num_blocks * BLOCK_SIZE;
+    void *addr = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      cerr << "Could not map disk" << endl;
+      exit(-1);
+    }
+    map = (char *) addr;
+  } else {
+    engine = IOEngine::create(fd, DISK_QUEUE_DEPTH, use_uring);
+  }
+
+  return created;
 }
 
-// Closes the file descriptor that represents the disk.
+// Closes the file descriptor that represents the disk. A mapped disk
+// is synced and unmapped first; the I/O engine is stopped.
 void Disk::unmount()
 {
+  if (map != NULL) {
+    sync();
+    munmap(map, (size_t) num_blocks * BLOCK_SIZE);
+    map = NULL;
+  }
+  delete engine;
+  engine = NULL;
   close(fd);
+  fd = -1;
 }
   
 // Reads disk block block_num from the disk into block.
 void Disk::read_block(int block_num, void *block)
 {
-  off_t offset;
-  off_t new_offset;
-  ssize_t size; 
+  check_block(block_num);
+  num_reads++;
+  thread_reads++;
 
-  if (block_num < 0 || block_num >= NUM_BLOCKS) {
-    cerr << "Invalid block number" << endl;
-    exit(-1);
+  if (map != NULL) {
+    memcpy(block, map + (size_t) block_num * BLOCK_SIZE, BLOCK_SIZE);
+    return;
   }
 
-  offset = block_num * BLOCK_SIZE;
-  new_offset = lseek(fd, offset, SEEK_SET);
-  if (offset != new_offset) {
-    cerr << "Seek failure" << endl;
-    exit(-1);
-  }
-
-  size = read(fd, block, BLOCK_SIZE);
+  ssize_t size = pread(fd, block, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
   if (size != BLOCK_SIZE) {
     cerr << "Failed to read entire block" << endl;
     exit(-1);
@@ -64,25 +121,242 @@ void Disk::read_block(int block_num, void *block)
 // Writes the data in block to disk block block_num.
 void Disk::write_block(int block_num, void *block)
 {
-  off_t offset;
-  off_t new_offset;
-  ssize_t size; 
+  check_block(block_num);
+  num_writes++;
+  thread_writes++;
 
-  if (block_num < 0 || block_num >= NUM_BLOCKS) {
-    cerr << "Invalid block number" << endl;
+  if (map != NULL) {
+    memcpy(map + (size_t) block_num * BLOCK_SIZE, block, BLOCK_SIZE);
+    return;
+  }
+
+  ssize_t size = pwrite(fd, block, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
+  if (size != BLOCK_SIZE) {
+    cerr << "Failed to write entire block" << endl;
     exit(-1);
   }
+}
+
+// Reads the n disk blocks in block_nums into the matching buffers in
+// blocks. Runs of adjacent block numbers are read with one request, and
+// all the requests are in flight at once.
+void Disk::read_blocks(const int *block_nums, void *const *blocks, int n)
+{
+  IOBatch batch;
+  start(batch, false, block_nums, blocks, n);
+  wait(batch);
+}
+
+// Writes the n buffers in blocks to the matching disk blocks in
+// block_nums. Runs of adjacent block numbers are written with one
+// request, and all the requests are in flight at once.
+void Disk::write_blocks(const int *block_nums, void *const *blocks, int n)
+{
+  IOBatch batch;
+  start(batch, true, block_nums, blocks, n);
+  wait(batch);
+}
+
+// Starts reading the n disk blocks in block_nums into the matching buffers
+// in blocks, adding the requests to batch without waiting for them. The
+// buffers are filled once wait returns for batch.
+void Disk::start_read(IOBatch &batch, const int *block_nums, void *const *blocks, int n)
+{
+  start(batch, false, block_nums, blocks, n);
+}
+
+// Starts writing the n buffers in blocks to the matching disk blocks in
+// block_nums, adding the requests to batch without waiting for them. The
+// buffers must not change until wait returns for batch.
+void Disk::start_write(IOBatch &batch, const int *block_nums, void *const *blocks, int n)
+{
+  start(batch, true, block_nums, blocks, n);
+}
+
+// Waits for every request of batch to complete, leaving batch empty. A
+// request that failed aborts the program.
+void Disk::wait(IOBatch &batch)
+{
+  if (engine != NULL) {
+    engine->wait(batch);
+  }
+
+  // a request may be cut short (by a signal, say); the rest of it is
+  // moved here
+  for (size_t i = 0; i < batch.requests.size(); i++) {
+    IORequest &request = batch.requests[i];
+    struct iovec *iov = request.iov.data();
+    int count = request.iov.size();
+    off_t offset = request.offset;
+    size_t left = request.size;
+    ssize_t size = request.result;
+    if (size == -EINTR || size == -EAGAIN) {
+      size = 0;
+    }
+    while (size >= 0 && (size_t) size < left) {
+      // skip what has been moved
+      offset += size;
+      left -= size;
+      while (size > 0) {
+        size_t step = min((size_t) size, iov->iov_len);
+        iov->iov_base = (char *) iov->iov_base + step;
+        iov->iov_len -= step;
+        size -= step;
+        if (iov->iov_len == 0) {
+          iov++;
+          count--;
+        }
+      }
+      size = request.write ? pwritev(fd, iov, count, offset) : preadv(fd, iov, count, offset);
+      if (size == -1 && errno == EINTR) {
+        size = 0;
+      } else if (size <= 0) {
+        size = -1;
+      }
+    }
+    if (size < 0) {
+      cerr << (request.write ? "Failed to write entire block" : "Failed to read entire block")
+           << endl;
+      exit(-1);
+    }
+  }
+  batch.requests.clear();
+}
+
+// Copies len bytes, starting offset bytes into block block_num, from the
+// disk file to out_fd inside the kernel (sendfile). Returns false, having
+// written nothing, if out_fd is not a regular file.
+bool Disk::send(int out_fd, int block_num, unsigned int offset, size_t len)
+{
+  check_block(block_num);
+  check_block(block_num + (offset + len - 1) / BLOCK_SIZE);
+
+  // sendfile into a pipe or socket passes references to the disk file's
+  // pages, so later writes to these blocks could change bytes not yet
+  // read from the other end; only a regular file gets a copy
+  struct stat st;
+  if (fstat(out_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
 
-  offset = block_num * BLOCK_SIZE;
-  new_offset = lseek(fd, offset, SEEK_SET);
-  if (offset != new_offset) {
-    cerr << "Seek failure" << endl;
+  // a shared mapping and the file are kept coherent by the kernel, so
+  // mapped disks can be sent from the file as well
+  num_reads += (offset + len - 1) / BLOCK_SIZE + 1;
+  thread_reads += (offset + len - 1) / BLOCK_SIZE + 1;
+  off_t pos = (off_t) block_num * BLOCK_SIZE + offset;
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t size = sendfile(out_fd, fd, &pos, len - sent);
+    if (size == -1 && errno == EINTR) {
+      continue;
+    }
+    if (size == -1 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+      return false;
+    }
+    if (size <= 0) {
+      cerr << "Failed to send blocks" << endl;
+      exit(-1);
+    }
+    sent += size;
+  }
+  return true;
+}
+
+// Forces written blocks to stable storage (msync or fsync).
+void Disk::sync()
+{
+  int result;
+  if (map != NULL) {
+    result = msync(map, (size_t) num_blocks * BLOCK_SIZE, MS_SYNC);
+  } else {
+    result = fsync(fd);
+  }
+  if (result == -1) {
+    cerr << "Failed to sync disk" << endl;
     exit(-1);
   }
+}
 
-  size = write(fd, block, BLOCK_SIZE);
-  if (size != BLOCK_SIZE) {
-    cerr << "Failed to write entire block" << endl;
+// Adds requests reading (or writing, if write is set) the n blocks in
+// block_nums to batch and submits them.
+void Disk::start(IOBatch &batch, bool write, const int *block_nums, void *const *blocks,
+                 int n)
+{
+  if (write) {
+    num_writes += n;
+    thread_writes += n;
+  } else {
+    num_reads += n;
+    thread_reads += n;
+  }
+
+  vector<IORequest *> requests;
+  for (int i = 0; i < n; ) {
+    int run = run_length(block_nums + i, n - i);
+
+    // a mapped disk is copied right away
+    if (map != NULL) {
+      for (int j = 0; j < run; j++) {
+        char *disk_block = map + (size_t) block_nums[i + j] * BLOCK_SIZE;
+        if (write) {
+          memcpy(disk_block, blocks[i + j], BLOCK_SIZE);
+        } else {
+          memcpy(blocks[i + j], disk_block, BLOCK_SIZE);
+        }
+      }
+    } else {
+      batch.requests.push_back(IORequest());
+      IORequest &request = batch.requests.back();
+      request.write = write;
+      request.offset = (off_t) block_nums[i] * BLOCK_SIZE;
+      request.iov.resize(run);
+      for (int j = 0; j < run; j++) {
+        request.iov[j].iov_base = blocks[i + j];
+        request.iov[j].iov_len = BLOCK_SIZE;
+      }
+      request.size = (size_t) run * BLOCK_SIZE;
+      request.result = 0;
+      request.batch = &batch;
+      requests.push_back(&request);
+    }
+
+    i += run;
+  }
+  if (!requests.empty()) {
+    engine->submit(requests.data(), requests.size());
+  }
+}
+
+// Returns the blocks read by the calling thread, on any disk.
+unsigned long Disk::thread_blocks_read()
+{
+  return thread_reads;
+}
+
+// Returns the blocks written by the calling thread, on any disk.
+unsigned long Disk::thread_blocks_written()
+{
+  return thread_writes;
+}
+
+// Aborts the program if block_num is not on the disk.
+void Disk::check_block(int block_num)
+{
+  if (block_num < 0 || block_num >= num_blocks) {
+    cerr << "Invalid block number" << endl;
     exit(-1);
   }
 }
+
+// Returns the number of blocks, at most IOV_MAX, that form a run of
+// adjacent block numbers at the start of block_nums.
+int Disk::run_length(const int *block_nums, int n)
+{
+  check_block(block_nums[0]);
+  int run = 1;
+  while (run < n && run < IOV_MAX && block_nums[run] == block_nums[run - 1] + 1) {
+    check_block(block_nums[run]);
+    run++;
+  }
+  return run;
+}
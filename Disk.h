@@ -4,15 +4,35 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <atomic>
+#include "IOEngine.h"
+
+// Number of requests the disk keeps in flight at once
+const int DISK_QUEUE_DEPTH = 64;
+
+// How blocks are moved between memory and the disk file
+enum DiskMode {
+  DISK_MODE_IO,		// reads and writes through an I/O engine
+  DISK_MODE_MMAP	// disk file mapped into memory
+};
+
 class Disk {
 
   public:
+    // Creates a disk that is not yet mounted.
+    Disk();
+
     // Opens the file "file_name" that represents the disk.  If the file does
-    // not exist, file is created. Returns true if a file is created and false if
-    // the file parameter fd exists. Any other error aborts the program.
-    bool mount(const char *filename);
+    // not exist, a sparse file is created with room for new_blocks blocks
+    // (all of them reading as zeros). Returns true if a file is created
+    // and false if the file parameter fd exists. Any other error aborts
+    // the program. In DISK_MODE_MMAP the whole file is mapped into memory;
+    // otherwise an I/O engine is started, using io_uring if use_uring is
+    // set and the kernel supports it.
+    bool mount(const char *filename, DiskMode mode, int new_blocks, bool use_uring = true);
 
-    // Closes the file descriptor that represents the disk.
+    // Closes the file descriptor that represents the disk. A mapped disk
+    // is synced and unmapped first; the I/O engine is stopped.
     void unmount();
   
     // Reads disk block block_num from the disk into block.
@@ -21,8 +41,72 @@ class Disk {
     // Writes the data in block to disk block block_num.
     void write_block(int block_num, void *block);
 
+    // Reads the n disk blocks in block_nums into the matching buffers in
+    // blocks. Runs of adjacent block numbers are read with one request,
+    // and all the requests are in flight at once.
+    void read_blocks(const int *block_nums, void *const *blocks, int n);
+
+    // Writes the n buffers in blocks to the matching disk blocks in
+    // block_nums. Runs of adjacent block numbers are written with one
+    // request, and all the requests are in flight at once.
+    void write_blocks(const int *block_nums, void *const *blocks, int n);
+
+    // Starts reading the n disk blocks in block_nums into the matching
+    // buffers in blocks, adding the requests to batch without waiting for
+    // them. The buffers are filled once wait returns for batch.
+    void start_read(IOBatch &batch, const int *block_nums, void *const *blocks, int n);
+
+    // Starts writing the n buffers in blocks to the matching disk blocks
+    // in block_nums, adding the requests to batch without waiting for
+    // them. The buffers must not change until wait returns for batch.
+    void start_write(IOBatch &batch, const int *block_nums, void *const *blocks, int n);
+
+    // Waits for every request of batch to complete, leaving batch empty.
+    // A request that failed aborts the program.
+    void wait(IOBatch &batch);
+
+    // Copies len bytes, starting offset bytes into block block_num, from
+    // the disk file to out_fd inside the kernel (sendfile). Returns false,
+    // having written nothing, if out_fd is not a regular file.
+    bool send(int out_fd, int block_num, unsigned int offset, size_t len);
+
+    // Forces written blocks to stable storage (msync or fsync).
+    void sync();
+
+    // Returns the number of blocks on the disk.
+    int get_num_blocks() const { return num_blocks; }
+
+    // Disk statistics: blocks moved to and from the disk file
+    unsigned long blocks_read() const { return num_reads; }
+    unsigned long blocks_written() const { return num_writes; }
+
+    // Returns the blocks read or written by the calling thread, on any
+    // disk.
+    static unsigned long thread_blocks_read();
+    static unsigned long thread_blocks_written();
+
+    // Returns how blocks are moved: the name of the I/O engine, or "mmap".
+    const char *engine_name() const { return engine != NULL ? engine->name() : "mmap"; }
+
   private:
     int fd;	// file descriptor that represents the disk
+    DiskMode mode;	// how blocks are read and written
+    char *map;	// start of the mapped disk (DISK_MODE_MMAP only)
+    int num_blocks;	// number of blocks on the disk
+    IOEngine *engine;	// moves blocks asynchronously (DISK_MODE_IO only)
+    std::atomic<unsigned long> num_reads;	// blocks read (or sent)
+    std::atomic<unsigned long> num_writes;	// blocks written
+
+    // Aborts the program if block_num is not on the disk.
+    void check_block(int block_num);
+
+    // Adds requests reading (or writing, if write is set) the n blocks in
+    // block_nums to batch and submits them.
+    void start(IOBatch &batch, bool write, const int *block_nums, void *const *blocks, int n);
+
+    // Returns the number of blocks, at most IOV_MAX, that form a run of
+    // adjacent block numbers at the start of block_nums.
+    int run_length(const int *block_nums, int n);
 };
 
 #endif
@@ -0,0 +1,249 @@
+// Computing Systems: Extent Map
+// Maps the blocks of a data file to disk blocks using the extents held
+// in its inode and in its chain of indirect extent blocks.
+
+#include <algorithm>
+#include <cstring>
+using namespace std;
+
+#include "ExtentMap.h"
+
+ExtentMap::ExtentMap() : total_blocks(0), dirty_from(0), stored_indirect(0)
+{
+}
+
+// Loads the extents of inode, following its indirect extent blocks.
+void ExtentMap::load(BasicFileSys &bfs, const inode_t &inode)
+{
+  extents.clear();
+  offsets.clear();
+  indirect.clear();
+  total_blocks = 0;
+
+  // extents held in the inode
+  unsigned int remaining = inode.num_extents;
+  for (int i = 0; i < INODE_EXTENTS && remaining > 0; i++, remaining--) {
+    extents.push_back(inode.extents[i]);
+  }
+
+  // extents held in the indirect blocks
+  blocknum_t block_num = inode.indirect;
+  while (block_num != 0) {
+    struct extentblock_t extent_block;
+    bfs.read_block(block_num, (void *) &extent_block);
+    indirect.push_back(block_num);
+    for (unsigned int i = 0; i < extent_block.num_extents; i++) {
+      extents.push_back(extent_block.extents[i]);
+    }
+    block_num = extent_block.next;
+  }
+
+  for (size_t i = 0; i < extents.size(); i++) {
+    offsets.push_back(total_blocks);
+    total_blocks += extents[i].length;
+  }
+  dirty_from = extents.size();
+  stored_indirect = indirect.size();
+}
+
+// Writes the extents into inode and its indirect extent blocks. The
+// caller must add enough indirect blocks first (see indirect_needed)
+// and write the inode itself.
+void ExtentMap::store(BasicFileSys &bfs, inode_t &inode)
+{
+  inode.num_extents = extents.size();
+  inode.indirect = indirect.empty() ? 0 : indirect[0];
+  for (size_t i = 0; i < (size_t) INODE_EXTENTS; i++) {
+    if (i < extents.size()) {
+      inode.extents[i] = extents[i];
+    } else {
+      inode.extents[i].start = 0;
+      inode.extents[i].length = 0;
+    }
+  }
+
+  // rewrite only the indirect blocks holding changed extents, plus the
+  // old last block whose next link changes when the chain grows
+  size_t first = indirect.size();
+  if (dirty_from < extents.size() && extents.size() > (size_t) INODE_EXTENTS) {
+    first = (dirty_from < (size_t) INODE_EXTENTS) ? 0 :
+            (dirty_from - INODE_EXTENTS) / EXTENTS_PER_BLOCK;
+  }
+  if (indirect.size() > stored_indirect && stored_indirect > 0) {
+    first = min(first, stored_indirect - 1);
+  }
+
+  for (size_t b = first; b < indirect.size(); b++) {
+    struct extentblock_t extent_block;
+    memset(&extent_block, 0, sizeof(extent_block));
+    extent_block.magic = EXTENT_MAGIC_NUM;
+    extent_block.next = (b + 1 < indirect.size()) ? indirect[b + 1] : 0;
+
+    size_t begin = INODE_EXTENTS + b * EXTENTS_PER_BLOCK;
+    for (size_t i = begin; i < extents.size() && i < begin + EXTENTS_PER_BLOCK; i++) {
+      extent_block.extents[extent_block.num_extents++] = extents[i];
+    }
+    bfs.write_block(indirect[b], (void *) &extent_block);
+  }
+
+  dirty_from = extents.size();
+  stored_indirect = indirect.size();
+}
+
+// Stores the disk blocks of file blocks first to first + count - 1 in
+// block_nums.
+void ExtentMap::map(unsigned int first, unsigned int count, blocknum_t *block_nums) const
+{
+  if (count == 0) {
+    return;
+  }
+
+  size_t e = find(first);
+  unsigned int offset = first - offsets[e];
+
+  for (unsigned int i = 0; i < count; i++) {
+    if (offset == extents[e].length) {
+      e++;
+      offset = 0;
+    }
+    block_nums[i] = extents[e].start + offset;
+    offset++;
+  }
+}
+
+// Returns the disk block just past the last mapped block, where the
+// file would best grow, or 0 if no blocks are mapped.
+blocknum_t ExtentMap::next_block() const
+{
+  if (extents.empty()) {
+    return 0;
+  }
+  return extents.back().start + extents.back().length;
+}
+
+// Adds block_num as the next block of the file. The last extent is
+// extended when block_num follows it on disk.
+void ExtentMap::append(blocknum_t block_num)
+{
+  if (!extents.empty()) {
+    extent_t &last = extents.back();
+    if (last.start + (blocknum_t) last.length == block_num) {
+      last.length++;
+      total_blocks++;
+      dirty_from = min(dirty_from, extents.size() - 1);
+      return;
+    }
+  }
+
+  extent_t extent;
+  extent.start = block_num;
+  extent.length = 1;
+  extents.push_back(extent);
+  offsets.push_back(total_blocks);
+  total_blocks++;
+  dirty_from = min(dirty_from, extents.size() - 1);
+}
+
+// Maps file blocks first to first + count - 1 to the disk blocks in
+// block_nums instead, as when blocks are copied on write. Extents left
+// contiguous on disk are merged.
+void ExtentMap::remap(unsigned int first, unsigned int count, const blocknum_t *block_nums)
+{
+  if (count == 0) {
+    return;
+  }
+
+  // rebuild the extents from the one before the range to the one after
+  size_t e_first = find(first);
+  size_t e_last = find(first + count - 1);
+  size_t from = (e_first > 0) ? e_first - 1 : 0;
+  size_t to = min(e_last + 2, extents.size());
+
+  vector<extent_t> pieces;
+  if (from < e_first) {
+    add_piece(pieces, extents[from]);
+  }
+  extent_t piece = extents[e_first];
+  piece.length = first - offsets[e_first];
+  if (piece.length > 0) {
+    add_piece(pieces, piece);
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    piece.start = block_nums[i];
+    piece.length = 1;
+    add_piece(pieces, piece);
+  }
+  unsigned int past = first + count - offsets[e_last];
+  piece.start = extents[e_last].start + past;
+  piece.length = extents[e_last].length - past;
+  if (piece.length > 0) {
+    add_piece(pieces, piece);
+  }
+  if (e_last + 1 < to) {
+    add_piece(pieces, extents[e_last + 1]);
+  }
+
+  extents.erase(extents.begin() + from, extents.begin() + to);
+  extents.insert(extents.begin() + from, pieces.begin(), pieces.end());
+  offsets.resize(from);
+  unsigned int offset = (from > 0) ? offsets[from - 1] + extents[from - 1].length : 0;
+  for (size_t i = from; i < extents.size(); i++) {
+    offsets.push_back(offset);
+    offset += extents[i].length;
+  }
+  dirty_from = min(dirty_from, from);
+}
+
+// Returns the number of indirect blocks that must be added before
+// the extents can be stored.
+int ExtentMap::indirect_needed() const
+{
+  return max(0, indirect_blocks_for(extents.size()) - (int) indirect.size());
+}
+
+// Makes blocks the chain of indirect blocks, so that the next store writes
+// every extent to them, as when the file is copied.
+void ExtentMap::set_indirect(const vector<blocknum_t> &blocks)
+{
+  indirect = blocks;
+  dirty_from = 0;
+  stored_indirect = 0;
+}
+
+// Appends every block used by the file, data blocks and indirect
+// blocks, to blocks.
+void ExtentMap::all_blocks(vector<blocknum_t> &blocks) const
+{
+  for (size_t i = 0; i < extents.size(); i++) {
+    for (unsigned int j = 0; j < extents[i].length; j++) {
+      blocks.push_back(extents[i].start + j);
+    }
+  }
+  blocks.insert(blocks.end(), indirect.begin(), indirect.end());
+}
+
+// Returns the index of the extent holding file block file_block.
+size_t ExtentMap::find(unsigned int file_block) const
+{
+  return upper_bound(offsets.begin(), offsets.end(), file_block) - offsets.begin() - 1;
+}
+
+// Adds extent to the end of pieces, merging it into the last one if it
+// follows that on disk.
+void ExtentMap::add_piece(vector<extent_t> &pieces, const extent_t &extent)
+{
+  if (!pieces.empty() && pieces.back().start + (blocknum_t) pieces.back().length == extent.start) {
+    pieces.back().length += extent.length;
+  } else {
+    pieces.push_back(extent);
+  }
+}
+
+// Returns the number of indirect blocks needed for n extents.
+int ExtentMap::indirect_blocks_for(size_t n)
+{
+  if (n <= (size_t) INODE_EXTENTS) {
+    return 0;
+  }
+  return (n - INODE_EXTENTS + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+}
@@ -0,0 +1,85 @@
+// Computing Systems: Extent Map
+// Maps the blocks of a data file to disk blocks using the extents held
+// in its inode and in its chain of indirect extent blocks.
+
+#ifndef EXTENT_MAP_H
+#define EXTENT_MAP_H
+
+#include <vector>
+#include "BasicFileSys.h"
+#include "Blocks.h"
+
+class ExtentMap {
+
+  public:
+    ExtentMap();
+
+    // Loads the extents of inode, following its indirect extent blocks.
+    void load(BasicFileSys &bfs, const inode_t &inode);
+
+    // Writes the extents into inode and its indirect extent blocks. The
+    // caller must add enough indirect blocks first (see indirect_needed)
+    // and write the inode itself.
+    void store(BasicFileSys &bfs, inode_t &inode);
+
+    // Returns the number of data blocks mapped.
+    unsigned int num_blocks() const { return total_blocks; }
+
+    // Returns the extents in file order.
+    const std::vector<extent_t> &get_extents() const { return extents; }
+
+    // Stores the disk blocks of file blocks first to first + count - 1 in
+    // block_nums.
+    void map(unsigned int first, unsigned int count, blocknum_t *block_nums) const;
+
+    // Returns the disk block just past the last mapped block, where the
+    // file would best grow, or 0 if no blocks are mapped.
+    blocknum_t next_block() const;
+
+    // Adds block_num as the next block of the file. The last extent is
+    // extended when block_num follows it on disk.
+    void append(blocknum_t block_num);
+
+    // Maps file blocks first to first + count - 1 to the disk blocks in
+    // block_nums instead, as when blocks are copied on write. Extents
+    // left contiguous on disk are merged.
+    void remap(unsigned int first, unsigned int count, const blocknum_t *block_nums);
+
+    // Returns the number of indirect blocks that must be added before
+    // the extents can be stored.
+    int indirect_needed() const;
+
+    // Adds block_num to the end of the chain of indirect blocks.
+    void add_indirect(blocknum_t block_num) { indirect.push_back(block_num); }
+
+    // Makes blocks the chain of indirect blocks, so that the next store
+    // writes every extent to them, as when the file is copied.
+    void set_indirect(const std::vector<blocknum_t> &blocks);
+
+    // Returns the number of indirect blocks in use.
+    int num_indirect() const { return indirect.size(); }
+
+    // Appends every block used by the file, data blocks and indirect
+    // blocks, to blocks.
+    void all_blocks(std::vector<blocknum_t> &blocks) const;
+
+    // Returns the number of indirect blocks needed for n extents.
+    static int indirect_blocks_for(size_t n);
+
+  private:
+    std::vector<extent_t> extents;	// extents in file order
+    std::vector<unsigned int> offsets;	// first file block of each extent
+    std::vector<blocknum_t> indirect;	// chain of indirect extent blocks
+    unsigned int total_blocks;		// number of data blocks mapped
+    size_t dirty_from;			// first extent changed since stored
+    size_t stored_indirect;		// indirect blocks when last stored
+
+    // Returns the index of the extent holding file block file_block.
+    size_t find(unsigned int file_block) const;
+
+    // Adds extent to the end of pieces, merging it into the last one if
+    // it follows that on disk.
+    static void add_piece(std::vector<extent_t> &pieces, const extent_t &extent);
+};
+
+#endif
@@ -1,663 +1,1949 @@
 // Computing Systems: File System
 // Implements the file system commands that are available to the shell.
+// Commands may run in several threads at once, each for its own session.
+//
+// Directories and inodes are locked through the lock table in tree order
+// (see LockTable.h), after an operation has begun with the journal and
+// before the internal locks of the caches, the open file table and the
+// allocator. A command looks up the last component of its path with the
+// directory holding it locked, and locks a data file before letting go
+// of its directory, so the file cannot be removed in between.
 
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
 #include <iostream>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <algorithm>
 using namespace std;
 
 #include "FileSys.h"
 #include "BasicFileSys.h"
 #include "Blocks.h"
+#include "ExtentMap.h"
+#include "Directory.h"
+
+// Number of blocks moved by one vectored read or write
+static const int IO_CHUNK_BLOCKS = 64;
+
+// Number of blocks moved at a time between a host file and a data file
+// (1 MiB)
+static const int STREAM_CHUNK_BLOCKS = (1 << 20) / BLOCK_SIZE;
+
+// Ends a file system operation when it goes out of scope, whichever way
+// the command returns, so its changes are committed with its group. An
+// operation changes no more blocks than it reserved room for in the
+// journal.
+class Operation {
+  public:
+    Operation(BasicFileSys &bfs, int blocks = OP_JOURNAL_BLOCKS)
+      : bfs(bfs), blocks(blocks), began(bfs.begin_op(blocks)) {}
+    ~Operation() { if (began) bfs.end_op(); }
+
+    // Returns false if the operation is too large for the journal
+    bool ok() const { return began; }
+
+    // Makes sure the operation may change need blocks. Returns false if
+    // the journal has no room for more now; the command then starts over
+    // with an operation that reserves need blocks up front.
+    bool reserve(int need) {
+      if (need > blocks) {
+        if (!bfs.extend_op(need - blocks)) {
+          return false;
+        }
+        blocks = need;
+      }
+      return true;
+    }
+
+  private:
+    BasicFileSys &bfs;
+    int blocks;		// blocks reserved in the journal
+    bool began;		// true if the operation began
+};
 
 // mounts the file system
-void FileSys::mount() {
-  bfs.mount();
-  curr_dir = 1;
+void FileSys::mount(const MountOptions &options) {
+  if (bfs.mount(options) < FS_VERSION) {
+    set_types(bfs.root_dir());
+  }
+  readahead.set_cache_blocks(options.cache_blocks);
+  root = bfs.root_dir();
+  read_only = false;
+  
+  // a snapshot is mounted in place of the live tree
+  if (options.snapshot != NULL) {
+    blocknum_t snapshot = 0;
+    if (bfs.snapshot_dir() != 0) {
+      unsigned char type;
+      Directory snapshots(bfs, bfs.snapshot_dir());
+      snapshot = snapshots.lookup(options.snapshot, type);
+    }
+    if (snapshot == 0) {
+      cerr << "Snapshot does not exist" << endl;
+      exit(-1);
+    }
+    root = snapshot;
+    read_only = true;
+  }
+  dentries.clear();
+  open_files.clear();
+  session_dirs.clear();
+  num_sessions = 0;
 }
 
 // unmounts the file system
 void FileSys::unmount() {
+  open_files.clear();
+  session_dirs.clear();
   bfs.unmount();
 }
 
+// write all cached changes to disk
+void FileSys::sync() {
+  OpTimer timer(command_metrics, OP_SYNC, NULL);
+  bfs.sync();
+}
+
+// display block and dentry cache, disk and journal statistics
+void FileSys::cachestat(Session &session) {
+  ostream &out = *session.out;
+  const BlockCache &cache = bfs.get_cache();
+  out << "Cache blocks: " << cache.size() << "/" << cache.capacity() << endl;
+  out << "Cache hits: " << cache.hits() << endl;
+  out << "Cache misses: " << cache.misses() << endl;
+  out << "Cache writebacks: " << cache.writebacks() << endl;
+  out << "Disk I/O: " << bfs.io_engine() << endl;
+  out << "Disk blocks read: " << bfs.get_disk().blocks_read() << endl;
+  out << "Disk blocks written: " << bfs.get_disk().blocks_written() << endl;
+  out << "Dentry hits: " << dentries.hits() << endl;
+  out << "Dentry misses: " << dentries.misses() << endl;
+  out << "Readahead windows: " << readahead.windows() << " (" << readahead.blocks()
+      << " blocks)" << endl;
+  out << "Readahead hits: " << readahead.hits() << endl;
+  const Journal &journal = bfs.get_journal();
+  if (journal.enabled()) {
+    out << "Journal commits: " << journal.commits() << endl;
+    out << "Journal blocks logged: " << journal.logged_blocks() << endl;
+    out << "Journal checkpoints: " << journal.checkpoints() << endl;
+    out << "Journal replayed: " << journal.replayed() << endl;
+  }
+  if (bfs.snapshot_dir() != 0) {
+    out << "Shared blocks: " << bfs.num_shared_blocks() << endl;
+  }
+}
+
+// display the calls, errors, latencies and disk blocks of each command,
+// with allocator, cache and disk statistics
+void FileSys::metrics(Session &session) {
+  ostream &out = *session.out;
+  command_metrics.print(out);
+  const BlockAllocator &allocator = bfs.get_allocator();
+  out << "Allocations: " << allocator.allocations() << " (" << allocator.blocks_allocated()
+      << " blocks)" << endl;
+  out << "Releases: " << allocator.releases() << " (" << allocator.blocks_released()
+      << " blocks)" << endl;
+  out << "Free extent lookups: " << allocator.extent_lookups() << endl;
+  out << "Bitmap scans: " << allocator.bitmap_scans() << " (" << allocator.words_scanned()
+      << " words)" << endl;
+  const BlockCache &cache = bfs.get_cache();
+  out << "Cache hits: " << cache.hits() << endl;
+  out << "Cache misses: " << cache.misses() << endl;
+  out << "Dentry hits: " << dentries.hits() << endl;
+  out << "Dentry misses: " << dentries.misses() << endl;
+  out << "Readahead windows: " << readahead.windows() << " (" << readahead.blocks()
+      << " blocks, " << readahead.hits() << " hits, " << readahead.resets() << " resets)"
+      << endl;
+  out << "Disk blocks read: " << bfs.get_disk().blocks_read() << endl;
+  out << "Disk blocks written: " << bfs.get_disk().blocks_written() << endl;
+}
+
+// write the metrics as a JSON object to out
+void FileSys::write_metrics(ostream &out) {
+  const BlockAllocator &allocator = bfs.get_allocator();
+  const BlockCache &cache = bfs.get_cache();
+  const Journal &journal = bfs.get_journal();
+  out << "{\n  \"commands\": {";
+  command_metrics.write_json(out);
+  out << "\n  },\n"
+      << "  \"allocator\": {\"allocations\": " << allocator.allocations()
+      << ", \"blocks_allocated\": " << allocator.blocks_allocated()
+      << ", \"releases\": " << allocator.releases()
+      << ", \"blocks_released\": " << allocator.blocks_released()
+      << ", \"extent_lookups\": " << allocator.extent_lookups()
+      << ", \"bitmap_scans\": " << allocator.bitmap_scans()
+      << ", \"bitmap_words_scanned\": " << allocator.words_scanned() << "},\n"
+      << "  \"cache\": {\"hits\": " << cache.hits()
+      << ", \"misses\": " << cache.misses()
+      << ", \"writebacks\": " << cache.writebacks() << "},\n"
+      << "  \"dentry_cache\": {\"hits\": " << dentries.hits()
+      << ", \"misses\": " << dentries.misses() << "},\n"
+      << "  \"readahead\": {\"windows\": " << readahead.windows()
+      << ", \"blocks\": " << readahead.blocks()
+      << ", \"hits\": " << readahead.hits()
+      << ", \"resets\": " << readahead.resets() << "},\n"
+      << "  \"disk\": {\"io_engine\": \"" << bfs.io_engine() << "\""
+      << ", \"blocks_read\": " << bfs.get_disk().blocks_read()
+      << ", \"blocks_written\": " << bfs.get_disk().blocks_written() << "},\n"
+      << "  \"journal\": {\"commits\": " << journal.commits()
+      << ", \"blocks_logged\": " << journal.logged_blocks()
+      << ", \"checkpoints\": " << journal.checkpoints()
+      << ", \"replayed\": " << journal.replayed() << "}\n"
+      << "}" << endl;
+}
+
+// start a session in the root directory, numbering it
+void FileSys::start_session(Session &session) {
+  {
+    lock_guard<mutex> guard(session_lock);
+    session.id = ++num_sessions;
+  }
+  session.curr_dir = 0;
+  session.handles.clear();
+  session.reading.clear();
+  session.next_handle = 1;
+  set_dir(session, root);
+}
+
+// end a session, closing its file handles
+void FileSys::end_session(Session &session) {
+  while (!session.handles.empty()) {
+    close(session, session.handles.begin()->first);
+  }
+  set_dir(session, 0);
+}
+
+// Helper function to display an error message to session and count it
+void FileSys::error(Session &session, const char *message) {
+  *session.out << message << endl;
+  session.errors++;
+}
+
 // Helper function to check if a block is a directory
-bool FileSys::is_directory(short block_num) {
+bool FileSys::is_directory(blocknum_t block_num) {
   struct dirblock_t block;
   bfs.read_block(block_num, (void *) &block);
   return block.magic == DIR_MAGIC_NUM;
 }
 
-// Helper function to find a file by name in the current directory
+// Helper function to record the type of every entry in directory dir and
+// the directories below it, for disks from before entry types. Runs while
+// mounting, before any session can read the directories.
+void FileSys::set_types(blocknum_t dir) {
+  Directory directory(bfs, dir);
+  vector<dirent_t> entries;
+  directory.entries(entries);
+  for (size_t i = 0; i < entries.size(); i++) {
+    bool is_dir = (entries[i].type == DIRENT_DIR);
+    if (entries[i].type == DIRENT_UNKNOWN) {
+      is_dir = is_directory(entries[i].block_num);
+      Operation op(bfs);
+      directory.set_type(entries[i].name, is_dir ? DIRENT_DIR : DIRENT_FILE);
+    }
+    if (is_dir) {
+      set_types(entries[i].block_num);
+    }
+  }
+}
+
+// Helper function to lock directory dir, shared or exclusively
+// Returns false if the directory was removed before it could be locked
+bool FileSys::lock_dir(BlockLock &lock, blocknum_t dir, bool exclusive) {
+  lock.lock(dir, exclusive);
+  return is_directory(dir);
+}
+
+// Helper function to look up one name in directory dir, through the
+// dentry cache. "." is dir itself and ".." its parent. The caller holds
+// the lock of dir.
 // Returns the block number of the file or 0 if not found
 // Sets is_dir to true if the found file is a directory
-short FileSys::find_file(const char *name, bool &is_dir) {
-  struct dirblock_t dir_block;
-  bfs.read_block(curr_dir, (void *) &dir_block);
+blocknum_t FileSys::lookup(blocknum_t dir, const string &name, bool &is_dir) {
+  if (name == ".") {
+    is_dir = true;
+    return dir;
+  }
+  
+  blocknum_t block_num;
+  if (dentries.lookup(dir, name, block_num, is_dir)) {
+    return block_num;
+  }
+  
+  // Read the directory and remember the answer, even if it is not found
+  Directory directory(bfs, dir);
+  if (name == "..") {
+    block_num = directory.parent();
+    is_dir = true;
+  } else {
+    unsigned char type = DIRENT_UNKNOWN;
+    block_num = directory.lookup(name.c_str(), type);
+    if (block_num != 0 && type == DIRENT_UNKNOWN) {
+      // Entries from older disks left untyped are read to learn it
+      type = is_directory(block_num) ? DIRENT_DIR : DIRENT_FILE;
+    }
+    is_dir = (type == DIRENT_DIR);
+  }
+  dentries.insert(dir, name, block_num, is_dir);
+  return block_num;
+}
+
+// Helper function to resolve every component of a path but the last.
+// Paths starting with "/" are absolute and others are relative to the
+// current directory of session. Sets dir to the directory that should
+// hold the last component and name to that component ("." if the path
+// names dir itself). Each directory along the way is locked only while
+// it is searched, so dir is left unlocked.
+// Returns false if a directory along the path does not exist.
+bool FileSys::resolve_parent(Session &session, const char *path, blocknum_t &dir, string &name) {
+  dir = (path[0] == '/') ? root : session.curr_dir;
+  
+  // Split the path at slashes, ignoring empty components
+  vector<string> components;
+  const char *start = path;
+  while (*start != '\0') {
+    const char *end = strchr(start, '/');
+    if (end == NULL) {
+      end = start + strlen(start);
+    }
+    if (end > start) {
+      components.push_back(string(start, end - start));
+    }
+    start = (*end == '/') ? end + 1 : end;
+  }
+  
+  if (components.empty()) {
+    name = ".";
+    return true;
+  }
   
-  for (int i = 0; i < dir_block.num_entries; i++) {
-    if (strcmp(dir_block.dir_entries[i].name, name) == 0) {
-      is_dir = is_directory(dir_block.dir_entries[i].block_num);
-      return dir_block.dir_entries[i].block_num;
+  // Walk down to the directory holding the last component
+  for (size_t i = 0; i + 1 < components.size(); i++) {
+    BlockLock lock(locks);
+    if (!lock_dir(lock, dir, false)) {
+      return false;
     }
+    bool is_dir;
+    blocknum_t block_num = lookup(dir, components[i], is_dir);
+    if (block_num == 0 || !is_dir) {
+      return false;
+    }
+    dir = block_num;
   }
-  return 0; // File not found
+  name = components.back();
+  return true;
+}
+
+// Helper function to find a data file by path and lock its inode, shared
+// or exclusively, in lock
+// Returns the inode block, or 0 (after displaying an error) if the path
+// does not name a data file
+blocknum_t FileSys::lock_file(Session &session, const char *path, BlockLock &lock, bool exclusive) {
+  blocknum_t dir;
+  string name;
+  bool is_dir;
+  blocknum_t file_block = 0;
+  BlockLock dir_lock(locks);
+  if (resolve_parent(session, path, dir, name) && lock_dir(dir_lock, dir, false)) {
+    file_block = lookup(dir, name, is_dir);
+  }
+  
+  // Check if file exists
+  if (file_block == 0) {
+    error(session, "File does not exist");
+    return 0;
+  }
+  
+  // Check if it's a directory
+  if (is_dir) {
+    error(session, "File is a directory");
+    return 0;
+  }
+  
+  lock.lock(file_block, exclusive);
+  return file_block;
 }
 
 // Helper function to check if filename is valid (not too long)
-bool FileSys::check_filename(const char *name) {
-  return strlen(name) <= MAX_FNAME_SIZE;
+bool FileSys::check_filename(const string &name) {
+  return name.size() <= (size_t) MAX_FNAME_SIZE;
+}
+
+// Helper function to check that the file system may be changed
+// Returns false (after displaying an error) if a snapshot is mounted
+bool FileSys::check_writable(Session &session) {
+  if (read_only) {
+    error(session, "File system is read-only");
+    return false;
+  }
+  return true;
+}
+
+// Helper function to check that session may reach host files, which
+// server clients and replayed traces may not
+// Returns false (after displaying an error) if it is not a local session
+bool FileSys::check_local(Session &session) {
+  if (!session.local) {
+    error(session, "Host files are only available to the local shell");
+    return false;
+  }
+  return true;
+}
+
+// Helper function to make dir the current directory of session (0 - none)
+void FileSys::set_dir(Session &session, blocknum_t dir) {
+  lock_guard<mutex> guard(session_lock);
+  if (session.curr_dir != 0) {
+    session_dirs.erase(session_dirs.find(session.curr_dir));
+  }
+  if (dir != 0) {
+    session_dirs.insert(dir);
+  }
+  session.curr_dir = dir;
 }
 
 // Helper function to reclaim blocks used by a file or directory
-void FileSys::reclaim_blocks(short block_num, bool is_dir) {
+void FileSys::reclaim_blocks(blocknum_t block_num, bool is_dir) {
   if (is_dir) {
-    // Directory blocks are single blocks, just reclaim it
-    bfs.reclaim_block(block_num);
+    // Reclaim every bucket and index block of the directory, marking it
+    // removed for anyone about to lock it
+    Directory dir(bfs, block_num);
+    vector<blocknum_t> blocks;
+    dir.all_blocks(blocks);
+    dir.invalidate();
+    bfs.reclaim_blocks(blocks.data(), blocks.size());
   } else {
     // For data files, need to reclaim inode and all data blocks
     struct inode_t inode;
     bfs.read_block(block_num, (void *) &inode);
     
-    // Reclaim all data blocks first
-    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
-      if (inode.blocks[i] != 0) {
-        bfs.reclaim_block(inode.blocks[i]);
+    // Collect all data and indirect extent blocks followed by the inode
+    ExtentMap extent_map;
+    extent_map.load(bfs, inode);
+    vector<blocknum_t> blocks;
+    extent_map.all_blocks(blocks);
+    blocks.push_back(block_num);
+    
+    // Reclaim them with a single bitmap update
+    bfs.reclaim_blocks(blocks.data(), blocks.size());
+  }
+}
+
+// Helper function to count the blocks used by a file or directory
+int FileSys::count_blocks(blocknum_t block_num, bool is_dir) {
+  if (is_dir) {
+    Directory dir(bfs, block_num);
+    vector<blocknum_t> blocks;
+    dir.all_blocks(blocks);
+    return blocks.size();
+  }
+  struct inode_t inode;
+  bfs.read_block(block_num, (void *) &inode);
+  ExtentMap extent_map;
+  extent_map.load(bfs, inode);
+  return extent_map.num_blocks() + extent_map.num_indirect() + 1;
+}
+
+// Helper function to bound the blocks changed by writing len bytes to
+// file at offset: the inode and extents, the blocks from the old end of
+// the file or offset on, copies of those shared with snapshots, and the
+// bitmap. Data blocks count if they are journaled.
+int FileSys::write_changes(const OpenFile &file, unsigned int offset, unsigned int len) {
+  size_t from = min((size_t) offset, (size_t) file.inode.size);
+  int blocks = ((size_t) offset + len - from) / BLOCK_SIZE + 2;
+  
+  // Each block written may split an extent in three
+  int extents = file.extent_map.get_extents().size() + 2 * blocks + 1;
+  int indirect = ExtentMap::indirect_blocks_for(extents);
+  int changes = OP_JOURNAL_BLOCKS + indirect + bfs.bitmap_op_blocks(2 * blocks + indirect);
+  if (bfs.journals_data()) {
+    changes += blocks;
+  }
+  return changes;
+}
+
+// Helper function to write the n buffers in iov to file descriptor fd,
+// retrying until everything is written
+// Returns false if fd cannot be written
+static bool write_all(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t size = writev(fd, iov, min(n, IOV_MAX));
+    if (size == -1 && errno == EINTR) {
+      continue;
+    }
+    if (size == -1) {
+      return false;
+    }
+    
+    // Skip the buffers written and advance into a partly written one
+    while (n > 0 && (size_t) size >= iov->iov_len) {
+      size -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + size;
+      iov->iov_len -= size;
+    }
+  }
+  return true;
+}
+
+// Helper function to display len bytes of a data file starting at byte
+// offset to the output of session. Inline data goes through the output
+// stream. Otherwise the bytes bypass the stream when it has a descriptor
+// behind it: when that is a file, runs of adjacent blocks are sent to it
+// from the disk file with sendfile; otherwise they are read with vectored
+// requests of up to IO_CHUNK_BLOCKS blocks and written with a single
+// writev. Reads run a chunk ahead, so the disk fetches the next chunk
+// while the current one is written.
+void FileSys::display(Session &session, const OpenFile &file, unsigned int offset,
+                      unsigned int len) {
+  if (len == 0) {
+    return;
+  }
+  if (file.inode.magic == INODE_INLINE_MAGIC_NUM) {
+    session.out->write(file.inode.data + offset, len);
+    return;
+  }
+  const ExtentMap &extent_map = file.extent_map;
+  
+  // two chunks of buffers, used in turn
+  vector<datablock_t> data_blocks(2 * IO_CHUNK_BLOCKS);
+  vector<void *> buffers(2 * IO_CHUNK_BLOCKS);
+  vector<blocknum_t> block_nums(2 * IO_CHUNK_BLOCKS);
+  vector<struct iovec> iov(IO_CHUNK_BLOCKS);
+  for (int i = 0; i < 2 * IO_CHUNK_BLOCKS; i++) {
+    buffers[i] = (void *) &data_blocks[i];
+  }
+  ReadBatch batches[2];
+  
+  unsigned int first_block = offset / BLOCK_SIZE;
+  unsigned int last_block = (offset + len - 1) / BLOCK_SIZE;
+  unsigned int block_offset = offset % BLOCK_SIZE;
+  unsigned int bytes_remaining = len;
+  int out_fd = session.out_fd;
+  bool use_send = (out_fd >= 0);
+  bool read_ahead = false;  // true once the chunk in slot is being read
+  int slot = 0;
+  
+  // Anything already printed must come out first
+  if (out_fd >= 0) {
+    session.out->flush();
+  }
+  
+  for (unsigned int chunk = first_block; chunk <= last_block; chunk += IO_CHUNK_BLOCKS) {
+    int num_blocks = min(last_block + 1 - chunk, (unsigned int) IO_CHUNK_BLOCKS);
+    unsigned int chunk_bytes = min(bytes_remaining, num_blocks * BLOCK_SIZE - block_offset);
+    int first = slot * IO_CHUNK_BLOCKS;
+    if (!read_ahead) {
+      extent_map.map(chunk, num_blocks, &block_nums[first]);
+    }
+    
+    if (use_send) {
+      use_send = bfs.send_blocks(out_fd, &block_nums[first], num_blocks,
+                                 block_offset, chunk_bytes);
+    }
+    if (!use_send) {
+      if (!read_ahead) {
+        bfs.start_read_blocks(batches[slot], &block_nums[first], &buffers[first], num_blocks);
+      }
+
+      // Start on the next chunk before waiting for this one
+      unsigned int next_chunk = chunk + IO_CHUNK_BLOCKS;
+      read_ahead = (next_chunk <= last_block);
+      if (read_ahead) {
+        int next_blocks = min(last_block + 1 - next_chunk, (unsigned int) IO_CHUNK_BLOCKS);
+        int next_first = (1 - slot) * IO_CHUNK_BLOCKS;
+        extent_map.map(next_chunk, next_blocks, &block_nums[next_first]);
+        bfs.start_read_blocks(batches[1 - slot], &block_nums[next_first],
+                              &buffers[next_first], next_blocks);
+      }
+      bfs.finish_read_blocks(batches[slot]);
+      
+      // Point at the bytes to display in each block (the first block may
+      // be partial)
+      unsigned int bytes_left = chunk_bytes;
+      for (int b = 0; b < num_blocks; b++) {
+        unsigned int bytes_to_display = min(bytes_left, BLOCK_SIZE - block_offset);
+        iov[b].iov_base = data_blocks[first + b].data + block_offset;
+        iov[b].iov_len = bytes_to_display;
+        bytes_left -= bytes_to_display;
+        block_offset = 0;
+      }
+      if (out_fd >= 0) {
+        if (!write_all(out_fd, iov.data(), num_blocks)) {
+          cerr << "Failed to write output" << endl;
+          exit(-1);
+        }
+      } else {
+        for (int b = 0; b < num_blocks; b++) {
+          session.out->write((const char *) iov[b].iov_base, iov[b].iov_len);
+        }
+      }
+      slot = 1 - slot;
+    }
+    
+    bytes_remaining -= chunk_bytes;
+    block_offset = 0;
+  }
+}
+
+// Helper function to get a data file's inode and extents, from the open
+// file table if the file is open and otherwise read into scratch. The
+// caller holds the lock of the inode.
+FileSys::OpenFile &FileSys::load_file(blocknum_t file_block, OpenFile &scratch) {
+  {
+    lock_guard<mutex> guard(open_lock);
+    map<blocknum_t, OpenFile>::iterator it = open_files.find(file_block);
+    if (it != open_files.end()) {
+      return it->second;
+    }
+  }
+  
+  bfs.read_block(file_block, (void *) &scratch.inode);
+  scratch.extent_map.load(bfs, scratch.inode);
+  scratch.refs = 0;
+  return scratch;
+}
+
+// Helper function to find the file of a handle in session
+// Returns the inode block, or 0 (after displaying an error) if the handle
+// is not open
+blocknum_t FileSys::find_handle(Session &session, int handle) {
+  map<int, blocknum_t>::iterator it = session.handles.find(handle);
+  if (it == session.handles.end()) {
+    error(session, "Invalid file handle");
+    return 0;
+  }
+  return it->second;
+}
+
+// Helper function to write len bytes of data to a data file at byte
+// offset. Existing bytes are overwritten in place, except in blocks
+// shared with snapshots, which are copied on write, and the file grows
+// (zero filled past its old end) as needed. An inline file stays inline
+// while it fits in the inode and otherwise moves its data to blocks. The
+// inode and extents in file are updated and written back.
+// Returns false (after displaying an error) if the disk is full
+bool FileSys::write_data(Session &session, blocknum_t file_block, OpenFile &file,
+                         unsigned int offset, const char *data, unsigned int len) {
+  // Nothing to write for empty data
+  if (len == 0) {
+    return true;
+  }
+  
+  inode_t &inode = file.inode;
+  ExtentMap &extent_map = file.extent_map;
+  size_t end = (size_t) offset + len;
+  unsigned int new_size = max((size_t) inode.size, end);
+  
+  // Inline data is written with the inode alone while it fits; the bytes
+  // past the end are already zero
+  bool was_inline = (inode.magic == INODE_INLINE_MAGIC_NUM);
+  if (was_inline && new_size <= (unsigned int) INODE_INLINE_SIZE) {
+    memcpy(inode.data + offset, data, len);
+    inode.size = new_size;
+    bfs.write_block(file_block, (void *) &inode);
+    return true;
+  }
+  
+  // Calculate which blocks we need (end_block holds the last byte). An
+  // inline file has no blocks yet.
+  unsigned int end_block = (new_size - 1) / BLOCK_SIZE;
+  
+  // Blocks past the ones already mapped are new; the blocks written run
+  // from the first the data lands in (or the first new one) to the last
+  unsigned int mapped_blocks = extent_map.num_blocks();
+  int new_blocks_needed = (end_block + 1 > mapped_blocks) ? end_block + 1 - mapped_blocks : 0;
+  unsigned int first_block = min(offset / BLOCK_SIZE, mapped_blocks);
+  unsigned int last_block = (end - 1) / BLOCK_SIZE;
+  
+  // Existing blocks shared with snapshots move to copies near them,
+  // which start from the old contents where the data does not cover them
+  vector<blocknum_t> shared_blocks;
+  vector<blocknum_t> copies;
+  map<blocknum_t, blocknum_t> copy_sources;
+  unsigned int copy_end = min(last_block + 1, mapped_blocks);
+  if (first_block < copy_end && bfs.num_shared_blocks() > 0) {
+    vector<blocknum_t> mapping(copy_end - first_block);
+    extent_map.map(first_block, mapping.size(), mapping.data());
+    vector<size_t> shared;
+    for (size_t i = 0; i < mapping.size(); i++) {
+      if (bfs.is_shared(mapping[i])) {
+        shared.push_back(i);
+      }
+    }
+    if (!shared.empty()) {
+      copies.resize(shared.size());
+      if (!bfs.get_free_blocks(copies.size(), copies.data(), mapping[shared[0]])) {
+        error(session, "Disk is full");
+        return false;
+      }
+      for (size_t i = 0; i < shared.size(); i++) {
+        shared_blocks.push_back(mapping[shared[i]]);
+        copy_sources[copies[i]] = mapping[shared[i]];
+        mapping[shared[i]] = copies[i];
+      }
+      extent_map.remap(first_block, mapping.size(), mapping.data());
+    }
+  }
+  
+  // Allocate all new blocks up front with a single bitmap update. The
+  // first run follows the inode; later ones continue the last extent
+  // when possible and otherwise start where the file has room to grow
+  blocknum_t goal = extent_map.next_block();
+  AllocPolicy policy = ALLOC_SPREAD;
+  if (goal == 0) {
+    goal = file_block + 1;
+    policy = ALLOC_NEAR;
+  }
+  vector<blocknum_t> new_blocks(new_blocks_needed);
+  if (new_blocks_needed > 0 &&
+      !bfs.get_free_blocks(new_blocks_needed, new_blocks.data(), goal, policy)) {
+    bfs.reclaim_blocks(copies.data(), copies.size());
+    extent_map.load(bfs, inode);
+    error(session, "Disk is full");
+    return false;
+  }
+  for (int i = 0; i < new_blocks_needed; i++) {
+    extent_map.append(new_blocks[i]);
+  }
+  
+  // Allocate indirect extent blocks if the extents outgrow the inode
+  int indirect_needed = extent_map.indirect_needed();
+  if (indirect_needed > 0) {
+    vector<blocknum_t> indirect_blocks(indirect_needed);
+    if (!bfs.get_free_blocks(indirect_needed, indirect_blocks.data(), file_block)) {
+      bfs.reclaim_blocks(new_blocks.data(), new_blocks_needed);
+      bfs.reclaim_blocks(copies.data(), copies.size());
+      extent_map.load(bfs, inode);
+      error(session, "Disk is full");
+      return false;
+    }
+    for (int i = 0; i < indirect_needed; i++) {
+      extent_map.add_indirect(indirect_blocks[i]);
+    }
+  }
+  
+  // Fill the blocks in memory and write them back in vectored chunks.
+  // Every new block is written; existing blocks only where the data
+  // lands, and are read first if the data covers them partly.
+  vector<datablock_t> data_blocks(IO_CHUNK_BLOCKS);
+  vector<void *> buffers(IO_CHUNK_BLOCKS);
+  vector<blocknum_t> block_nums(IO_CHUNK_BLOCKS);
+  vector<blocknum_t> read_nums;
+  vector<void *> read_buffers;
+  
+  for (unsigned int chunk = first_block; chunk <= last_block; chunk += IO_CHUNK_BLOCKS) {
+    int num_blocks = min(last_block + 1 - chunk, (unsigned int) IO_CHUNK_BLOCKS);
+    extent_map.map(chunk, num_blocks, block_nums.data());
+    read_nums.clear();
+    read_buffers.clear();
+    
+    for (int b = 0; b < num_blocks; b++) {
+      size_t block_start = (size_t) (chunk + b) * BLOCK_SIZE;
+      buffers[b] = (void *) &data_blocks[b];
+      if (chunk + b >= mapped_blocks) {
+        // New block: start from zeroes, or the inline data moving out
+        memset(data_blocks[b].data, 0, BLOCK_SIZE);
+        if (was_inline && chunk + b == 0) {
+          memcpy(data_blocks[b].data, inode.data, inode.size);
+        }
+      } else if (offset > block_start || end < block_start + BLOCK_SIZE) {
+        // Partly overwritten block: keep its other bytes, from the
+        // shared block if this is its copy
+        map<blocknum_t, blocknum_t>::iterator source = copy_sources.find(block_nums[b]);
+        read_nums.push_back(source == copy_sources.end() ? block_nums[b] : source->second);
+        read_buffers.push_back(buffers[b]);
       }
     }
+    if (!read_nums.empty()) {
+      bfs.read_blocks(read_nums.data(), read_buffers.data(), read_nums.size());
+    }
     
-    // Finally reclaim the inode block
-    bfs.reclaim_block(block_num);
+    // Copy the part of the data that lands in each block
+    for (int b = 0; b < num_blocks; b++) {
+      size_t block_start = (size_t) (chunk + b) * BLOCK_SIZE;
+      size_t from = max(block_start, (size_t) offset);
+      size_t to = min(block_start + BLOCK_SIZE, end);
+      if (from < to) {
+        memcpy(data_blocks[b].data + (from - block_start), data + (from - offset), to - from);
+      }
+    }
+    
+    bfs.write_data_blocks(block_nums.data(), buffers.data(), num_blocks);
+  }
+  
+  // Update extents and inode size and write back to disk, then let go
+  // of the shared blocks that were copied
+  if (was_inline) {
+    inode.magic = INODE_MAGIC_NUM;
+  }
+  extent_map.store(bfs, inode);
+  inode.size = new_size;
+  bfs.write_block(file_block, (void *) &inode);
+  bfs.reclaim_blocks(shared_blocks.data(), shared_blocks.size());
+  return true;
+}
+
+// Helper function to read host file in into new blocks for a data file,
+// STREAM_CHUNK_BLOCKS blocks at a time, outside any operation so that a
+// slow host file holds up no commit. The blocks of a chunk are reserved
+// together and written in place with a single vectored request; until
+// the file is linked in nothing refers to them, and a crash leaves them
+// free. Data that fits in the inode stays inline. Sets inode to the new
+// inode and extent_map to the data blocks and the indirect extent blocks
+// they need, all still reserved.
+// Returns false (after displaying an error, with nothing left reserved)
+// if in cannot be read or the data does not fit
+bool FileSys::import_data(Session &session, FILE *in, inode_t &inode, ExtentMap &extent_map) {
+  memset(&inode, 0, sizeof(inode));
+  inode.magic = INODE_INLINE_MAGIC_NUM;
+  
+  vector<datablock_t> data_blocks(STREAM_CHUNK_BLOCKS);
+  vector<void *> buffers(STREAM_CHUNK_BLOCKS);
+  vector<blocknum_t> block_nums(STREAM_CHUNK_BLOCKS);
+  for (int i = 0; i < STREAM_CHUNK_BLOCKS; i++) {
+    buffers[i] = (void *) &data_blocks[i];
+  }
+  size_t size = 0;
+  const char *failure = NULL;
+  
+  while (true) {
+    size_t got = fread(data_blocks.data(), 1, (size_t) STREAM_CHUNK_BLOCKS * BLOCK_SIZE, in);
+    if (ferror(in)) {
+      failure = "Could not read host file";
+      break;
+    }
+    if (got == 0) {
+      break;
+    }
+    if (got > MAX_FILE_SIZE - size) {
+      failure = "Import exceeds maximum file size";
+      break;
+    }
+    
+    // A short read is the end of the data: if that is all of it and it
+    // fits, keep it in the inode
+    if (size == 0 && got <= (size_t) INODE_INLINE_SIZE) {
+      memcpy(inode.data, data_blocks.data(), got);
+      size = got;
+      break;
+    }
+    
+    // Zero the rest of the last block, then reserve the chunk's blocks:
+    // the first near the directory the inode will go in, the rest
+    // continuing the last extent when possible
+    int num_blocks = (got + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset((char *) data_blocks.data() + got, 0, (size_t) num_blocks * BLOCK_SIZE - got);
+    blocknum_t goal = extent_map.next_block();
+    AllocPolicy policy = ALLOC_SPREAD;
+    if (goal == 0) {
+      goal = session.curr_dir;
+      policy = ALLOC_NEAR;
+    }
+    if (!bfs.reserve_blocks(num_blocks, block_nums.data(), goal, policy)) {
+      failure = "Disk is full";
+      break;
+    }
+    for (int b = 0; b < num_blocks; b++) {
+      extent_map.append(block_nums[b]);
+    }
+    bfs.write_reserved_blocks(block_nums.data(), buffers.data(), num_blocks);
+    size += got;
+  }
+  
+  // Reserve indirect extent blocks if the extents outgrow the inode
+  int indirect_needed = extent_map.indirect_needed();
+  if (failure == NULL && indirect_needed > 0) {
+    vector<blocknum_t> indirect_blocks(indirect_needed);
+    if (!bfs.reserve_blocks(indirect_needed, indirect_blocks.data(), extent_map.next_block())) {
+      failure = "Disk is full";
+    }
+    for (int i = 0; failure == NULL && i < indirect_needed; i++) {
+      extent_map.add_indirect(indirect_blocks[i]);
+    }
+  }
+  if (failure != NULL) {
+    vector<blocknum_t> reserved;
+    extent_map.all_blocks(reserved);
+    bfs.unreserve_blocks(reserved.data(), reserved.size());
+    error(session, failure);
+    return false;
+  }
+  
+  if (extent_map.num_blocks() > 0) {
+    inode.magic = INODE_MAGIC_NUM;
+  }
+  inode.size = size;
+  return true;
+}
+
+// Helper function to write the whole of data file file to host file
+// descriptor fd, reading STREAM_CHUNK_BLOCKS blocks at a time with a
+// vectored request and writing them with a single writev
+// Returns false if fd cannot be written
+bool FileSys::export_data(const OpenFile &file, int fd) {
+  unsigned int size = file.inode.size;
+  if (file.inode.magic == INODE_INLINE_MAGIC_NUM) {
+    struct iovec iov = {(void *) file.inode.data, size};
+    return write_all(fd, &iov, 1);
+  }
+  
+  vector<datablock_t> data_blocks(STREAM_CHUNK_BLOCKS);
+  vector<void *> buffers(STREAM_CHUNK_BLOCKS);
+  vector<blocknum_t> block_nums(STREAM_CHUNK_BLOCKS);
+  vector<struct iovec> iov(STREAM_CHUNK_BLOCKS);
+  for (int i = 0; i < STREAM_CHUNK_BLOCKS; i++) {
+    buffers[i] = (void *) &data_blocks[i];
+  }
+  unsigned int total_blocks = (size + (size_t) BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (unsigned int chunk = 0; chunk < total_blocks; chunk += STREAM_CHUNK_BLOCKS) {
+    int num_blocks = min(total_blocks - chunk, (unsigned int) STREAM_CHUNK_BLOCKS);
+    file.extent_map.map(chunk, num_blocks, block_nums.data());
+    bfs.read_blocks(block_nums.data(), buffers.data(), num_blocks);
+    
+    // The last block of the file may be partial
+    for (int b = 0; b < num_blocks; b++) {
+      size_t block_start = (size_t) (chunk + b) * BLOCK_SIZE;
+      iov[b].iov_base = data_blocks[b].data;
+      iov[b].iov_len = min((size_t) BLOCK_SIZE, size - block_start);
+    }
+    if (!write_all(fd, iov.data(), num_blocks)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Helper function to lock directory dir and everything in it shared in
+// held, so that copy_dir copies it at one point in time. Adds the number
+// of data blocks the copy shares to data.
+// Returns the most blocks the copy changes, besides the bitmap and
+// reference counts
+int FileSys::lock_tree(list<BlockLock> &held, blocknum_t dir, int &data) {
+  held.emplace_back(locks, dir, false);
+  Directory directory(bfs, dir);
+  vector<dirent_t> entries;
+  directory.entries(entries);
+  
+  // Adding the entries one at a time, with the splits along the way,
+  // writes a few blocks for each block of entries
+  int changes = 5 * (entries.size() / DIR_ENTRIES_PER_BLOCK + 1) + 4;
+  for (size_t i = 0; i < entries.size(); i++) {
+    const dirent_t &entry = entries[i];
+    bool is_dir = (entry.type == DIRENT_DIR);
+    if (entry.type == DIRENT_UNKNOWN) {
+      is_dir = is_directory(entry.block_num);
+    }
+    if (is_dir) {
+      changes += lock_tree(held, entry.block_num, data);
+      continue;
+    }
+    
+    // A file copies its inode and indirect extent blocks
+    held.emplace_back(locks, entry.block_num, false);
+    inode_t inode;
+    bfs.read_block(entry.block_num, (void *) &inode);
+    ExtentMap extent_map;
+    extent_map.load(bfs, inode);
+    changes += 1 + extent_map.num_indirect();
+    data += extent_map.num_blocks();
+  }
+  return changes;
+}
+
+// Helper function to copy directory dir and everything in it into new
+// blocks, as a child of directory parent (0 - the copy is its own
+// parent). Directories and inodes are copied but data blocks are shared,
+// gaining a reference. The tree must be locked by lock_tree. Entry types
+// are resolved in the copy.
+// Returns the copy, or 0 (with nothing left allocated) if the disk is full
+blocknum_t FileSys::copy_dir(blocknum_t dir, blocknum_t parent) {
+  blocknum_t copy = bfs.get_free_block(dir);
+  if (copy == 0) {
+    return 0;
+  }
+  Directory::init(bfs, copy, (parent == 0) ? copy : parent);
+  
+  Directory directory(bfs, dir);
+  vector<dirent_t> entries;
+  directory.entries(entries);
+  Directory copy_directory(bfs, copy);
+  for (size_t i = 0; i < entries.size(); i++) {
+    const dirent_t &entry = entries[i];
+    bool is_dir = (entry.type == DIRENT_DIR);
+    if (entry.type == DIRENT_UNKNOWN) {
+      is_dir = is_directory(entry.block_num);
+    }
+    blocknum_t entry_copy = is_dir ? copy_dir(entry.block_num, copy) :
+                                     copy_file(entry.block_num);
+    if (entry_copy != 0 &&
+        copy_directory.add(entry.name, entry_copy, is_dir ? DIRENT_DIR : DIRENT_FILE)) {
+      continue;
+    }
+    
+    // Out of room: undo the copy so far
+    if (entry_copy != 0 && is_dir) {
+      drop_tree(entry_copy);
+    } else if (entry_copy != 0) {
+      reclaim_blocks(entry_copy, false);
+    }
+    drop_tree(copy);
+    return 0;
+  }
+  return copy;
+}
+
+// Helper function to copy the inode and indirect extent blocks of a data
+// file into new blocks, sharing its data blocks. The inode must be locked
+// by lock_tree.
+// Returns the new inode block, or 0 if the disk is full
+blocknum_t FileSys::copy_file(blocknum_t file_block) {
+  inode_t inode;
+  bfs.read_block(file_block, (void *) &inode);
+  ExtentMap extent_map;
+  extent_map.load(bfs, inode);
+  
+  // The inode copy comes first, then its indirect blocks
+  vector<blocknum_t> blocks(1 + extent_map.num_indirect());
+  if (!bfs.get_free_blocks(blocks.size(), blocks.data(), file_block)) {
+    return 0;
+  }
+  vector<blocknum_t> data_blocks;
+  extent_map.all_blocks(data_blocks);
+  data_blocks.resize(extent_map.num_blocks());
+  bfs.share_blocks(data_blocks.data(), data_blocks.size());
+  
+  if (inode.magic != INODE_INLINE_MAGIC_NUM) {
+    extent_map.set_indirect(vector<blocknum_t>(blocks.begin() + 1, blocks.end()));
+    extent_map.store(bfs, inode);
+  }
+  bfs.write_block(blocks[0], (void *) &inode);
+  return blocks[0];
+}
+
+// Helper function to count the blocks of a tree made by copy_dir, adding
+// the number of directories in it to dirs
+int FileSys::count_tree(blocknum_t dir, int &dirs) {
+  Directory directory(bfs, dir);
+  vector<dirent_t> entries;
+  directory.entries(entries);
+  int blocks = count_blocks(dir, true);
+  dirs++;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].type == DIRENT_DIR) {
+      blocks += count_tree(entries[i].block_num, dirs);
+    } else {
+      blocks += count_blocks(entries[i].block_num, false);
+    }
   }
+  return blocks;
+}
+
+// Helper function to reclaim a tree made by copy_dir, everything in it
+// first. Data blocks still shared only lose a reference.
+void FileSys::drop_tree(blocknum_t dir) {
+  Directory directory(bfs, dir);
+  vector<dirent_t> entries;
+  directory.entries(entries);
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].type == DIRENT_DIR) {
+      drop_tree(entries[i].block_num);
+    } else {
+      reclaim_blocks(entries[i].block_num, false);
+    }
+  }
+  reclaim_blocks(dir, true);
 }
 
 // make a directory
-void FileSys::mkdir(const char *name)
+void FileSys::mkdir(Session &session, const char *name)
 {
-  // Check if filename is too long
-  if (!check_filename(name)) {
-    cout << "File name is too long" << endl;
+  OpTimer timer(command_metrics, OP_MKDIR, &session.errors);
+  if (!check_writable(session)) {
+    return;
+  }
+  Operation op(bfs);
+  
+  // Find the directory that will hold the new directory and lock it
+  blocknum_t parent;
+  string dir_name;
+  BlockLock parent_lock(locks);
+  if (!resolve_parent(session, name, parent, dir_name) ||
+      !lock_dir(parent_lock, parent, true)) {
+    error(session, "File does not exist");
     return;
   }
   
-  // Check if file already exists
-  bool is_dir;
-  if (find_file(name, is_dir) != 0) {
-    cout << "File exists" << endl;
+  // Check if filename is too long
+  if (!check_filename(dir_name)) {
+    error(session, "File name is too long");
     return;
   }
   
-  // Check if directory is full
-  struct dirblock_t dir_block;
-  bfs.read_block(curr_dir, (void *) &dir_block);
-  if (dir_block.num_entries >= MAX_DIR_ENTRIES) {
-    cout << "Directory is full" << endl;
+  // Check if file already exists
+  bool is_dir;
+  if (lookup(parent, dir_name, is_dir) != 0) {
+    error(session, "File exists");
     return;
   }
   
-  // Get a free block for the new directory
-  short new_dir_block = bfs.get_free_block();
+  // Get a free block for the new directory near its parent
+  blocknum_t new_dir_block = bfs.get_free_block(parent);
   if (new_dir_block == 0) {
-    cout << "Disk is full" << endl;
+    error(session, "Disk is full");
     return;
   }
   
   // Initialize the new directory block
-  struct dirblock_t new_dir;
-  new_dir.magic = DIR_MAGIC_NUM;
-  new_dir.num_entries = 0;
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-    new_dir.dir_entries[i].block_num = 0;
-  }
-  
-  // Write the new directory block to disk
-  bfs.write_block(new_dir_block, (void *) &new_dir);
+  Directory::init(bfs, new_dir_block, parent);
   
-  // Add the new directory to the current directory
-  strcpy(dir_block.dir_entries[dir_block.num_entries].name, name);
-  dir_block.dir_entries[dir_block.num_entries].block_num = new_dir_block;
-  dir_block.num_entries++;
-  
-  // Write the updated current directory block back to disk
-  bfs.write_block(curr_dir, (void *) &dir_block);
+  // Add the new directory to its parent
+  Directory dir(bfs, parent);
+  if (!dir.add(dir_name.c_str(), new_dir_block, DIRENT_DIR)) {
+    bfs.reclaim_block(new_dir_block);
+    error(session, "Disk is full");
+    return;
+  }
+  dentries.insert(parent, dir_name, new_dir_block, true);
 }
 
 // switch to a directory
-void FileSys::cd(const char *name)
+void FileSys::cd(Session &session, const char *name)
 {
+  OpTimer timer(command_metrics, OP_CD, &session.errors);
+  blocknum_t parent;
+  string dir_name;
   bool is_dir;
-  short dir_block = find_file(name, is_dir);
+  blocknum_t dir_block = 0;
+  BlockLock parent_lock(locks);
+  if (resolve_parent(session, name, parent, dir_name) &&
+      lock_dir(parent_lock, parent, false)) {
+    dir_block = lookup(parent, dir_name, is_dir);
+  }
+  parent_lock.unlock();
   
   // Check if file exists
   if (dir_block == 0) {
-    cout << "File does not exist" << endl;
+    error(session, "File does not exist");
     return;
   }
   
   // Check if file is a directory
   if (!is_dir) {
-    cout << "File is not a directory" << endl;
+    error(session, "File is not a directory");
+    return;
+  }
+  
+  // Hold the directory while it becomes current so it cannot be removed
+  // in between. It is locked on its own since it may be "." or "..".
+  BlockLock dir_lock(locks);
+  if (!lock_dir(dir_lock, dir_block, false)) {
+    error(session, "File does not exist");
     return;
   }
   
   // Update current directory
-  curr_dir = dir_block;
+  set_dir(session, dir_block);
 }
 
 // switch to home directory
-void FileSys::home() {
-  curr_dir = 1; // Home directory is always block 1
+void FileSys::home(Session &session) {
+  OpTimer timer(command_metrics, OP_HOME, &session.errors);
+  set_dir(session, root); // Home directory is the root directory
 }
 
 // remove a directory
-void FileSys::rmdir(const char *name)
+void FileSys::rmdir(Session &session, const char *name)
 {
-  bool is_dir;
-  short dir_block =  find_file(name, is_dir);
-  
-  // Check if file exists
-  if (dir_block == 0) {
-    cout << "File does not exist" << endl;
-    return;
-  }
-  
-  // Check if file is a directory
-  if (!is_dir) {
-    cout << "File is not a directory" << endl;
-    return;
-  }
-  
-  // Check if directory is empty
-  struct dirblock_t dir;
-  bfs.read_block(dir_block, (void *) &dir);
-  if (dir.num_entries > 0) {
-    cout << "Directory is not empty" << endl;
+  OpTimer timer(command_metrics, OP_RMDIR, &session.errors);
+  if (!check_writable(session)) {
     return;
   }
-  
-  // Remove the directory entry from the current directory
-  struct dirblock_t curr_dir_block;
-  bfs.read_block(curr_dir, (void *) &curr_dir_block);
-  
-  int entry_idx = -1;
-  for (int i = 0; i < curr_dir_block.num_entries; i++) {
-    if (strcmp(curr_dir_block.dir_entries[i].name, name) == 0) {
-      entry_idx = i;
-      break;
+  // Start over reserving more room in the journal if freeing the
+  // directory's blocks needs it
+  int blocks = OP_JOURNAL_BLOCKS;
+  while (true) {
+    Operation op(bfs, blocks);
+    if (!op.ok()) {
+      error(session, "Operation is too large for the journal");
+      return;
+    }
+    
+    blocknum_t parent_block;
+    string dir_name;
+    bool is_dir;
+    blocknum_t dir_block = 0;
+    BlockLock parent_lock(locks);
+    if (resolve_parent(session, name, parent_block, dir_name) &&
+        lock_dir(parent_lock, parent_block, true)) {
+      dir_block = lookup(parent_block, dir_name, is_dir);
+    }
+    
+    // Check if file exists
+    if (dir_block == 0) {
+      error(session, "File does not exist");
+      return;
+    }
+    
+    // Check if file is a directory
+    if (!is_dir) {
+      error(session, "File is not a directory");
+      return;
+    }
+    
+    // A directory can only be removed through its name in its parent
+    if (dir_name == "." || dir_name == "..") {
+      error(session, "Invalid directory name");
+      return;
+    }
+    
+    // Lock the directory itself so no command is working inside it
+    BlockLock dir_lock(locks, dir_block, true);
+    
+    // Check that the directory is not the root or any session's current
+    // directory
+    bool in_use;
+    {
+      lock_guard<mutex> guard(session_lock);
+      in_use = session_dirs.count(dir_block) > 0;
+    }
+    if (dir_block == root || in_use) {
+      error(session, "Directory is in use");
+      return;
+    }
+    
+    // Check if directory is empty
+    Directory dir(bfs, dir_block);
+    if (dir.size() > 0) {
+      error(session, "Directory is not empty");
+      return;
+    }
+    
+    // Freeing the blocks changes the bitmap and reference counts
+    blocks = OP_JOURNAL_BLOCKS + bfs.bitmap_op_blocks(count_blocks(dir_block, true));
+    if (!op.reserve(blocks)) {
+      continue;
     }
+    
+    // Remove the directory entry from its parent and forget the names
+    // cached under it
+    Directory parent(bfs, parent_block);
+    parent.remove(dir_name.c_str());
+    dentries.insert(parent_block, dir_name, 0, false);
+    dentries.forget_dir(dir_block);
+    
+    // Reclaim the directory blocks
+    reclaim_blocks(dir_block, true);
+    return;
   }
-  
-  // Shift remaining entries to fill the gap
-  for (int i = entry_idx; i < curr_dir_block.num_entries - 1; i++) {
-    strcpy(curr_dir_block.dir_entries[i].name, curr_dir_block.dir_entries[i+1].name);
-    curr_dir_block.dir_entries[i].block_num = curr_dir_block.dir_entries[i+1].block_num;
-  }
-  
-  // Update the entry count and clear the last entry
-  curr_dir_block.num_entries--;
-  curr_dir_block.dir_entries[curr_dir_block.num_entries].block_num = 0;
-  
-  // Write the updated current directory block back to disk
-  bfs.write_block(curr_dir, (void *) &curr_dir_block);
-  
-  // Reclaim the directory block
-  bfs.reclaim_block(dir_block);
 }
 
 // list the contents of current directory
-void FileSys::ls()
+void FileSys::ls(Session &session)
 {
-  struct dirblock_t dir_block;
-  bfs.read_block(curr_dir, (void *) &dir_block);
-  
-  for (int i = 0; i < dir_block.num_entries; i++) {
-    cout << dir_block.dir_entries[i].name;
+  OpTimer timer(command_metrics, OP_LS, &session.errors);
+  ostream &out = *session.out;
+  BlockLock lock(locks, session.curr_dir, false);
+  Directory dir(bfs, session.curr_dir);
+  vector<dirent_t> entries;
+  dir.entries(entries);
+  
+  for (size_t i = 0; i < entries.size(); i++) {
+    out << entries[i].name;
     
-    // Add a "/" suffix for directories
-    if (is_directory(dir_block.dir_entries[i].block_num)) {
-      cout << "/";
+    // Add a "/" suffix for directories, using the type in the entry
+    bool is_dir = (entries[i].type == DIRENT_DIR);
+    if (entries[i].type == DIRENT_UNKNOWN) {
+      is_dir = is_directory(entries[i].block_num);
+    }
+    if (is_dir) {
+      out << "/";
     }
     
-    cout << endl;
+    out << endl;
   }
 }
 
 // create an empty data file
-void FileSys::create(const char *name)
+void FileSys::create(Session &session, const char *name)
 {
-  // Check if filename is too long
-  if (!check_filename(name)) {
-    cout << "File name is too long" << endl;
+  OpTimer timer(command_metrics, OP_CREATE, &session.errors);
+  if (!check_writable(session)) {
     return;
   }
+  Operation op(bfs);
   
-  // Check if file already exists
-  bool is_dir;
-  if (find_file(name, is_dir) != 0) {
-    cout << "File exists" << endl;
-    return;
+  BlockLock file_lock(locks);
+  create_file(session, name, file_lock);
+}
+
+// Helper function to create an empty data file at path and lock its
+// inode exclusively in lock before its directory is unlocked
+// Returns the inode block, or 0 (after displaying an error) if the file
+// cannot be created
+blocknum_t FileSys::create_file(Session &session, const char *path, BlockLock &lock) {
+  // Find the directory that will hold the file and lock it
+  blocknum_t dir_block;
+  string file_name;
+  BlockLock dir_lock(locks);
+  if (!resolve_parent(session, path, dir_block, file_name) ||
+      !lock_dir(dir_lock, dir_block, true)) {
+    error(session, "File does not exist");
+    return 0;
   }
   
-  // Check if directory is full
-  struct dirblock_t dir_block;
-  bfs.read_block(curr_dir, (void *) &dir_block);
-  if (dir_block.num_entries >= MAX_DIR_ENTRIES) {
-    cout << "Directory is full" << endl;
-    return;
+  // Check if filename is too long
+  if (!check_filename(file_name)) {
+    error(session, "File name is too long");
+    return 0;
+  }
+  
+  // Check if file already exists
+  bool is_dir;
+  if (lookup(dir_block, file_name, is_dir) != 0) {
+    error(session, "File exists");
+    return 0;
   }
   
-  // Get a free block for the inode
-  short inode_block = bfs.get_free_block();
+  // Get a free block for the inode near its directory
+  blocknum_t inode_block = bfs.get_free_block(dir_block);
   if (inode_block == 0) {
-    cout << "Disk is full" << endl;
-    return;
+    error(session, "Disk is full");
+    return 0;
   }
   
-  // Initialize the inode
+  // Initialize the inode with no data, kept inline until it outgrows it
   struct inode_t inode;
-  inode.magic = INODE_MAGIC_NUM;
+  memset(&inode, 0, sizeof(inode));
+  inode.magic = INODE_INLINE_MAGIC_NUM;
   inode.size = 0;
-  for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
-    inode.blocks[i] = 0;
-  }
   
   // Write the inode to disk
   bfs.write_block(inode_block, (void *) &inode);
   
-  // Add the file to the current directory
-  strcpy(dir_block.dir_entries[dir_block.num_entries].name, name);
-  dir_block.dir_entries[dir_block.num_entries].block_num = inode_block;
-  dir_block.num_entries++;
-  
-  // Write the updated current directory block back to disk
-  bfs.write_block(curr_dir, (void *) &dir_block);
+  // Add the file to its directory
+  Directory dir(bfs, dir_block);
+  if (!dir.add(file_name.c_str(), inode_block, DIRENT_FILE)) {
+    bfs.reclaim_block(inode_block);
+    error(session, "Disk is full");
+    return 0;
+  }
+  dentries.insert(dir_block, file_name, inode_block, false);
+  lock.lock(inode_block, true);
+  return inode_block;
 }
 
 // append data to a data file
-void FileSys::append(const char *name, const char *data)
+void FileSys::append(Session &session, const char *name, const char *data)
 {
-  bool is_dir;
-  short file_block = find_file(name, is_dir);
-  
-  // Check if file exists
-  if (file_block == 0) {
-    cout << "File does not exist" << endl;
+  OpTimer timer(command_metrics, OP_APPEND, &session.errors);
+  if (!check_writable(session)) {
     return;
   }
-  
-  // Check if it's a directory
-  if (is_dir) {
-    cout << "File is a directory" << endl;
+  // Start over reserving more room in the journal if the data needs it
+  int blocks = OP_JOURNAL_BLOCKS;
+  while (true) {
+    Operation op(bfs, blocks);
+    if (!op.ok()) {
+      error(session, "Operation is too large for the journal");
+      return;
+    }
+    
+    BlockLock file_lock(locks);
+    blocknum_t file_block = lock_file(session, name, file_lock, true);
+    if (file_block == 0) {
+      return;
+    }
+    
+    // Get the inode, from memory if the file is open
+    OpenFile scratch;
+    OpenFile &file = load_file(file_block, scratch);
+    
+    // Check if append would exceed maximum file size
+    unsigned int data_len = strlen(data);
+    if (data_len > MAX_FILE_SIZE - file.inode.size) {
+      error(session, "Append exceeds maximum file size");
+      return;
+    }
+    blocks = write_changes(file, file.inode.size, data_len);
+    if (!op.reserve(blocks)) {
+      continue;
+    }
+    
+    // Write the data at the end of the file
+    write_data(session, file_block, file, file.inode.size, data, data_len);
+    return;
+  }
+}
+
+// display the contents of a data file
+void FileSys::cat(Session &session, const char *name)
+{
+  OpTimer timer(command_metrics, OP_CAT, &session.errors);
+  ostream &out = *session.out;
+  BlockLock file_lock(locks);
+  blocknum_t file_block = lock_file(session, name, file_lock, false);
+  if (file_block == 0) {
     return;
   }
   
-  // Read the inode
-  struct inode_t inode;
-  bfs.read_block(file_block, (void *) &inode);
-  
-  // Calculate new size after append
-  unsigned int data_len = strlen(data);
-  unsigned int new_size = inode.size + data_len;
+  // Get the inode, from memory if the file is open
+  OpenFile scratch;
+  OpenFile &file = load_file(file_block, scratch);
   
-  // Check if append would exceed maximum file size
-  if (new_size > MAX_FILE_SIZE) {
-    cout << "Append exceeds maximum file size" << endl;
+  // Display file contents
+  display(session, file, 0, file.inode.size);
+  out << endl;
+}
+
+// display the last N bytes of the file
+void FileSys::tail(Session &session, const char *name, unsigned int n)
+{
+  OpTimer timer(command_metrics, OP_TAIL, &session.errors);
+  ostream &out = *session.out;
+  BlockLock file_lock(locks);
+  blocknum_t file_block = lock_file(session, name, file_lock, false);
+  if (file_block == 0) {
     return;
   }
   
-  // Calculate which blocks we need to use
-  unsigned int start_block = inode.size / BLOCK_SIZE;
-  unsigned int start_offset = inode.size % BLOCK_SIZE;
-  unsigned int end_block = new_size / BLOCK_SIZE;
-  unsigned int end_offset = new_size % BLOCK_SIZE;
+  // Get the inode, from memory if the file is open
+  OpenFile scratch;
+  OpenFile &file = load_file(file_block, scratch);
+  unsigned int size = file.inode.size;
   
-  // If end_offset is 0 and new_size > 0, adjust end values
-  if (end_offset == 0 && new_size > 0) {
-    end_block--;
-    end_offset = BLOCK_SIZE;
-  }
+  // If n is greater than or equal to file size, just display the whole file
+  unsigned int start_pos = (n >= size) ? 0 : size - n;
   
-  // Check if we need more blocks than available
-  if (end_block >= MAX_DATA_BLOCKS) {
-    cout << "Append exceeds maximum file size" << endl;
+  // Display last n bytes
+  display(session, file, start_pos, size - start_pos);
+  out << endl;
+}
+
+// delete a data file
+void FileSys::rm(Session &session, const char *name)
+{
+  OpTimer timer(command_metrics, OP_RM, &session.errors);
+  if (!check_writable(session)) {
     return;
   }
-  
-  // Calculate how many new blocks we need
-  int new_blocks_needed = 0;
-  for (unsigned int i = start_block; i <= end_block; i++) {
-    if (inode.blocks[i] == 0) {
-      new_blocks_needed++;
+  // Start over reserving more room in the journal if freeing the
+  // file's blocks needs it
+  int blocks = OP_JOURNAL_BLOCKS;
+  while (true) {
+    Operation op(bfs, blocks);
+    if (!op.ok()) {
+      error(session, "Operation is too large for the journal");
+      return;
     }
-  }
-  
-  // Verify we have enough disk space
-  if (new_blocks_needed > 0) {
-    // Check available blocks without actually allocating them yet
-    struct superblock_t super_block;
-    bfs.read_block(0, (void *) &super_block);
     
-    int free_blocks = 0;
-    for (int byte = 0; byte < BLOCK_SIZE; byte++) {
-      for (int bit = 0; bit < 8; bit++) {
-        if (!(super_block.bitmap[byte] & (1 << bit))) {
-          free_blocks++;
-          if (free_blocks >= new_blocks_needed) {
-            break;
-          }
-        }
-      }
-      if (free_blocks >= new_blocks_needed) {
-        break;
-      }
+    blocknum_t dir_block;
+    string file_name;
+    bool is_dir;
+    blocknum_t file_block = 0;
+    BlockLock dir_lock(locks);
+    if (resolve_parent(session, name, dir_block, file_name) &&
+        lock_dir(dir_lock, dir_block, true)) {
+      file_block = lookup(dir_block, file_name, is_dir);
     }
     
-    if (free_blocks < new_blocks_needed) {
-      cout << "Disk is full" << endl;
+    // Check if file exists
+    if (file_block == 0) {
+      error(session, "File does not exist");
       return;
     }
-  }
-  
-  // Append data block by block
-  unsigned int data_pos = 0;
-  
-  // Handle first block (may need to read existing data)
-  if (start_block == end_block) {
-    // All data fits in one block
-    struct datablock_t data_block;
     
-    // If block doesn't exist yet, allocate it
-    if (inode.blocks[start_block] == 0) {
-      inode.blocks[start_block] = bfs.get_free_block();
-      memset(data_block.data, 0, BLOCK_SIZE);
-    } else {
-      // Read existing block
-      bfs.read_block(inode.blocks[start_block], (void *) &data_block);
+    // Check if it's a directory
+    if (is_dir) {
+      error(session, "File is a directory");
+      return;
     }
     
-    // Copy data into block
-    memcpy(data_block.data + start_offset, data, data_len);
-    
-    // Write block back to disk
-    bfs.write_block(inode.blocks[start_block], (void *) &data_block);
-  } else {
-    // Data spans multiple blocks
-    
-    // Handle first block if it exists
-    if (start_offset > 0 || inode.blocks[start_block] != 0) {
-      struct datablock_t data_block;
-      
-      // If block doesn't exist yet, allocate it
-      if (inode.blocks[start_block] == 0) {
-        inode.blocks[start_block] = bfs.get_free_block();
-        memset(data_block.data, 0, BLOCK_SIZE);
-      } else {
-        // Read existing block
-        bfs.read_block(inode.blocks[start_block], (void *) &data_block);
-      }
-      
-      // Copy data into block
-      unsigned int bytes_to_copy = BLOCK_SIZE - start_offset;
-      memcpy(data_block.data + start_offset, data, bytes_to_copy);
-      
-      // Write block back to disk
-      bfs.write_block(inode.blocks[start_block], (void *) &data_block);
-      
-      // Update data position
-      data_pos += bytes_to_copy;
+    // Check if the file is open, waiting for commands using it to finish
+    BlockLock file_lock(locks, file_block, true);
+    bool in_use;
+    {
+      lock_guard<mutex> guard(open_lock);
+      in_use = open_files.count(file_block) > 0;
     }
-    
-    // Handle middle blocks (full blocks)
-    for (unsigned int i = start_block + 1; i < end_block; i++) {
-      struct datablock_t data_block;
-      
-      // Allocate new block if needed
-      if (inode.blocks[i] == 0) {
-        inode.blocks[i] = bfs.get_free_block();
-      }
-      
-      // Copy full block of data
-      memcpy(data_block.data, data + data_pos, BLOCK_SIZE);
-      
-      // Write block to disk
-      bfs.write_block(inode.blocks[i], (void *) &data_block);
-      
-      // Update data position
-      data_pos += BLOCK_SIZE;
+    if (in_use) {
+      error(session, "File is in use");
+      return;
     }
     
-    // Handle last block if needed
-    if (end_offset > 0) {
-      struct datablock_t data_block;
-      
-      // Allocate new block if needed
-      if (inode.blocks[end_block] == 0) {
-        inode.blocks[end_block] = bfs.get_free_block();
-        memset(data_block.data, 0, BLOCK_SIZE);
-      } else {
-        // Read existing block
-        bfs.read_block(inode.blocks[end_block], (void *) &data_block);
-      }
-      
-      // Copy remaining data
-      memcpy(data_block.data, data + data_pos, end_offset);
-      
-      // Write block to disk
-      bfs.write_block(inode.blocks[end_block], (void *) &data_block);
+    // Freeing the blocks changes the bitmap and reference counts
+    blocks = OP_JOURNAL_BLOCKS + bfs.bitmap_op_blocks(count_blocks(file_block, false));
+    if (!op.reserve(blocks)) {
+      continue;
     }
+    
+    // Remove the file entry from its directory
+    Directory dir(bfs, dir_block);
+    dir.remove(file_name.c_str());
+    dentries.insert(dir_block, file_name, 0, false);
+    
+    // Reclaim all blocks used by the file
+    reclaim_blocks(file_block, false);
+    return;
   }
-  
-  // Update inode size and write back to disk
-  inode.size = new_size;
-  bfs.write_block(file_block, (void *) &inode);
 }
 
-// display the contents of a data file
-void FileSys::cat(const char *name)
+// display stats about file or directory
+void FileSys::stat(Session &session, const char *name)
 {
+  OpTimer timer(command_metrics, OP_STAT, &session.errors);
+  ostream &out = *session.out;
+  blocknum_t dir_block;
+  string file_name;
   bool is_dir;
-  short file_block = find_file(name, is_dir);
+  blocknum_t block_num = 0;
+  BlockLock dir_lock(locks);
+  if (resolve_parent(session, name, dir_block, file_name) &&
+      lock_dir(dir_lock, dir_block, false)) {
+    block_num = lookup(dir_block, file_name, is_dir);
+  }
   
   // Check if file exists
-  if (file_block == 0) {
-    cout << "File does not exist" << endl;
+  if (block_num == 0) {
+    error(session, "File does not exist");
     return;
   }
   
-  // Check if it's a directory
   if (is_dir) {
-    cout << "File is a directory" << endl;
-    return;
-  }
-  
-  // Read the inode
-  struct inode_t inode;
-  bfs.read_block(file_block, (void *) &inode);
-  
-  // Display file contents block by block
-  unsigned int bytes_remaining = inode.size;
-  unsigned int block_index = 0;
-  
-  while (bytes_remaining > 0) {
-    // Read the data block
-    struct datablock_t data_block;
-    bfs.read_block(inode.blocks[block_index], (void *) &data_block);
+    // Directory stats, named without the trailing slashes given
+    string dir_name = name;
+    while (dir_name.size() > 1 && dir_name[dir_name.size() - 1] == '/') {
+      dir_name.erase(dir_name.size() - 1);
+    }
+    if (dir_name != "/") {
+      dir_name += "/";
+    }
+    out << "Directory name: " << dir_name << endl;
+    out << "Directory block: " << block_num << endl;
+  } else {
+    // File stats, from memory if the file is open
+    BlockLock file_lock(locks, block_num, false);
+    dir_lock.unlock();
+    OpenFile scratch;
+    OpenFile &file = load_file(block_num, scratch);
+    const inode_t &inode = file.inode;
+    const ExtentMap &extent_map = file.extent_map;
     
-    // Determine how many bytes to display from this block
-    unsigned int bytes_to_display = (bytes_remaining < BLOCK_SIZE) ? bytes_remaining : BLOCK_SIZE;
+    // Calculate number of blocks (inode block + data blocks + indirect
+    // extent blocks)
+    int num_blocks = 1 + extent_map.num_blocks() + extent_map.num_indirect();
     
-    // Display the data one character at a time
-    for (unsigned int i = 0; i < bytes_to_display; i++) {
-      cout << data_block.data[i];
+    // First data block (0 if empty or inline file)
+    blocknum_t first_block = 0;
+    if (!extent_map.get_extents().empty()) {
+      first_block = extent_map.get_extents()[0].start;
     }
     
-    // Update remaining bytes and block index
-    bytes_remaining -= bytes_to_display;
-    block_index++;
+    out << "Inode block: " << block_num << endl;
+    out << "Bytes in file: " << inode.size << endl;
+    out << "Number of blocks: " << num_blocks << endl;
+    out << "First block: " << first_block << endl;
+    out << "Number of extents: " << extent_map.get_extents().size() << endl;
   }
-  
-  cout << endl;
 }
 
-// display the last N bytes of the file
-void FileSys::tail(const char *name, unsigned int n)
+
+// open a data file and display its handle
+void FileSys::open(Session &session, const char *name)
 {
-  bool is_dir;
-  short file_block = find_file(name, is_dir);
-  
-  // Check if file exists
+  OpTimer timer(command_metrics, OP_OPEN, &session.errors);
+  ostream &out = *session.out;
+  BlockLock file_lock(locks);
+  blocknum_t file_block = lock_file(session, name, file_lock, false);
   if (file_block == 0) {
-    cout << "File does not exist" << endl;
     return;
   }
   
-  // Check if it's a directory
-  if (is_dir) {
-    cout << "File is a directory" << endl;
-    return;
+  // Keep the inode in memory while any handle to the file is open
+  {
+    lock_guard<mutex> guard(open_lock);
+    map<blocknum_t, OpenFile>::iterator it = open_files.find(file_block);
+    if (it == open_files.end()) {
+      OpenFile &file = open_files[file_block];
+      bfs.read_block(file_block, (void *) &file.inode);
+      file.extent_map.load(bfs, file.inode);
+      file.refs = 1;
+    } else {
+      it->second.refs++;
+    }
   }
   
-  // Read the inode
-  struct inode_t inode;
-  bfs.read_block(file_block, (void *) &inode);
+  int handle = session.next_handle++;
+  session.handles[handle] = file_block;
+  out << "File handle: " << handle << endl;
+}
+
+// close a file handle
+void FileSys::close(Session &session, int handle)
+{
+  OpTimer timer(command_metrics, OP_CLOSE, &session.errors);
+  blocknum_t file_block = find_handle(session, handle);
+  if (file_block == 0) {
+    return;
+  }
   
-  // If n is greater than or equal to file size, just display the whole file
-  if (n >= inode.size) {
-    cat(name);
+  // Drop the in-memory inode with the last handle, once no command is
+  // using it
+  BlockLock file_lock(locks, file_block, true);
+  {
+    lock_guard<mutex> guard(open_lock);
+    map<blocknum_t, OpenFile>::iterator file = open_files.find(file_block);
+    if (--file->second.refs == 0) {
+      open_files.erase(file);
+    }
+  }
+  session.handles.erase(handle);
+  session.reading.erase(handle);
+}
+
+// display len bytes of an open file starting at byte offset
+void FileSys::read(Session &session, int handle, unsigned int offset, unsigned int len)
+{
+  OpTimer timer(command_metrics, OP_READ, &session.errors);
+  ostream &out = *session.out;
+  blocknum_t file_block = find_handle(session, handle);
+  if (file_block == 0) {
     return;
   }
   
-  // Calculate starting position
-  unsigned int start_pos = inode.size - n;
-  unsigned int start_block = start_pos / BLOCK_SIZE;
-  unsigned int start_offset = start_pos % BLOCK_SIZE;
+  BlockLock file_lock(locks, file_block, false);
+  OpenFile scratch;
+  OpenFile &file = load_file(file_block, scratch);
   
-  // Display last n bytes
-  unsigned int bytes_remaining = n;
-  unsigned int block_index = start_block;
+  // Stop at the end of the file
+  unsigned int size = file.inode.size;
+  if (offset > size) {
+    offset = size;
+  }
+  if (len > size - offset) {
+    len = size - offset;
+  }
   
-  // Handle first block (may be partial)
-  if (start_offset > 0) {
-    struct datablock_t data_block;
-    bfs.read_block(inode.blocks[block_index], (void *) &data_block);
-    
-    unsigned int bytes_to_display = (bytes_remaining < (BLOCK_SIZE - start_offset)) ? 
-                                     bytes_remaining : (BLOCK_SIZE - start_offset);
-    
-    for (unsigned int i = 0; i < bytes_to_display; i++) {
-      cout << data_block.data[start_offset + i];
+  // A handle read sequentially gets the next window of the file fetched
+  // into the cache while these bytes are displayed
+  unsigned int ahead_first, ahead_count;
+  ReadBatch ahead_batch;
+  vector<datablock_t> ahead_blocks;
+  vector<blocknum_t> ahead_nums;
+  vector<void *> ahead_buffers;
+  bool ahead = (len > 0 &&
+                readahead.plan(session.reading[handle], offset / BLOCK_SIZE, (offset + len - 1) / BLOCK_SIZE,
+                               file.extent_map.num_blocks(), ahead_first, ahead_count));
+  if (ahead) {
+    ahead_blocks.resize(ahead_count);
+    ahead_nums.resize(ahead_count);
+    for (unsigned int i = 0; i < ahead_count; i++) {
+      ahead_buffers.push_back((void *) &ahead_blocks[i]);
     }
-    
-    bytes_remaining -= bytes_to_display;
-    block_index++;
+    file.extent_map.map(ahead_first, ahead_count, ahead_nums.data());
+    bfs.start_read_blocks(ahead_batch, ahead_nums.data(), ahead_buffers.data(), ahead_count);
   }
   
-  // Handle remaining blocks
-  while (bytes_remaining > 0) {
-    struct datablock_t data_block;
-    bfs.read_block(inode.blocks[block_index], (void *) &data_block);
+  display(session, file, offset, len);
+  out << endl;
+  if (ahead) {
+    bfs.finish_read_blocks(ahead_batch);
+  }
+}
+
+// write len bytes of data to an open file starting at byte offset,
+// overwriting existing bytes and extending the file as needed
+void FileSys::write(Session &session, int handle, unsigned int offset, const char *data,
+                    unsigned int len)
+{
+  OpTimer timer(command_metrics, OP_WRITE, &session.errors);
+  if (!check_writable(session)) {
+    return;
+  }
+  // Start over reserving more room in the journal if the data needs it
+  int blocks = OP_JOURNAL_BLOCKS;
+  while (true) {
+    Operation op(bfs, blocks);
+    if (!op.ok()) {
+      error(session, "Operation is too large for the journal");
+      return;
+    }
     
-    unsigned int bytes_to_display = (bytes_remaining < BLOCK_SIZE) ? bytes_remaining : BLOCK_SIZE;
+    blocknum_t file_block = find_handle(session, handle);
+    if (file_block == 0) {
+      return;
+    }
     
-    for (unsigned int i = 0; i < bytes_to_display; i++) {
-      cout << data_block.data[i];
+    // Check if write would exceed maximum file size
+    if (offset > MAX_FILE_SIZE || len > MAX_FILE_SIZE - offset) {
+      error(session, "Write exceeds maximum file size");
+      return;
     }
     
-    bytes_remaining -= bytes_to_display;
-    block_index++;
+    BlockLock file_lock(locks, file_block, true);
+    OpenFile scratch;
+    OpenFile &file = load_file(file_block, scratch);
+    blocks = write_changes(file, offset, len);
+    if (!op.reserve(blocks)) {
+      continue;
+    }
+    write_data(session, file_block, file, offset, data, len);
+    return;
   }
-  
-  cout << endl;
 }
 
-// delete a data file
-void FileSys::rm(const char *name)
+// take a read-only snapshot of the whole file system called name
+void FileSys::mksnap(Session &session, const char *name)
 {
-  bool is_dir;
-  short file_block = find_file(name, is_dir);
-  
-  // Check if file exists
-  if (file_block == 0) {
-    cout << "File does not exist" << endl;
+  OpTimer timer(command_metrics, OP_MKSNAP, &session.errors);
+  if (!check_writable(session)) {
     return;
   }
   
-  // Check if it's a directory
-  if (is_dir) {
-    cout << "File is a directory" << endl;
+  // Snapshots are named like files, without any path
+  string snap_name = name;
+  if (snap_name.empty() || snap_name.find('/') != string::npos ||
+      snap_name == "." || snap_name == "..") {
+    error(session, "Invalid snapshot name");
+    return;
+  }
+  if (!check_filename(snap_name)) {
+    error(session, "File name is too long");
     return;
   }
   
-  // Remove the file entry from the current directory
-  struct dirblock_t dir_block;
-  bfs.read_block(curr_dir, (void *) &dir_block);
+  lock_guard<mutex> guard(snapshot_lock);
   
-  int entry_idx = -1;
-  for (int i = 0; i < dir_block.num_entries; i++) {
-    if (strcmp(dir_block.dir_entries[i].name, name) == 0) {
-      entry_idx = i;
-      break;
+  // The directory listing the snapshots is made with the first one, in an
+  // operation of its own since the reference count table comes with it
+  if (bfs.snapshot_dir() == 0) {
+    Operation op(bfs, OP_JOURNAL_BLOCKS + bfs.snapshot_op_blocks());
+    if (!op.ok()) {
+      error(session, "Operation is too large for the journal");
+      return;
+    }
+    blocknum_t snapshot_dir = bfs.get_free_block(root);
+    if (snapshot_dir == 0) {
+      error(session, "Disk is full");
+      return;
+    }
+    Directory::init(bfs, snapshot_dir, snapshot_dir);
+    if (!bfs.enable_snapshots(snapshot_dir)) {
+      bfs.reclaim_block(snapshot_dir);
+      error(session, "Disk is full");
+      return;
     }
   }
   
-  // Shift remaining entries to fill the gap
-  for (int i = entry_idx; i < dir_block.num_entries - 1; i++) {
-    strcpy(dir_block.dir_entries[i].name, dir_block.dir_entries[i+1].name);
-    dir_block.dir_entries[i].block_num = dir_block.dir_entries[i+1].block_num;
+  // Start over reserving more room in the journal if copying the tree
+  // needs it
+  int blocks = OP_JOURNAL_BLOCKS;
+  while (true) {
+    Operation op(bfs, blocks);
+    if (!op.ok()) {
+      error(session, "Operation is too large for the journal");
+      return;
+    }
+    
+    Directory snapshots(bfs, bfs.snapshot_dir());
+    unsigned char type;
+    if (snapshots.lookup(name, type) != 0) {
+      error(session, "Snapshot exists");
+      return;
+    }
+    if (snapshots.size() >= (unsigned int) MAX_SNAPSHOTS) {
+      error(session, "Too many snapshots");
+      return;
+    }
+    
+    // Lock the whole tree, holding every part of it until the copy is
+    // complete, which tells how much the copy changes
+    list<BlockLock> held;
+    int data = 0;
+    int changes = lock_tree(held, root, data);
+    blocks = OP_JOURNAL_BLOCKS + changes + bfs.bitmap_op_blocks(changes + data);
+    if (!op.reserve(blocks)) {
+      continue;
+    }
+    
+    blocknum_t copy = copy_dir(root, 0);
+    held.clear();
+    if (copy == 0) {
+      error(session, "Disk is full");
+      return;
+    }
+    if (!snapshots.add(name, copy, DIRENT_DIR)) {
+      drop_tree(copy);
+      error(session, "Disk is full");
+    }
+    return;
   }
-  
-  // Update the entry count and clear the last entry
-  dir_block.num_entries--;
-  dir_block.dir_entries[dir_block.num_entries].block_num = 0;
-  
-  // Write the updated directory block back to disk
-  bfs.write_block(curr_dir, (void *) &dir_block);
-  
-  // Reclaim all blocks used by the file
-  reclaim_blocks(file_block, false);
 }
 
-// display stats about file or directory
-void FileSys::stat(const char *name)
+// list the snapshots
+void FileSys::lssnap(Session &session)
 {
-  bool is_dir;
-  short block_num = find_file(name, is_dir);
-  
-  // Check if file exists
-  if (block_num == 0) {
-    cout << "File does not exist" << endl;
+  OpTimer timer(command_metrics, OP_LSSNAP, &session.errors);
+  ostream &out = *session.out;
+  lock_guard<mutex> guard(snapshot_lock);
+  if (bfs.snapshot_dir() == 0) {
     return;
   }
   
-  if (is_dir) {
-    // Directory stats
-    struct dirblock_t dir_block;
-    bfs.read_block(block_num, (void *) &dir_block);
-    
-    cout << "Directory name: " << name << "/" << endl;
-    cout << "Directory block: " << block_num << endl;
-  } else {
-    // File stats
-    struct inode_t inode;
-    bfs.read_block(block_num, (void *) &inode);
+  // List them by name
+  Directory snapshots(bfs, bfs.snapshot_dir());
+  vector<dirent_t> entries;
+  snapshots.entries(entries);
+  vector<string> names;
+  for (size_t i = 0; i < entries.size(); i++) {
+    names.push_back(entries[i].name);
+  }
+  sort(names.begin(), names.end());
+  for (size_t i = 0; i < names.size(); i++) {
+    out << names[i] << endl;
+  }
+}
+
+// delete a snapshot
+void FileSys::rmsnap(Session &session, const char *name)
+{
+  OpTimer timer(command_metrics, OP_RMSNAP, &session.errors);
+  if (!check_writable(session)) {
+    return;
+  }
+  lock_guard<mutex> guard(snapshot_lock);
+  
+  // Start over reserving more room in the journal if dropping the tree
+  // needs it
+  int blocks = OP_JOURNAL_BLOCKS;
+  while (true) {
+    Operation op(bfs, blocks);
+    if (!op.ok()) {
+      error(session, "Operation is too large for the journal");
+      return;
+    }
     
-    // Calculate number of blocks (inode block + data blocks)
-    int num_blocks = 1; // Start with 1 for the inode block
-    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
-      if (inode.blocks[i] != 0) {
-        num_blocks++;
-      }
+    blocknum_t snapshot = 0;
+    unsigned char type;
+    if (bfs.snapshot_dir() != 0) {
+      Directory snapshots(bfs, bfs.snapshot_dir());
+      snapshot = snapshots.lookup(name, type);
+    }
+    if (snapshot == 0) {
+      error(session, "Snapshot does not exist");
+      return;
     }
     
-    // First data block (0 if empty file)
-    short first_block = 0;
-    if (inode.size > 0) {
-      first_block = inode.blocks[0];
+    // Dropping the tree marks each directory removed and changes the
+    // bitmap and reference counts
+    int dirs = 0;
+    int tree_blocks = count_tree(snapshot, dirs);
+    blocks = OP_JOURNAL_BLOCKS + dirs + bfs.bitmap_op_blocks(tree_blocks);
+    if (!op.reserve(blocks)) {
+      continue;
     }
     
-    cout << "Inode block: " << block_num << endl;
-    cout << "Bytes in file: " << inode.size << endl;
-    cout << "Number of blocks: " << num_blocks << endl;
-    cout << "First block: " << first_block << endl;
+    // Reclaim the copied tree; its data blocks lose a reference each
+    Directory snapshots(bfs, bfs.snapshot_dir());
+    snapshots.remove(name);
+    drop_tree(snapshot);
+    return;
+  }
+}
+
+// copy host file host_path ("-" - standard input) into a new data file,
+// in a local session only
+void FileSys::import_file(Session &session, const char *host_path, const char *name)
+{
+  OpTimer timer(command_metrics, OP_IMPORT, &session.errors);
+  if (!check_writable(session) || !check_local(session)) {
+    return;
+  }
+  bool from_stdin = (strcmp(host_path, "-") == 0);
+  FILE *in = from_stdin ? stdin : fopen(host_path, "rb");
+  if (in == NULL) {
+    error(session, "Could not open host file");
+    return;
+  }
+  
+  // Read the data into reserved blocks first, outside any operation
+  inode_t inode;
+  ExtentMap extent_map;
+  bool imported = import_data(session, in, inode, extent_map);
+  if (!from_stdin) {
+    fclose(in);
+  }
+  if (!imported) {
+    return;
+  }
+  
+  // Then link the file in with one operation: its entry, the inode and
+  // extents, and the bitmap recording its blocks. If it cannot be made,
+  // the blocks are given back and nothing is left behind.
+  vector<blocknum_t> blocks;
+  extent_map.all_blocks(blocks);
+  Operation op(bfs, OP_JOURNAL_BLOCKS + extent_map.num_indirect() +
+                    bfs.bitmap_op_blocks(blocks.size()));
+  BlockLock file_lock(locks);
+  blocknum_t file_block = 0;
+  if (!op.ok()) {
+    error(session, "Operation is too large for the journal");
+  } else {
+    file_block = create_file(session, name, file_lock);
+  }
+  if (file_block == 0) {
+    bfs.unreserve_blocks(blocks.data(), blocks.size());
+    return;
+  }
+  bfs.claim_blocks(blocks.data(), blocks.size());
+  if (extent_map.num_blocks() > 0) {
+    extent_map.store(bfs, inode);
   }
+  bfs.write_block(file_block, (void *) &inode);
 }
 
+// copy a data file to host file host_path ("-" - the output), replacing
+// its contents, in a local session only
+void FileSys::export_file(Session &session, const char *name, const char *host_path)
+{
+  OpTimer timer(command_metrics, OP_EXPORT, &session.errors);
+  if (!check_local(session)) {
+    return;
+  }
+  BlockLock file_lock(locks);
+  blocknum_t file_block = lock_file(session, name, file_lock, false);
+  if (file_block == 0) {
+    return;
+  }
+  
+  // Get the inode, from memory if the file is open
+  OpenFile scratch;
+  OpenFile &file = load_file(file_block, scratch);
+  
+  // The output takes the bytes as cat displays them
+  if (strcmp(host_path, "-") == 0) {
+    display(session, file, 0, file.inode.size);
+    return;
+  }
+  
+  int fd = ::open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    error(session, "Could not create host file");
+    return;
+  }
+  bool written = export_data(file, fd);
+  if (::close(fd) != 0 || !written) {
+    error(session, "Could not write host file");
+  }
+}
@@ -1,62 +1,200 @@
 // Computing Systems: File System
 // Implements the file system commands that are available to the shell.
+// Commands may run in several threads at once, each for its own session.
 
 #ifndef FILESYS_H
 #define FILESYS_H
 
+#include <cstdio>
+#include <string>
+#include <iostream>
+#include <map>
+#include <set>
+#include <list>
+#include <mutex>
+#include <functional>
+#include <unistd.h>
 #include "BasicFileSys.h"
+#include "DentryCache.h"
+#include "ExtentMap.h"
+#include "LockTable.h"
+#include "Metrics.h"
+#include "Readahead.h"
+#include "Blocks.h"
+
+// One user of the file system, with its own current directory, file
+// handles and output. A session is used by one thread at a time.
+struct Session {
+  blocknum_t curr_dir;			// current directory
+  std::map<int, blocknum_t> handles;	// inode block of each handle
+  std::map<int, ReadaheadState> reading;	// how each handle is being read
+  int next_handle;			// next handle to give out
+  std::ostream *out;			// where command output goes
+  std::ostream *err;			// where command line errors go
+  int out_fd;				// descriptor behind out that file data
+					// is written to directly (-1 - none)
+  unsigned long errors;			// errors reported by commands
+  int id;				// number of the session (from 1)
+  bool local;				// true if the session may reach host
+					// files (the shell's own, not a
+					// server client or a replayed trace)
+
+  Session()
+    : curr_dir(0), next_handle(1), out(&std::cout), err(&std::cerr),
+      out_fd(STDOUT_FILENO), errors(0), id(0), local(false) {}
+};
+
+// Runs one command line for a session. Returns true if the session quit.
+typedef std::function<bool(Session &, const std::string &)> CommandHandler;
 
 class FileSys {
   
   public:
     // mounts the file system
-    void mount();
+    void mount(const MountOptions &options = MountOptions());
 
     // unmounts the file system
     void unmount();
 
+    // write all cached changes to disk
+    void sync();
+
+    // display block and dentry cache, disk and journal statistics
+    void cachestat(Session &session);
+
+    // display the calls, errors, latencies and disk blocks of each command,
+    // with allocator, cache and disk statistics
+    void metrics(Session &session);
+
+    // write the metrics as a JSON object to out
+    void write_metrics(std::ostream &out);
+
+    // returns the basic file system (for statistics)
+    const BasicFileSys &basic() const { return bfs; }
+
+    // start a session in the root directory, numbering it
+    void start_session(Session &session);
+
+    // end a session, closing its file handles
+    void end_session(Session &session);
+
     // make a directory
-    void mkdir(const char *name);
+    void mkdir(Session &session, const char *name);
 
     // switch to a directory
-    void cd(const char *name);
+    void cd(Session &session, const char *name);
     
     // switch to home directory
-    void home();
+    void home(Session &session);
     
     // remove a directory
-    void rmdir(const char *name);
+    void rmdir(Session &session, const char *name);
 
     // list the contents of current directory
-    void ls();
+    void ls(Session &session);
 
     // create an empty data file
-    void create(const char *name);
+    void create(Session &session, const char *name);
 
     // append data to a data file
-    void append(const char *name, const char *data);
+    void append(Session &session, const char *name, const char *data);
 
     // display the contents of a data file
-    void cat(const char *name);
+    void cat(Session &session, const char *name);
 
     // display the last N bytes of the file
-    void tail(const char *name, unsigned int n);
+    void tail(Session &session, const char *name, unsigned int n);
 
     // delete a data file
-    void rm(const char *name);
+    void rm(Session &session, const char *name);
 
     // display stats about file or directory
-    void stat(const char *name);
+    void stat(Session &session, const char *name);
+
+    // open a data file and display its handle
+    void open(Session &session, const char *name);
+
+    // close a file handle
+    void close(Session &session, int handle);
+
+    // display len bytes of an open file starting at byte offset
+    void read(Session &session, int handle, unsigned int offset, unsigned int len);
+
+    // write len bytes of data to an open file starting at byte offset,
+    // overwriting existing bytes and extending the file as needed
+    void write(Session &session, int handle, unsigned int offset, const char *data,
+               unsigned int len);
+
+    // take a read-only snapshot of the whole file system called name
+    void mksnap(Session &session, const char *name);
+
+    // list the snapshots
+    void lssnap(Session &session);
+
+    // delete a snapshot
+    void rmsnap(Session &session, const char *name);
+
+    // copy host file host_path ("-" - standard input) into a new data
+    // file, in a local session only
+    void import_file(Session &session, const char *host_path, const char *name);
+
+    // copy a data file to host file host_path ("-" - the output), replacing
+    // its contents, in a local session only
+    void export_file(Session &session, const char *name, const char *host_path);
 
   private:
     BasicFileSys bfs;	// basic file system
-    short curr_dir;	// current directory
+    DentryCache dentries;	// cached name lookups
+    LockTable locks;	// locks of directories and inodes
+    Metrics command_metrics;	// calls of each command
+    Readahead readahead;	// windows fetched ahead of sequential reads
+    blocknum_t root;	// root directory of the tree mounted
+    bool read_only;	// true if a snapshot is mounted
+    std::mutex snapshot_lock;	// serializes taking and deleting snapshots
+
+    // A data file whose inode is kept in memory while it is open. The
+    // inode and extents are guarded by the lock of the inode block.
+    struct OpenFile {
+      inode_t inode;		// copy of the inode
+      ExtentMap extent_map;	// extents of the file
+      int refs;			// number of handles to the file
+    };
+    std::mutex open_lock;	// guards open_files
+    std::map<blocknum_t, OpenFile> open_files;	// open files by inode block
+
+    std::mutex session_lock;	// guards session_dirs and num_sessions
+    std::multiset<blocknum_t> session_dirs;	// current directory of each session
+    int num_sessions;		// sessions started since mounting
 
     // Helper functions
-    bool is_directory(short block_num);
-    short find_file(const char *name, bool &is_dir);
-    bool check_filename(const char *name);
-    void reclaim_blocks(short block_num, bool is_dir);
+    void error(Session &session, const char *message);
+    bool is_directory(blocknum_t block_num);
+    void set_types(blocknum_t dir);
+    bool lock_dir(BlockLock &lock, blocknum_t dir, bool exclusive);
+    blocknum_t lookup(blocknum_t dir, const std::string &name, bool &is_dir);
+    bool resolve_parent(Session &session, const char *path, blocknum_t &dir, std::string &name);
+    blocknum_t lock_file(Session &session, const char *path, BlockLock &lock, bool exclusive);
+    blocknum_t create_file(Session &session, const char *path, BlockLock &lock);
+    bool check_filename(const std::string &name);
+    bool check_writable(Session &session);
+    bool check_local(Session &session);
+    void set_dir(Session &session, blocknum_t dir);
+    void reclaim_blocks(blocknum_t block_num, bool is_dir);
+    int count_blocks(blocknum_t block_num, bool is_dir);
+    OpenFile &load_file(blocknum_t file_block, OpenFile &scratch);
+    blocknum_t find_handle(Session &session, int handle);
+    bool write_data(Session &session, blocknum_t file_block, OpenFile &file,
+                    unsigned int offset, const char *data, unsigned int len);
+    int write_changes(const OpenFile &file, unsigned int offset, unsigned int len);
+    bool import_data(Session &session, FILE *in, inode_t &inode, ExtentMap &extent_map);
+    bool export_data(const OpenFile &file, int fd);
+    void display(Session &session, const OpenFile &file, unsigned int offset,
+                 unsigned int len);
+    int lock_tree(std::list<BlockLock> &held, blocknum_t dir, int &data);
+    blocknum_t copy_dir(blocknum_t dir, blocknum_t parent);
+    blocknum_t copy_file(blocknum_t file_block);
+    int count_tree(blocknum_t dir, int &dirs);
+    void drop_tree(blocknum_t dir);
 };
 
 #endif 
@@ -0,0 +1,401 @@
+// Computing Systems: I/O Engine
+// Moves runs of blocks between memory and the disk file asynchronously:
+// requests are submitted in groups and complete in any order while the
+// caller goes on. io_uring is used where the kernel offers it, driven
+// through its system calls directly; elsewhere a pool of threads issues
+// ordinary vectored reads and writes.
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+using namespace std;
+
+#include "IOEngine.h"
+
+// Number of threads issuing requests when io_uring is not available
+static const int POOL_THREADS = 4;
+
+// Sets up an io_uring instance (io_uring_setup system call).
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+// Submits and waits for io_uring requests (io_uring_enter system call).
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                       NULL, 0);
+}
+
+// Engine submitting requests to the kernel through an io_uring: a
+// submission ring the requests are placed on and a completion ring their
+// results come back on, both shared with the kernel. One waiting thread
+// at a time collects completions, for every batch.
+class UringEngine : public IOEngine {
+
+  public:
+    // Creates an engine for the file descriptor fd. setup must succeed
+    // before it is used.
+    UringEngine(int fd);
+
+    // Tears down the rings.
+    ~UringEngine();
+
+    // Sets up rings for up to depth requests in flight. Returns false if
+    // the kernel does not support io_uring or refuses it.
+    bool setup(int depth);
+
+    // Returns the name of the engine.
+    const char *name() const { return "io_uring"; }
+
+    // Starts the n requests. Each counts as pending in its batch until it
+    // completes.
+    void submit(IORequest *const *requests, int n);
+
+    // Waits until every request submitted in batch has completed.
+    void wait(IOBatch &batch);
+
+  private:
+    int fd;			// file the requests read and write
+    int ring_fd;		// io_uring instance (-1 - none)
+    void *sq_ring;		// mapped submission ring
+    size_t sq_ring_size;	// bytes mapped at sq_ring
+    void *cq_ring;		// mapped completion ring (may equal sq_ring)
+    size_t cq_ring_size;	// bytes mapped at cq_ring
+    struct io_uring_sqe *sqes;	// mapped submission entries
+    size_t sqes_size;		// bytes mapped at sqes
+    unsigned *sq_tail;		// next submission slot (written by us)
+    unsigned *sq_mask;		// submission ring index mask
+    unsigned *sq_array;		// submission ring slots
+    unsigned sq_entries;	// size of the submission ring
+    unsigned *cq_head;		// next completion to collect (written by us)
+    unsigned *cq_tail;		// end of the completions (written by the kernel)
+    unsigned *cq_mask;		// completion ring index mask
+    struct io_uring_cqe *cqes;	// completion ring entries
+
+    mutex lock;			// guards the rings and everything below
+    condition_variable changed;	// signalled when completions are collected
+    unsigned queued;		// entries placed but not yet passed to the kernel
+    unsigned in_flight;		// requests submitted and not yet collected
+    bool reaping;		// true while a thread waits for completions
+
+    // Passes the entries placed on the submission ring to the kernel.
+    // lock must be held.
+    void flush_queue();
+
+    // Waits for at least one request to complete and collects every
+    // completion, or, if another thread is doing so, waits for it to
+    // finish. guard must hold lock.
+    void reap(unique_lock<mutex> &guard);
+};
+
+// Creates an engine for the file descriptor fd. setup must succeed before
+// it is used.
+UringEngine::UringEngine(int fd)
+  : fd(fd), ring_fd(-1), sq_ring(MAP_FAILED), sq_ring_size(0), cq_ring(MAP_FAILED),
+    cq_ring_size(0), sqes((struct io_uring_sqe *) MAP_FAILED), sqes_size(0),
+    queued(0), in_flight(0), reaping(false)
+{
+}
+
+// Tears down the rings.
+UringEngine::~UringEngine()
+{
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring != MAP_FAILED) {
+    munmap(sq_ring, sq_ring_size);
+  }
+  if (ring_fd != -1) {
+    close(ring_fd);
+  }
+}
+
+// Sets up rings for up to depth requests in flight. Returns false if the
+// kernel does not support io_uring or refuses it.
+bool UringEngine::setup(int depth)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = io_uring_setup(depth, &params);
+  if (ring_fd == -1) {
+    return false;
+  }
+
+  // map the rings: older kernels want the two rings mapped separately
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size = max(sq_ring_size, cq_ring_size);
+  }
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      return false;
+    }
+  }
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe *) mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+
+  char *sq = (char *) sq_ring;
+  sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  sq_array = (unsigned *) (sq + params.sq_off.array);
+  sq_entries = params.sq_entries;
+  char *cq = (char *) cq_ring;
+  cq_head = (unsigned *) (cq + params.cq_off.head);
+  cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return true;
+}
+
+// Starts the n requests. Each counts as pending in its batch until it
+// completes.
+void UringEngine::submit(IORequest *const *requests, int n)
+{
+  unique_lock<mutex> guard(lock);
+  for (int i = 0; i < n; i++) {
+    // the completion ring is twice the size of the submission ring, so
+    // keeping no more than sq_entries in flight means it never overflows
+    while (in_flight == sq_entries) {
+      flush_queue();
+      reap(guard);
+    }
+
+    IORequest *request = requests[i];
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) request->iov.data();
+    sqe->len = request->iov.size();
+    sqe->off = request->offset;
+    sqe->user_data = (uint64_t) (uintptr_t) request;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    request->batch->pending++;
+    queued++;
+    in_flight++;
+  }
+  flush_queue();
+}
+
+// Waits until every request submitted in batch has completed.
+void UringEngine::wait(IOBatch &batch)
+{
+  unique_lock<mutex> guard(lock);
+  while (batch.pending > 0) {
+    reap(guard);
+  }
+}
+
+// Passes the entries placed on the submission ring to the kernel. lock
+// must be held.
+void UringEngine::flush_queue()
+{
+  while (queued > 0) {
+    int submitted = io_uring_enter(ring_fd, queued, 0, 0);
+    if (submitted == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      cerr << "Failed to submit disk requests" << endl;
+      exit(-1);
+    }
+    queued -= submitted;
+  }
+}
+
+// Waits for at least one request to complete and collects every
+// completion, or, if another thread is doing so, waits for it to finish.
+// guard must hold lock.
+void UringEngine::reap(unique_lock<mutex> &guard)
+{
+  if (reaping) {
+    changed.wait(guard);
+    return;
+  }
+
+  // wait without the lock so that other threads can submit meanwhile
+  reaping = true;
+  guard.unlock();
+  int result = io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+  int error = errno;
+  guard.lock();
+  reaping = false;
+  if (result == -1 && error != EINTR && error != EAGAIN) {
+    cerr << "Failed to wait for disk requests" << endl;
+    exit(-1);
+  }
+
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    IORequest *request = (IORequest *) (uintptr_t) cqe->user_data;
+    request->result = cqe->res;
+    request->batch->pending--;
+    in_flight--;
+    head++;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  changed.notify_all();
+}
+
+// Engine handing requests to a pool of threads that issue them with
+// ordinary vectored reads and writes.
+class ThreadPoolEngine : public IOEngine {
+
+  public:
+    // Creates an engine for the file descriptor fd with num_threads
+    // threads.
+    ThreadPoolEngine(int fd, int num_threads);
+
+    // Stops the threads once the requests they hold are done.
+    ~ThreadPoolEngine();
+
+    // Returns the name of the engine.
+    const char *name() const { return "threads"; }
+
+    // Starts the n requests. Each counts as pending in its batch until it
+    // completes.
+    void submit(IORequest *const *requests, int n);
+
+    // Waits until every request submitted in batch has completed.
+    void wait(IOBatch &batch);
+
+  private:
+    int fd;			// file the requests read and write
+    vector<thread> threads;	// threads issuing requests
+    mutex lock;			// guards everything below
+    condition_variable ready;	// signalled when requests are queued
+    condition_variable changed;	// signalled when requests complete
+    deque<IORequest *> queue;	// requests waiting for a thread
+    bool done;			// true when the threads should exit
+
+    // Issues queued requests until the engine is destroyed.
+    void work();
+};
+
+// Creates an engine for the file descriptor fd with num_threads threads.
+ThreadPoolEngine::ThreadPoolEngine(int fd, int num_threads) : fd(fd), done(false)
+{
+  for (int i = 0; i < num_threads; i++) {
+    threads.push_back(thread(&ThreadPoolEngine::work, this));
+  }
+}
+
+// Stops the threads once the requests they hold are done.
+ThreadPoolEngine::~ThreadPoolEngine()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    done = true;
+  }
+  ready.notify_all();
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+}
+
+// Starts the n requests. Each counts as pending in its batch until it
+// completes.
+void ThreadPoolEngine::submit(IORequest *const *requests, int n)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    for (int i = 0; i < n; i++) {
+      requests[i]->batch->pending++;
+      queue.push_back(requests[i]);
+    }
+  }
+  ready.notify_all();
+}
+
+// Waits until every request submitted in batch has completed.
+void ThreadPoolEngine::wait(IOBatch &batch)
+{
+  unique_lock<mutex> guard(lock);
+  while (batch.pending > 0) {
+    changed.wait(guard);
+  }
+}
+
+// Issues queued requests until the engine is destroyed.
+void ThreadPoolEngine::work()
+{
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    while (queue.empty() && !done) {
+      ready.wait(guard);
+    }
+    if (queue.empty()) {
+      return;
+    }
+    IORequest *request = queue.front();
+    queue.pop_front();
+    guard.unlock();
+
+    ssize_t size;
+    do {
+      if (request->write) {
+        size = pwritev(fd, request->iov.data(), request->iov.size(), request->offset);
+      } else {
+        size = preadv(fd, request->iov.data(), request->iov.size(), request->offset);
+      }
+    } while (size == -1 && errno == EINTR);
+    request->result = (size == -1) ? -errno : size;
+
+    guard.lock();
+    request->batch->pending--;
+    changed.notify_all();
+  }
+}
+
+// Creates an engine for the file descriptor fd keeping up to depth
+// requests in flight: io_uring if use_uring is set and the kernel
+// supports it, a pool of threads otherwise.
+IOEngine *IOEngine::create(int fd, int depth, bool use_uring)
+{
+  if (use_uring) {
+    UringEngine *engine = new UringEngine(fd);
+    if (engine->setup(depth)) {
+      return engine;
+    }
+    delete engine;
+  }
+  return new ThreadPoolEngine(fd, POOL_THREADS);
+}
@@ -0,0 +1,58 @@
+// Computing Systems: I/O Engine
+// Moves runs of blocks between memory and the disk file asynchronously:
+// requests are submitted in groups and complete in any order while the
+// caller goes on. io_uring is used where the kernel offers it, driven
+// through its system calls directly; elsewhere a pool of threads issues
+// ordinary vectored reads and writes. An engine may be used by several
+// threads at once.
+
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <deque>
+#include <vector>
+
+struct IOBatch;
+
+// One vectored read or write of adjacent bytes of the disk file
+struct IORequest {
+  bool write;			// true for a write, false for a read
+  off_t offset;			// where the bytes start in the file
+  std::vector<struct iovec> iov;	// buffers the bytes move to or from
+  size_t size;			// number of bytes to move
+  ssize_t result;		// bytes moved or -errno, once complete
+  IOBatch *batch;		// batch the request belongs to
+};
+
+// Requests submitted together and waited for together
+struct IOBatch {
+  std::deque<IORequest> requests;	// requests of the batch (never move)
+  int pending;			// requests not yet complete
+
+  IOBatch() : pending(0) {}
+};
+
+class IOEngine {
+
+  public:
+    // Creates an engine for the file descriptor fd keeping up to depth
+    // requests in flight: io_uring if use_uring is set and the kernel
+    // supports it, a pool of threads otherwise.
+    static IOEngine *create(int fd, int depth, bool use_uring);
+
+    virtual ~IOEngine() {}
+
+    // Returns the name of the engine ("io_uring" or "threads").
+    virtual const char *name() const = 0;
+
+    // Starts the n requests. Each counts as pending in its batch until it
+    // completes.
+    virtual void submit(IORequest *const *requests, int n) = 0;
+
+    // Waits until every request submitted in batch has completed.
+    virtual void wait(IOBatch &batch) = 0;
+};
+
+#endif
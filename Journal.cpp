@@ -0,0 +1,517 @@
+// Computing Systems: Journal
+// Implements a write-ahead journal that makes file system operations
+// atomic across crashes. Blocks written by operations are held in memory
+// and committed to the journal as one transaction per group of
+// operations, so a single sync covers the whole group. Committed blocks
+// then reach their home location through the block cache, and
+// transactions left in the journal by a crash are replayed on mount.
+// Operations may run in several threads at once; a commit waits for the
+// operations in progress to end and holds off new ones until it is done,
+// so every operation lands in the journal whole. Each operation reserves
+// room for the blocks it may change, and a group only takes operations
+// that fit, so a transaction is never larger than the journal.
+
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#include "Journal.h"
+
+// FNV-1a parameters used for transaction checksums
+static const unsigned int FNV_OFFSET = 2166136261u;
+static const unsigned int FNV_PRIME = 16777619u;
+
+// Blocks reserved by the operation in progress on this thread
+static thread_local int thread_credits = 0;
+
+// Creates a journal in front of cache, logging to disk. The journal
+// starts out disabled until mount is called.
+Journal::Journal(Disk *disk, BlockCache *cache)
+  : disk(disk), cache(cache), start(0), num_blocks(0), max_blocks(0),
+    commit_ops(DEFAULT_COMMIT_OPS), journal_data(false), sequence(0), head(1),
+    checkpoint_wanted(false),
+    outstanding(0), ops(0), reserved(0), commit_wanted(false), committing(false),
+    num_commits(0), num_checkpoints(0), num_logged(0), num_replayed(0)
+{
+}
+
+// Writes an empty journal header to block start of a new disk.
+void Journal::format(Disk *disk, blocknum_t start)
+{
+  struct journalheader_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = JOURNAL_MAGIC_NUM;
+  header.sequence = 1;
+  disk->write_block(start, (void *) &header);
+}
+
+// Uses the num_blocks blocks starting at start as the journal (none if
+// num_blocks is 0) and replays any committed transactions left in it.
+// Every commit_ops operations are committed together. If journal_data
+// is set, file data is journaled along with the metadata.
+void Journal::mount(blocknum_t start, int num_blocks, int commit_ops, bool journal_data)
+{
+  this->start = start;
+  this->num_blocks = num_blocks;
+  this->commit_ops = commit_ops;
+  this->journal_data = journal_data && num_blocks > 0;
+  head = 1;
+  checkpoint_wanted = false;
+  outstanding = ops = reserved = 0;
+  commit_wanted = committing = false;
+  running.clear();
+  committed.clear();
+  logged.clear();
+  ordered.clear();
+  num_commits = num_checkpoints = num_logged = num_replayed = 0;
+  if (!enabled()) {
+    return;
+  }
+
+  struct journalheader_t header;
+  disk->read_block(start, (void *) &header);
+  if (header.magic != JOURNAL_MAGIC_NUM) {
+    cerr << "Journal is corrupt" << endl;
+    exit(-1);
+  }
+  sequence = header.sequence;
+
+  // the replayed blocks are synced, so the journal can start over
+  num_replayed = replay();
+  if (num_replayed > 0) {
+    write_header();
+  }
+
+  // operations need room for at least a small transaction, which fills
+  // at most the whole journal after the header
+  if (num_blocks < MIN_JOURNAL_BLOCKS) {
+    cerr << "Journal is too small" << endl;
+    exit(-1);
+  }
+  max_blocks = 0;
+  while (transaction_size(max_blocks + 1) <= num_blocks - 1) {
+    max_blocks++;
+  }
+}
+
+// Copies block block_num into block if it was written since the last
+// commit. Returns false if it was not.
+bool Journal::read_block(blocknum_t block_num, void *block)
+{
+  bool found;
+  return read_blocks(&block_num, &block, 1, &found) > 0;
+}
+
+// Copies each of the n blocks in block_nums written since the last commit
+// into the matching buffer in blocks and sets the matching flag in found.
+// Returns the number of blocks copied.
+int Journal::read_blocks(const blocknum_t *block_nums, void *const *blocks, int n, bool *found)
+{
+  lock_guard<mutex> guard(lock);
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    // blocks being committed are in the cache only once the commit ends
+    map<blocknum_t, datablock_t>::const_iterator it = running.find(block_nums[i]);
+    if (it == running.end()) {
+      it = committed.find(block_nums[i]);
+      if (it == committed.end()) {
+        found[i] = false;
+        continue;
+      }
+    }
+    memcpy(blocks[i], &it->second, BLOCK_SIZE);
+    found[i] = true;
+    count++;
+  }
+  return count;
+}
+
+// Records a write of block block_num, to be committed with the current
+// group of operations.
+void Journal::write_block(blocknum_t block_num, const void *block)
+{
+  lock_guard<mutex> guard(lock);
+  memcpy(&running[block_num], block, BLOCK_SIZE);
+}
+
+// Returns true if any of the n blocks in block_nums were written since
+// the last commit.
+bool Journal::holds(const blocknum_t *block_nums, int n)
+{
+  lock_guard<mutex> guard(lock);
+  for (int i = 0; i < n; i++) {
+    if (running.count(block_nums[i]) || committed.count(block_nums[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Prepares for the n blocks in block_nums to be written in place without
+// the journal. Older copies of them are dropped, or the journal is
+// checkpointed before the next commit, so that replay can never overwrite
+// the new contents, and the blocks are written back before the next
+// commit so that committed metadata never points at stale data.
+void Journal::ordered_write(const blocknum_t *block_nums, int n)
+{
+  if (!enabled()) {
+    return;
+  }
+
+  // a block freed as metadata and reused for data may still have copies
+  // waiting to be committed or already in the journal. Those in the
+  // journal are only a danger once metadata referring to the new contents
+  // commits, so the next commit starts the journal over before logging.
+  lock_guard<mutex> guard(lock);
+  for (int i = 0; i < n; i++) {
+    running.erase(block_nums[i]);
+    if (logged.count(block_nums[i])) {
+      checkpoint_wanted = true;
+    }
+  }
+  ordered.insert(ordered.end(), block_nums, block_nums + n);
+}
+
+// Marks the start of an operation that changes at most credits blocks,
+// waiting for a commit in progress to finish and, if the group has no room
+// left for the operation, for the group to commit. Returns false, starting
+// nothing, if the operation would not fit in the journal even alone.
+bool Journal::begin_op(int credits)
+{
+  if (!enabled()) {
+    return true;
+  }
+  if (credits > max_blocks) {
+    return false;
+  }
+
+  unique_lock<mutex> guard(lock);
+  while (commit_wanted || committing ||
+         (int) running.size() + reserved + credits > max_blocks) {
+    if (!commit_wanted && !committing) {
+      // the group has no room: with no operation in it left to commit it,
+      // commit it here, and otherwise the last one to end commits it
+      if (outstanding == 0) {
+        claim(guard);
+        write_transaction();
+        release(guard);
+        guard.lock();
+        continue;
+      }
+      commit_wanted = true;
+    }
+    changed.wait(guard);
+  }
+  outstanding++;
+  reserved += credits;
+  thread_credits = credits;
+  return true;
+}
+
+// Reserves credits more blocks for the operation in progress on this
+// thread, if the group has room for them now. Returns false, reserving
+// nothing, if it does not.
+bool Journal::extend_op(int credits)
+{
+  if (!enabled()) {
+    return true;
+  }
+
+  lock_guard<mutex> guard(lock);
+  if ((int) running.size() + reserved + credits > max_blocks) {
+    return false;
+  }
+  reserved += credits;
+  thread_credits += credits;
+  return true;
+}
+
+// Marks the end of an operation, committing the group once it holds
+// enough operations or blocks and no other operation is in progress.
+// Returns true if the group was committed.
+bool Journal::end_op()
+{
+  if (!enabled()) {
+    return false;
+  }
+
+  // commit before the group outgrows half of the journal so that the
+  // next one has room; the last operation of the group to end commits it
+  unique_lock<mutex> guard(lock);
+  outstanding--;
+  ops++;
+  reserved -= thread_credits;
+  thread_credits = 0;
+  if (ops >= commit_ops || transaction_size(running.size()) > (num_blocks - 1) / 2) {
+    commit_wanted = true;
+  }
+  if (!commit_wanted || outstanding > 0) {
+    return false;
+  }
+
+  claim(guard);
+  write_transaction();
+  release(guard);
+  return true;
+}
+
+// Commits every block written since the last commit as one transaction
+// and forces it to stable storage. The blocks are then written to the
+// cache. Waits for operations in progress to end.
+void Journal::commit()
+{
+  unique_lock<mutex> guard(lock);
+  claim(guard);
+  write_transaction();
+  release(guard);
+}
+
+// Writes every cached block back to the disk and forces it to stable
+// storage, after which the journal starts over empty. Waits for
+// operations in progress to end.
+void Journal::checkpoint()
+{
+  unique_lock<mutex> guard(lock);
+  claim(guard);
+  write_transaction();
+  start_over();
+  release(guard);
+}
+
+// Waits for the operations in progress to end and claims the journal for
+// a commit, moving the running blocks to committed. Returns with lock
+// released.
+void Journal::claim(unique_lock<mutex> &guard)
+{
+  while (outstanding > 0 || committing) {
+    commit_wanted = true;
+    changed.wait(guard);
+  }
+  commit_wanted = false;
+  committing = true;
+  ops = 0;
+  committed.swap(running);
+  guard.unlock();
+}
+
+// Ends a commit begun by claim, letting operations start again.
+void Journal::release(unique_lock<mutex> &guard)
+{
+  guard.lock();
+  committed.clear();
+  committing = false;
+  changed.notify_all();
+  guard.unlock();
+}
+
+// Logs the blocks in committed as one transaction and writes them to the
+// cache. The cache is written before committed is emptied, so readers
+// always find the latest copy in one or the other.
+void Journal::write_transaction()
+{
+  if (committed.empty()) {
+    return;
+  }
+
+  // old copies of blocks since written in place must not be replayed
+  // once this transaction commits
+  if (checkpoint_wanted) {
+    start_over();
+  }
+
+  // file data goes to the disk ahead of the metadata that refers to it
+  cache->write_back(ordered.data(), ordered.size());
+  ordered.clear();
+
+  vector<blocknum_t> block_nums;
+  vector<void *> blocks;
+  for (map<blocknum_t, datablock_t>::iterator it = committed.begin(); it != committed.end(); it++) {
+    block_nums.push_back(it->first);
+    blocks.push_back((void *) &it->second);
+  }
+
+  // operations reserve room for what they change, so the transaction
+  // always fits in the journal whole and is never split
+  int n = block_nums.size();
+  if (n > max_blocks) {
+    cerr << "Transaction is larger than the journal" << endl;
+    exit(-1);
+  }
+  if (transaction_size(n) > num_blocks - head) {
+    start_over();
+  }
+
+  log(block_nums.data(), blocks.data(), n);
+  cache->write_blocks(block_nums.data(), blocks.data(), n);
+  logged.insert(block_nums.begin(), block_nums.end());
+}
+
+// Writes every cached block back to the disk and starts the journal over
+// empty.
+void Journal::start_over()
+{
+  cache->flush();
+  disk->sync();
+  if (!enabled() || head == 1) {
+    return;
+  }
+
+  write_header();
+  head = 1;
+  logged.clear();
+  ordered.clear();
+  checkpoint_wanted = false;
+  num_checkpoints++;
+}
+
+// Returns the number of journal blocks a transaction of n block copies
+// takes, counting its descriptors and commit block.
+int Journal::transaction_size(int n)
+{
+  return n + (n + JOURNAL_DESC_ENTRIES - 1) / JOURNAL_DESC_ENTRIES + 1;
+}
+
+// Writes the n blocks in block_nums, with contents blocks, to the journal
+// as one transaction at head, and syncs the disk.
+void Journal::log(const blocknum_t *block_nums, void *const *blocks, int n)
+{
+  int num_descs = (n + JOURNAL_DESC_ENTRIES - 1) / JOURNAL_DESC_ENTRIES;
+  vector<journaldescblock_t> descs(num_descs);
+  struct journalcommitblock_t commit_block;
+  vector<blocknum_t> journal_nums;
+  vector<void *> buffers;
+  unsigned int sum = FNV_OFFSET;
+  blocknum_t pos = start + head;
+
+  // each descriptor is followed by the copies it lists
+  for (int d = 0; d < num_descs; d++) {
+    int first = d * JOURNAL_DESC_ENTRIES;
+    struct journaldescblock_t &desc = descs[d];
+    memset(&desc, 0, sizeof(desc));
+    desc.magic = JOURNAL_DESC_MAGIC_NUM;
+    desc.sequence = sequence;
+    desc.num_blocks = min(JOURNAL_DESC_ENTRIES, n - first);
+    for (unsigned int i = 0; i < desc.num_blocks; i++) {
+      desc.blocks[i] = block_nums[first + i];
+    }
+    journal_nums.push_back(pos++);
+    buffers.push_back((void *) &desc);
+    sum = checksum(sum, &desc);
+
+    for (unsigned int i = 0; i < desc.num_blocks; i++) {
+      journal_nums.push_back(pos++);
+      buffers.push_back(blocks[first + i]);
+      sum = checksum(sum, blocks[first + i]);
+    }
+  }
+
+  memset(&commit_block, 0, sizeof(commit_block));
+  commit_block.magic = JOURNAL_COMMIT_MAGIC_NUM;
+  commit_block.sequence = sequence;
+  commit_block.num_blocks = n;
+  commit_block.checksum = sum;
+  journal_nums.push_back(pos++);
+  buffers.push_back((void *) &commit_block);
+
+  // the checksum catches a commit block that reached the disk before the
+  // rest of the transaction, so one sync is enough
+  disk->write_blocks(journal_nums.data(), buffers.data(), journal_nums.size());
+  disk->sync();
+
+  head += journal_nums.size();
+  sequence++;
+  num_commits++;
+  num_logged += n;
+}
+
+// Replays the committed transactions in the journal, in order. Returns
+// the number replayed.
+int Journal::replay()
+{
+  int count = 0;
+  int pos = 1;
+
+  while (true) {
+    // gather the copies of the next transaction up to its commit block
+    vector<blocknum_t> block_nums;
+    vector<datablock_t> copies;
+    unsigned int sum = FNV_OFFSET;
+    bool committed = false;
+    int p = pos;
+
+    while (p < num_blocks) {
+      struct journaldescblock_t desc;
+      disk->read_block(start + p, (void *) &desc);
+      p++;
+      if (desc.sequence != sequence) {
+        break;
+      }
+
+      if (desc.magic == JOURNAL_COMMIT_MAGIC_NUM) {
+        struct journalcommitblock_t commit_block;
+        memcpy(&commit_block, &desc, sizeof(commit_block));
+        committed = commit_block.num_blocks == block_nums.size() &&
+                    commit_block.checksum == sum;
+        break;
+      }
+      if (desc.magic != JOURNAL_DESC_MAGIC_NUM ||
+          desc.num_blocks > (unsigned int) JOURNAL_DESC_ENTRIES ||
+          p + (int) desc.num_blocks > num_blocks) {
+        break;
+      }
+
+      sum = checksum(sum, &desc);
+      size_t first = copies.size();
+      copies.resize(first + desc.num_blocks);
+      for (unsigned int i = 0; i < desc.num_blocks; i++) {
+        disk->read_block(start + p, (void *) &copies[first + i]);
+        sum = checksum(sum, &copies[first + i]);
+        block_nums.push_back(desc.blocks[i]);
+        p++;
+      }
+    }
+    if (!committed) {
+      break;
+    }
+
+    // write the copies to their home blocks
+    vector<void *> buffers(copies.size());
+    for (size_t i = 0; i < copies.size(); i++) {
+      buffers[i] = (void *) &copies[i];
+    }
+    disk->write_blocks(block_nums.data(), buffers.data(), block_nums.size());
+
+    pos = p;
+    sequence++;
+    count++;
+  }
+
+  if (count > 0) {
+    disk->sync();
+  }
+  return count;
+}
+
+// Writes the journal header for the next transaction and syncs it.
+void Journal::write_header()
+{
+  struct journalheader_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = JOURNAL_MAGIC_NUM;
+  header.sequence = sequence;
+  disk->write_block(start, (void *) &header);
+  disk->sync();
+}
+
+// Returns the checksum of a transaction's descriptors and copies.
+unsigned int Journal::checksum(unsigned int sum, const void *block)
+{
+  const unsigned char *bytes = (const unsigned char *) block;
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    sum = (sum ^ bytes[i]) * FNV_PRIME;
+  }
+  return sum;
+}
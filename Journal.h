@@ -0,0 +1,185 @@
+// Computing Systems: Journal
+// Implements a write-ahead journal that makes file system operations
+// atomic across crashes. Blocks written by operations are held in memory
+// and committed to the journal as one transaction per group of
+// operations, so a single sync covers the whole group. Committed blocks
+// then reach their home location through the block cache, and
+// transactions left in the journal by a crash are replayed on mount.
+// Operations may run in several threads at once; a commit waits for the
+// operations in progress to end and holds off new ones until it is done,
+// so every operation lands in the journal whole. Each operation reserves
+// room for the blocks it may change, and a group only takes operations
+// that fit, so a transaction is never larger than the journal.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "Disk.h"
+#include "BlockCache.h"
+#include "Blocks.h"
+
+// Default number of operations committed together
+const int DEFAULT_COMMIT_OPS = 16;
+
+class Journal {
+
+  public:
+    // Creates a journal in front of cache, logging to disk. The journal
+    // starts out disabled until mount is called.
+    Journal(Disk *disk, BlockCache *cache);
+
+    // Writes an empty journal header to block start of a new disk.
+    static void format(Disk *disk, blocknum_t start);
+
+    // Uses the num_blocks blocks starting at start as the journal (none if
+    // num_blocks is 0) and replays any committed transactions left in it.
+    // Every commit_ops operations are committed together. If journal_data
+    // is set, file data is journaled along with the metadata.
+    void mount(blocknum_t start, int num_blocks, int commit_ops, bool journal_data);
+
+    // Returns true if the disk has a journal.
+    bool enabled() const { return num_blocks > 0; }
+
+    // Returns true if file data is journaled.
+    bool journals_data() const { return journal_data; }
+
+    // Copies block block_num into block if it was written since the last
+    // commit. Returns false if it was not.
+    bool read_block(blocknum_t block_num, void *block);
+
+    // Copies each of the n blocks in block_nums written since the last
+    // commit into the matching buffer in blocks and sets the matching flag
+    // in found. Returns the number of blocks copied.
+    int read_blocks(const blocknum_t *block_nums, void *const *blocks, int n, bool *found);
+
+    // Records a write of block block_num, to be committed with the
+    // current group of operations.
+    void write_block(blocknum_t block_num, const void *block);
+
+    // Returns true if any of the n blocks in block_nums were written since
+    // the last commit.
+    bool holds(const blocknum_t *block_nums, int n);
+
+    // Prepares for the n blocks in block_nums to be written in place
+    // without the journal. Older copies of them are dropped, or the
+    // journal is checkpointed before the next commit, so that replay can
+    // never overwrite the new contents, and the blocks are written back
+    // before the next commit so that committed metadata never points at
+    // stale data.
+    void ordered_write(const blocknum_t *block_nums, int n);
+
+    // Marks the start of an operation that changes at most credits
+    // blocks, waiting for a commit in progress to finish and, if the group
+    // has no room left for the operation, for the group to commit. Returns
+    // false, starting nothing, if the operation would not fit in the
+    // journal even alone.
+    bool begin_op(int credits);
+
+    // Reserves credits more blocks for the operation in progress on this
+    // thread, if the group has room for them now. Returns false,
+    // reserving nothing, if it does not.
+    bool extend_op(int credits);
+
+    // Returns the most blocks one transaction holds.
+    int max_op_blocks() const { return max_blocks; }
+
+    // Marks the end of an operation, committing the group once it holds
+    // enough operations or blocks and no other operation is in progress.
+    // Returns true if the group was committed.
+    bool end_op();
+
+    // Commits every block written since the last commit as one
+    // transaction and forces it to stable storage. The blocks are then
+    // written to the cache. Waits for operations in progress to end.
+    void commit();
+
+    // Returns the sequence number of the transaction that blocks written
+    // now will be committed with.
+    unsigned int running_sequence() const { return sequence; }
+
+    // Writes every cached block back to the disk and forces it to stable
+    // storage, after which the journal starts over empty. Waits for
+    // operations in progress to end.
+    void checkpoint();
+
+    // Statistics
+    unsigned long commits() const { return num_commits; }
+    unsigned long checkpoints() const { return num_checkpoints; }
+    unsigned long logged_blocks() const { return num_logged; }
+    unsigned long replayed() const { return num_replayed; }
+
+  private:
+    Disk *disk;			// disk the journal is on
+    BlockCache *cache;		// cache the committed blocks go to
+    blocknum_t start;		// header block of the journal
+    int num_blocks;		// size of the journal (0 - no journal)
+    int max_blocks;		// most block copies in one transaction
+    int commit_ops;		// operations per group commit
+    bool journal_data;		// true if file data is journaled
+
+    // only a commit, which runs while no operation is in progress, or
+    // ordered_write, holding lock, change these
+    std::atomic<unsigned int> sequence;	// sequence number of the next transaction
+    int head;			// next free journal block after the header
+    std::set<blocknum_t> logged;	// blocks logged since the last checkpoint
+    std::vector<blocknum_t> ordered;	// data written in place since the last commit
+    bool checkpoint_wanted;	// true if blocks in the journal were since written
+				// in place
+
+    std::mutex lock;		// guards everything below
+    std::condition_variable changed;	// signalled when operations or a commit end
+    int outstanding;		// operations in progress
+    int ops;			// operations ended since the last commit
+    int reserved;		// blocks reserved by the operations in progress
+    bool commit_wanted;		// true if new operations must wait for a commit
+    bool committing;		// true while a commit is running
+    std::map<blocknum_t, datablock_t> running; // blocks written since the last commit
+    std::map<blocknum_t, datablock_t> committed; // blocks of the commit running
+
+    std::atomic<unsigned long> num_commits;	// transactions committed
+    std::atomic<unsigned long> num_checkpoints;	// times the journal started over
+    std::atomic<unsigned long> num_logged;	// block copies written to the journal
+    std::atomic<unsigned long> num_replayed;	// transactions replayed on mount
+
+    // Waits for the operations in progress to end and claims the journal
+    // for a commit, moving the running blocks to committed. Returns with
+    // lock released.
+    void claim(std::unique_lock<std::mutex> &guard);
+
+    // Ends a commit begun by claim, letting operations start again.
+    void release(std::unique_lock<std::mutex> &guard);
+
+    // Logs the blocks in committed as one transaction and writes them to
+    // the cache.
+    void write_transaction();
+
+    // Writes every cached block back to the disk and starts the journal
+    // over empty.
+    void start_over();
+
+    // Returns the number of journal blocks a transaction of n block
+    // copies takes, counting its descriptors and commit block.
+    static int transaction_size(int n);
+
+    // Writes the n blocks in block_nums, with contents blocks, to the
+    // journal as one transaction at head, and syncs the disk.
+    void log(const blocknum_t *block_nums, void *const *blocks, int n);
+
+    // Replays the committed transactions in the journal, in order.
+    // Returns the number replayed.
+    int replay();
+
+    // Writes the journal header for the next transaction and syncs it.
+    void write_header();
+
+    // Returns the checksum of a transaction's descriptors and copies.
+    static unsigned int checksum(unsigned int sum, const void *block);
+};
+
+#endif
@@ -0,0 +1,48 @@
+// Computing Systems: Lock Table
+// Reader-writer locks for directory and inode blocks, created when a
+// block is first locked and dropped when its last user unlocks it.
+
+#include <cstdlib>
+#include <iostream>
+using namespace std;
+
+#include "LockTable.h"
+
+// Locks block block_num, shared with other readers or exclusively.
+void LockTable::lock(blocknum_t block_num, bool exclusive)
+{
+  // entries stay put in the map while they have users, so the lock can
+  // be waited for outside the table lock
+  Entry *entry;
+  {
+    lock_guard<mutex> guard(table_lock);
+    unordered_map<blocknum_t, Entry>::iterator it = entries.find(block_num);
+    if (it == entries.end()) {
+      entry = &entries[block_num];
+      pthread_rwlock_init(&entry->rwlock, NULL);
+      entry->users = 0;
+    } else {
+      entry = &it->second;
+    }
+    entry->users++;
+  }
+
+  int result = exclusive ? pthread_rwlock_wrlock(&entry->rwlock)
+                         : pthread_rwlock_rdlock(&entry->rwlock);
+  if (result != 0) {
+    cerr << "Failed to lock block" << endl;
+    exit(-1);
+  }
+}
+
+// Unlocks block block_num.
+void LockTable::unlock(blocknum_t block_num)
+{
+  lock_guard<mutex> guard(table_lock);
+  unordered_map<blocknum_t, Entry>::iterator it = entries.find(block_num);
+  pthread_rwlock_unlock(&it->second.rwlock);
+  if (--it->second.users == 0) {
+    pthread_rwlock_destroy(&it->second.rwlock);
+    entries.erase(it);
+  }
+}
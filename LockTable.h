@@ -0,0 +1,77 @@
+// Computing Systems: Lock Table
+// Reader-writer locks for directory and inode blocks, created when a
+// block is first locked and dropped when its last user unlocks it.
+//
+// Locks are always taken in tree order: a directory before any directory
+// or inode inside it, and never a directory while holding one of its
+// descendants. Paths are resolved by locking one directory at a time.
+
+#ifndef LOCK_TABLE_H
+#define LOCK_TABLE_H
+
+#include <pthread.h>
+#include <mutex>
+#include <unordered_map>
+#include "Blocks.h"
+
+class LockTable {
+
+  public:
+    LockTable() {}
+
+    // Locks block block_num, shared with other readers or exclusively.
+    void lock(blocknum_t block_num, bool exclusive);
+
+    // Unlocks block block_num.
+    void unlock(blocknum_t block_num);
+
+  private:
+    // the lock of one block
+    struct Entry {
+      pthread_rwlock_t rwlock;	// the lock itself
+      int users;		// threads holding or waiting for it
+    };
+
+    std::mutex table_lock;	// guards entries
+    std::unordered_map<blocknum_t, Entry> entries; // locks in use by block
+
+    LockTable(const LockTable &);
+    LockTable &operator=(const LockTable &);
+};
+
+// Holds the lock of one block until it is unlocked or goes out of scope.
+class BlockLock {
+
+  public:
+    // Creates a holder that holds nothing yet.
+    BlockLock(LockTable &table) : table(table), block_num(0) {}
+
+    // Locks block_num, shared or exclusively.
+    BlockLock(LockTable &table, blocknum_t block_num, bool exclusive)
+      : table(table), block_num(0) { lock(block_num, exclusive); }
+
+    ~BlockLock() { unlock(); }
+
+    // Locks block_num, shared or exclusively. Nothing may be held.
+    void lock(blocknum_t block_num, bool exclusive) {
+      table.lock(block_num, exclusive);
+      this->block_num = block_num;
+    }
+
+    // Unlocks the block held, if any.
+    void unlock() {
+      if (block_num != 0) {
+        table.unlock(block_num);
+        block_num = 0;
+      }
+    }
+
+  private:
+    LockTable &table;		// table the lock is in
+    blocknum_t block_num;	// block held (0 - none)
+
+    BlockLock(const BlockLock &);
+    BlockLock &operator=(const BlockLock &);
+};
+
+#endif
@@ -0,0 +1,180 @@
+// Computing Systems: Metrics
+// Counts the calls and errors of each file system command, with a
+// histogram of their latencies and the disk blocks they read and wrote.
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+using namespace std;
+
+#include "Metrics.h"
+#include "Disk.h"
+
+// Names of the commands, in the order of MetricOp
+static const char *const OP_NAMES[NUM_METRIC_OPS] = {
+  "mkdir", "cd", "home", "rmdir", "ls", "create", "append", "cat",
+  "tail", "rm", "stat", "open", "close", "read", "write", "sync",
+  "mksnap", "lssnap", "rmsnap", "import", "export"
+};
+
+// Returns the upper bound in microseconds of latency histogram bucket i.
+static unsigned long bucket_bound(int i)
+{
+  return 1UL << i;
+}
+
+// Creates metrics with every counter at zero.
+Metrics::Metrics()
+{
+  reset();
+}
+
+// Sets every counter back to zero.
+void Metrics::reset()
+{
+  for (int op = 0; op < NUM_METRIC_OPS; op++) {
+    OpStats &stats = ops[op];
+    stats.calls = 0;
+    stats.errors = 0;
+    stats.total_usecs = 0;
+    stats.max_usecs = 0;
+    stats.reads = 0;
+    stats.writes = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      stats.latency[i] = 0;
+    }
+  }
+}
+
+// Records a call of op that took usecs microseconds and read and wrote the
+// given numbers of disk blocks. failed is set if the call reported an
+// error.
+void Metrics::record(MetricOp op, unsigned long usecs, unsigned long reads,
+                     unsigned long writes, bool failed)
+{
+  OpStats &stats = ops[op];
+  stats.calls++;
+  if (failed) {
+    stats.errors++;
+  }
+  stats.total_usecs += usecs;
+  unsigned long longest = stats.max_usecs;
+  while (usecs > longest && !stats.max_usecs.compare_exchange_weak(longest, usecs)) {
+  }
+  stats.reads += reads;
+  stats.writes += writes;
+
+  // the bucket is the number of bits in usecs
+  int bucket = (usecs == 0) ? 0 : 64 - __builtin_clzl(usecs);
+  stats.latency[min(bucket, LATENCY_BUCKETS - 1)]++;
+}
+
+// Writes a line for each command called, then the latency histogram of
+// each, to out.
+void Metrics::print(ostream &out) const
+{
+  out << left << setw(8) << "Command" << right
+      << setw(10) << "Calls" << setw(8) << "Errors"
+      << setw(10) << "Mean us" << setw(10) << "p50 us" << setw(10) << "p99 us"
+      << setw(10) << "Max us" << setw(12) << "Reads/call" << setw(12) << "Writes/call"
+      << endl;
+  for (int op = 0; op < NUM_METRIC_OPS; op++) {
+    const OpStats &stats = ops[op];
+    unsigned long calls = stats.calls;
+    if (calls == 0) {
+      continue;
+    }
+    out << left << setw(8) << OP_NAMES[op] << right << fixed
+        << setw(10) << calls << setw(8) << stats.errors
+        << setw(10) << setprecision(1) << (double) stats.total_usecs / calls
+        << setw(10) << percentile(stats, 0.5) << setw(10) << percentile(stats, 0.99)
+        << setw(10) << stats.max_usecs
+        << setw(12) << setprecision(2) << (double) stats.reads / calls
+        << setw(12) << (double) stats.writes / calls << endl;
+  }
+
+  out << "Latency histograms (calls taking less than N us):" << endl;
+  for (int op = 0; op < NUM_METRIC_OPS; op++) {
+    const OpStats &stats = ops[op];
+    if (stats.calls == 0) {
+      continue;
+    }
+    out << left << setw(8) << OP_NAMES[op] << right;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      if (stats.latency[i] > 0) {
+        out << " <" << bucket_bound(i) << ":" << stats.latency[i];
+      }
+    }
+    out << endl;
+  }
+}
+
+// Writes the counters of each command called to out as the members of a
+// JSON object, one per command.
+void Metrics::write_json(ostream &out) const
+{
+  bool first = true;
+  for (int op = 0; op < NUM_METRIC_OPS; op++) {
+    const OpStats &stats = ops[op];
+    if (stats.calls == 0) {
+      continue;
+    }
+    out << (first ? "" : ",") << "\n    \"" << OP_NAMES[op] << "\": {"
+        << "\"calls\": " << stats.calls
+        << ", \"errors\": " << stats.errors
+        << ", \"total_us\": " << stats.total_usecs
+        << ", \"max_us\": " << stats.max_usecs
+        << ", \"p50_us\": " << percentile(stats, 0.5)
+        << ", \"p99_us\": " << percentile(stats, 0.99)
+        << ", \"block_reads\": " << stats.reads
+        << ", \"block_writes\": " << stats.writes
+        << ", \"latency_us\": {";
+    bool first_bucket = true;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      if (stats.latency[i] > 0) {
+        out << (first_bucket ? "" : ", ") << "\"<" << bucket_bound(i) << "\": "
+            << stats.latency[i];
+        first_bucket = false;
+      }
+    }
+    out << "}}";
+    first = false;
+  }
+}
+
+// Returns the upper bound in microseconds of the histogram bucket in which
+// the fraction p of the calls of stats is reached, or the longest call if
+// that is less.
+unsigned long Metrics::percentile(const OpStats &stats, double p)
+{
+  unsigned long rank = max((unsigned long) ceil(p * stats.calls), 1UL);
+  unsigned long seen = 0;
+  int i = 0;
+  while (i < LATENCY_BUCKETS - 1) {
+    seen += stats.latency[i];
+    if (seen >= rank) {
+      break;
+    }
+    i++;
+  }
+  return min(bucket_bound(i), (unsigned long) stats.max_usecs);
+}
+
+// Starts measuring a call of op. errors points to the error count of the
+// session it runs for, if any: the call failed if it grows.
+OpTimer::OpTimer(Metrics &metrics, MetricOp op, const unsigned long *errors)
+  : metrics(metrics), op(op), errors(errors), start_errors(errors != NULL ? *errors : 0),
+    start_reads(Disk::thread_blocks_read()), start_writes(Disk::thread_blocks_written()),
+    start(chrono::steady_clock::now())
+{
+}
+
+// Records the call.
+OpTimer::~OpTimer()
+{
+  unsigned long usecs = chrono::duration_cast<chrono::microseconds>(
+    chrono::steady_clock::now() - start).count();
+  metrics.record(op, usecs, Disk::thread_blocks_read() - start_reads,
+                 Disk::thread_blocks_written() - start_writes,
+                 errors != NULL && *errors != start_errors);
+}
@@ -0,0 +1,94 @@
+// Computing Systems: Metrics
+// Counts the calls and errors of each file system command, with a
+// histogram of their latencies and the disk blocks they read and wrote.
+// The counters may be updated by several threads at once.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+// Commands whose calls are measured
+enum MetricOp {
+  OP_MKDIR, OP_CD, OP_HOME, OP_RMDIR, OP_LS, OP_CREATE, OP_APPEND, OP_CAT,
+  OP_TAIL, OP_RM, OP_STAT, OP_OPEN, OP_CLOSE, OP_READ, OP_WRITE, OP_SYNC,
+  OP_MKSNAP, OP_LSSNAP, OP_RMSNAP, OP_IMPORT, OP_EXPORT, NUM_METRIC_OPS
+};
+
+// Number of latency histogram buckets. Bucket 0 counts calls taking less
+// than 1 microsecond and bucket i those taking at least 2^(i-1) and less
+// than 2^i microseconds; the last bucket also counts anything slower.
+const int LATENCY_BUCKETS = 32;
+
+class Metrics {
+
+  public:
+    // Creates metrics with every counter at zero.
+    Metrics();
+
+    // Sets every counter back to zero.
+    void reset();
+
+    // Records a call of op that took usecs microseconds and read and wrote
+    // the given numbers of disk blocks. failed is set if the call reported
+    // an error.
+    void record(MetricOp op, unsigned long usecs, unsigned long reads,
+                unsigned long writes, bool failed);
+
+    // Writes a line for each command called, then the latency histogram
+    // of each, to out.
+    void print(std::ostream &out) const;
+
+    // Writes the counters of each command called to out as the members
+    // of a JSON object, one per command.
+    void write_json(std::ostream &out) const;
+
+  private:
+    // counters of one command
+    struct OpStats {
+      std::atomic<unsigned long> calls;		// times called
+      std::atomic<unsigned long> errors;	// calls that reported an error
+      std::atomic<unsigned long> total_usecs;	// time spent in all calls
+      std::atomic<unsigned long> max_usecs;	// longest call
+      std::atomic<unsigned long> reads;		// disk blocks read
+      std::atomic<unsigned long> writes;	// disk blocks written
+      std::atomic<unsigned long> latency[LATENCY_BUCKETS];	// histogram
+    };
+
+    OpStats ops[NUM_METRIC_OPS];	// counters by command
+
+    // Returns the upper bound in microseconds of the histogram bucket in
+    // which the fraction p of the calls of stats is reached, or the
+    // longest call if that is less.
+    static unsigned long percentile(const OpStats &stats, double p);
+};
+
+// Measures one call of a command from construction to destruction and
+// records it in metrics. The disk blocks read and written by the calling
+// thread meanwhile are charged to the call.
+class OpTimer {
+
+  public:
+    // Starts measuring a call of op. errors points to the error count of
+    // the session it runs for, if any: the call failed if it grows.
+    OpTimer(Metrics &metrics, MetricOp op, const unsigned long *errors);
+
+    // Records the call.
+    ~OpTimer();
+
+  private:
+    Metrics &metrics;		// where the call is recorded
+    MetricOp op;		// command called
+    const unsigned long *errors;	// error count of the session (or NULL)
+    unsigned long start_errors;	// errors before the call
+    unsigned long start_reads;	// blocks the thread had read before the call
+    unsigned long start_writes;	// blocks the thread had written before the call
+    std::chrono::steady_clock::time_point start;	// when the call began
+
+    OpTimer(const OpTimer &);
+    OpTimer &operator=(const OpTimer &);
+};
+
+#endif
@@ -0,0 +1,74 @@
+// Computing Systems: Readahead
+// Detects files being read sequentially and decides which of their blocks
+// to fetch into the block cache ahead of the reader.
+
+#include <algorithm>
+using namespace std;
+
+#include "Readahead.h"
+
+Readahead::Readahead()
+  : max_window(0), num_windows(0), num_blocks(0), num_hits(0), num_resets(0)
+{
+}
+
+// Limits windows to a quarter of a cache of cache_blocks blocks, so that
+// blocks fetched ahead stay cached until they are read. A cache of fewer
+// than 4 * READAHEAD_MIN_BLOCKS blocks turns readahead off.
+void Readahead::set_cache_blocks(int cache_blocks)
+{
+  unsigned int quarter = max(cache_blocks, 0) / 4;
+  max_window = (quarter < READAHEAD_MIN_BLOCKS) ? 0 : min(quarter, READAHEAD_MAX_BLOCKS);
+}
+
+// Records a read of blocks first to last of a file of file_blocks blocks
+// read as in state. If the reader is sequential and within half a window
+// of the end of the blocks already fetched, sets ahead_first and
+// ahead_count to the next window and returns true.
+bool Readahead::plan(ReadaheadState &state, unsigned int first, unsigned int last,
+                     unsigned int file_blocks, unsigned int &ahead_first,
+                     unsigned int &ahead_count)
+{
+  // a read may start in the block the last one ended in
+  unsigned int reached = state.next_block;
+  bool sequential = (first == reached || first + 1 == reached);
+  state.next_block = last + 1;
+  if (!sequential || max_window == 0) {
+    if (state.window > 0) {
+      num_resets++;
+    }
+    state.window = 0;
+    state.ahead_start = 0;
+    state.ahead_end = 0;
+    return false;
+  }
+
+  // count the blocks reached for the first time that were fetched ahead
+  unsigned int hit_start = max(max(first, reached), state.ahead_start);
+  unsigned int hit_end = min(last + 1, state.ahead_end);
+  if (hit_start < hit_end) {
+    num_hits += hit_end - hit_start;
+  }
+
+  // fetch more only once the reader nears the end of what was fetched
+  if (state.window > 0 && state.ahead_end > last + 1 + state.window / 2) {
+    return false;
+  }
+  unsigned int window = (state.window == 0) ? READAHEAD_MIN_BLOCKS :
+                        min(state.window * 2, (unsigned int) max_window);
+  unsigned int start = max(state.ahead_end, last + 1);
+  unsigned int end = min(last + 1 + window, file_blocks);
+  if (start >= end) {
+    return false;
+  }
+  if (state.window == 0) {
+    state.ahead_start = start;
+  }
+  state.window = window;
+  state.ahead_end = end;
+  ahead_first = start;
+  ahead_count = end - start;
+  num_windows++;
+  num_blocks += ahead_count;
+  return true;
+}
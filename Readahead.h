@@ -0,0 +1,63 @@
+// Computing Systems: Readahead
+// Detects files being read sequentially and decides which of their blocks
+// to fetch into the block cache ahead of the reader. The window fetched
+// starts small and doubles each time the reader catches up with it, up to
+// a limit set by the size of the cache, and closes on the first read that
+// is not sequential.
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <atomic>
+
+// Blocks in the first window fetched ahead of a sequential reader
+const unsigned int READAHEAD_MIN_BLOCKS = 4;
+
+// Most blocks in a window fetched ahead
+const unsigned int READAHEAD_MAX_BLOCKS = 64;
+
+// How one file is being read through one handle
+struct ReadaheadState {
+  unsigned int next_block;	// block just past the last read
+  unsigned int window;		// blocks in the last window (0 - none open)
+  unsigned int ahead_start;	// first block fetched ahead in this run
+  unsigned int ahead_end;	// block just past the last window
+
+  ReadaheadState() : next_block(0), window(0), ahead_start(0), ahead_end(0) {}
+};
+
+// Plans the windows of every reader and counts them. May be used by
+// several threads at once, each planning with states of its own.
+class Readahead {
+
+  public:
+    Readahead();
+
+    // Limits windows to a quarter of a cache of cache_blocks blocks, so
+    // that blocks fetched ahead stay cached until they are read. A cache
+    // of fewer than 4 * READAHEAD_MIN_BLOCKS blocks turns readahead off.
+    void set_cache_blocks(int cache_blocks);
+
+    // Records a read of blocks first to last of a file of file_blocks
+    // blocks read as in state. If the reader is sequential and within
+    // half a window of the end of the blocks already fetched, sets
+    // ahead_first and ahead_count to the next window and returns true.
+    bool plan(ReadaheadState &state, unsigned int first, unsigned int last,
+              unsigned int file_blocks, unsigned int &ahead_first, unsigned int &ahead_count);
+
+    // Readahead statistics
+    unsigned long windows() const { return num_windows; }
+    unsigned long blocks() const { return num_blocks; }
+    unsigned long hits() const { return num_hits; }
+    unsigned long resets() const { return num_resets; }
+
+  private:
+    std::atomic<unsigned int> max_window;	// most blocks in a window
+    std::atomic<unsigned long> num_windows;	// windows fetched
+    std::atomic<unsigned long> num_blocks;	// blocks fetched ahead
+    std::atomic<unsigned long> num_hits;	// blocks first read after being fetched
+						// ahead
+    std::atomic<unsigned long> num_resets;	// windows closed by a read elsewhere
+};
+
+#endif
@@ -0,0 +1,66 @@
+// Computing Systems: Reference Counts
+// Keeps the reference count table in memory.
+
+#include <cstring>
+using namespace std;
+
+#include "RefCounts.h"
+
+RefCounts::RefCounts() : shared_count(0)
+{
+}
+
+// Loads the counts of num_blocks blocks from the on-disk table, whose byte
+// i counts the extra references of block i (NULL - no table, so no block
+// is shared).
+void RefCounts::load(const unsigned char *table, int num_blocks)
+{
+  counts.assign(num_blocks, 0);
+  shared_count = 0;
+  if (table != NULL) {
+    for (int i = 0; i < num_blocks; i++) {
+      counts[i] = table[i];
+      if (counts[i] > 0) {
+        shared_count++;
+      }
+    }
+  }
+  dirty_blocks.clear();
+}
+
+// Copies table block index (the counts of blocks index * BLOCK_SIZE
+// onwards) into the on-disk format used by load.
+void RefCounts::store(int index, refcountblock_t *block) const
+{
+  memset(block->refs, 0, BLOCK_SIZE);
+  size_t first = (size_t) index * BLOCK_SIZE;
+  for (size_t i = first; i < counts.size() && i < first + BLOCK_SIZE; i++) {
+    block->refs[i - first] = counts[i];
+  }
+}
+
+// Adds a reference to each of the n blocks in blocks.
+void RefCounts::add(const blocknum_t *blocks, int n)
+{
+  for (int i = 0; i < n; i++) {
+    if (counts[blocks[i]]++ == 0) {
+      shared_count++;
+    }
+    dirty_blocks.insert(blocks[i] / BLOCK_SIZE);
+  }
+}
+
+// Drops a reference beyond the first from block_num. Returns false if it
+// has none, in which case the block is no longer used once its only
+// reference goes.
+bool RefCounts::drop(blocknum_t block_num)
+{
+  if (counts[block_num] == 0) {
+    return false;
+  }
+  if (--counts[block_num] == 0) {
+    shared_count--;
+  }
+  dirty_blocks.insert(block_num / BLOCK_SIZE);
+  return true;
+}
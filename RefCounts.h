@@ -0,0 +1,55 @@
+// Computing Systems: Reference Counts
+// Keeps the reference count table in memory. A block normally has one
+// reference, from the live file system or from one snapshot; each other
+// snapshot sharing it adds one more. The table holds a byte per block
+// counting the references beyond the first.
+
+#ifndef REF_COUNTS_H
+#define REF_COUNTS_H
+
+#include <vector>
+#include <set>
+#include "Blocks.h"
+
+class RefCounts {
+
+  public:
+    RefCounts();
+
+    // Loads the counts of num_blocks blocks from the on-disk table, whose
+    // byte i counts the extra references of block i (NULL - no table, so
+    // no block is shared).
+    void load(const unsigned char *table, int num_blocks);
+
+    // Copies table block index (the counts of blocks index * BLOCK_SIZE
+    // onwards) into the on-disk format used by load.
+    void store(int index, refcountblock_t *block) const;
+
+    // Returns the table blocks changed since the last call to
+    // clear_dirty.
+    const std::set<int> &dirty() const { return dirty_blocks; }
+
+    // Forgets which table blocks have changed.
+    void clear_dirty() { dirty_blocks.clear(); }
+
+    // Returns true if block_num has references beyond the first.
+    bool is_shared(blocknum_t block_num) const { return counts[block_num] > 0; }
+
+    // Adds a reference to each of the n blocks in blocks.
+    void add(const blocknum_t *blocks, int n);
+
+    // Drops a reference beyond the first from block_num. Returns false if
+    // it has none, in which case the block is no longer used once its
+    // only reference goes.
+    bool drop(blocknum_t block_num);
+
+    // Returns the number of blocks with references beyond the first.
+    int num_shared() const { return shared_count; }
+
+  private:
+    std::vector<unsigned char> counts;	// extra references of each block
+    int shared_count;			// number of non-zero counts
+    std::set<int> dirty_blocks;		// table blocks changed since stored
+};
+
+#endif
@@ -0,0 +1,424 @@
+// Computing Systems: Server
+// Serves many clients of one mounted file system over a Unix domain
+// socket. An epoll event loop accepts clients and moves their bytes; the
+// command lines they send run in a pool of worker threads, each client in
+// a session of its own. A client may send commands without waiting for
+// replies: they run one at a time, in order, and their output comes back
+// in the same order, each reply followed by the prompt.
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+using namespace std;
+
+#include "Server.h"
+
+// Fewest worker threads run; commands spend time waiting for locks and
+// the disk, so more workers than processors pay off
+static const int MIN_WORKERS = 4;
+
+// A client is not read from while this many of its lines wait to run or
+// this many bytes of its output wait to be sent
+static const size_t MAX_QUEUED_COMMANDS = 256;
+static const size_t MAX_PENDING_OUTPUT = 1 << 20;
+
+// Bytes read from a client at a time
+static const int READ_SIZE = 65536;
+
+// Longest command line a client may send; one that sends a longer line,
+// complete or not, is told so and disconnected
+static const size_t MAX_LINE_BYTES = 16384;
+
+// Events handled per call to epoll_wait
+static const int MAX_EVENTS = 64;
+
+// Creates a server running the command lines of its clients with
+// handler, in sessions of filesys. prompt is sent to a client when it
+// connects and after each of its commands.
+Server::Server(FileSys &filesys, const string &prompt, CommandHandler handler)
+  : filesys(filesys), prompt(prompt), handler(handler), epoll_fd(-1),
+    listen_fd(-1), event_fd(-1), signal_fd(-1), stopping(false),
+    workers_done(false)
+{
+}
+
+// Listens on the Unix domain socket socket_path and serves clients until
+// the process is interrupted or terminated. Commands already running are
+// finished first.
+void Server::run(const char *socket_path)
+{
+  // signals arrive through signal_fd; blocking them before the workers
+  // start keeps them blocked in the workers too
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    cerr << "Socket path is too long" << endl;
+    exit(-1);
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  // a socket left behind by an earlier server is replaced
+  struct stat st;
+  if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(socket_path);
+  }
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, SOMAXCONN) == -1) {
+    cerr << "Could not listen on socket" << endl;
+    exit(-1);
+  }
+
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (signal_fd == -1 || event_fd == -1 || epoll_fd == -1) {
+    cerr << "Could not start event loop" << endl;
+    exit(-1);
+  }
+  int fds[] = {listen_fd, event_fd, signal_fd};
+  for (int i = 0; i < 3; i++) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fds[i];
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event);
+  }
+
+  int num_workers = max(MIN_WORKERS, (int) thread::hardware_concurrency());
+  for (int i = 0; i < num_workers; i++) {
+    workers.push_back(thread(&Server::work, this));
+  }
+
+  // run until stopped and every client is gone
+  struct epoll_event events[MAX_EVENTS];
+  while (!stopping || !connections.empty()) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      cerr << "Failed to wait for events" << endl;
+      exit(-1);
+    }
+
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        accept_clients();
+      } else if (fd == event_fd) {
+        collect_results();
+      } else if (fd == signal_fd) {
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) > 0) {
+        }
+        stop();
+      } else {
+        // the client may have been closed by an earlier event
+        map<int, unique_ptr<Connection> >::iterator it = connections.find(fd);
+        if (it == connections.end()) {
+          continue;
+        }
+        Connection &conn = *it->second;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          receive(conn);
+        }
+        if (events[i].events & EPOLLOUT) {
+          send_output(conn);
+        }
+        dispatch(conn);
+        update(conn);
+      }
+    }
+  }
+
+  {
+    lock_guard<mutex> guard(task_lock);
+    workers_done = true;
+  }
+  task_ready.notify_all();
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  workers.clear();
+
+  close(epoll_fd);
+  close(event_fd);
+  close(signal_fd);
+  unlink(socket_path);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+// Accepts every pending client.
+void Server::accept_clients()
+{
+  while (true) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      // out of descriptors or a client that gave up: try again later
+      return;
+    }
+
+    unique_ptr<Connection> conn(new Connection);
+    conn->fd = fd;
+    conn->busy = conn->eof = conn->quit = conn->failed = false;
+    conn->events = 0;
+    filesys.start_session(conn->session);
+    conn->session.out_fd = -1;
+    conn->out = prompt;
+
+    Connection &c = *conn;
+    connections[fd] = move(conn);
+    send_output(c);
+    update(c);
+  }
+}
+
+// Reads what a client has sent and queues its complete lines.
+void Server::receive(Connection &conn)
+{
+  char buffer[READ_SIZE];
+  while (!conn.eof && !conn.failed && conn.commands.size() < MAX_QUEUED_COMMANDS &&
+         conn.out.size() < MAX_PENDING_OUTPUT) {
+    ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        conn.failed = true;
+      }
+      return;
+    }
+    if (n == 0) {
+      // a last line without a newline still runs
+      conn.eof = true;
+      if (!conn.in.empty()) {
+        conn.commands.push_back(conn.in);
+        conn.in.clear();
+      }
+      return;
+    }
+
+    conn.in.append(buffer, n);
+    size_t start = 0;
+    size_t end;
+    bool too_long = false;
+    while (!too_long && (end = conn.in.find('\n', start)) != string::npos) {
+      size_t len = end - start;
+      if (len > 0 && conn.in[end - 1] == '\r') {
+        len--;
+      }
+      too_long = (len > MAX_LINE_BYTES);
+      if (!too_long) {
+        conn.commands.push_back(conn.in.substr(start, len));
+        start = end + 1;
+      }
+    }
+    conn.in.erase(0, start);
+    if (too_long || conn.in.size() > MAX_LINE_BYTES) {
+      // the client is dropped like one that quit, abandoning queued lines
+      conn.out += "Command line is too long\n";
+      conn.in.clear();
+      conn.quit = true;
+      return;
+    }
+  }
+}
+
+// Hands the next command of a client to the workers if none is running.
+void Server::dispatch(Connection &conn)
+{
+  if (conn.busy || conn.quit || conn.failed || conn.commands.empty()) {
+    return;
+  }
+
+  Task task;
+  task.fd = conn.fd;
+  task.session = &conn.session;
+  task.command.swap(conn.commands.front());
+  conn.commands.pop_front();
+  conn.busy = true;
+  {
+    lock_guard<mutex> guard(task_lock);
+    tasks.push_back(task);
+  }
+  task_ready.notify_one();
+}
+
+// Adds the output of finished commands to their clients.
+void Server::collect_results()
+{
+  uint64_t count;
+  while (read(event_fd, &count, sizeof(count)) > 0) {
+  }
+
+  vector<Result> done;
+  {
+    lock_guard<mutex> guard(result_lock);
+    done.swap(results);
+  }
+
+  for (size_t i = 0; i < done.size(); i++) {
+    // a client stays open while its command runs
+    Connection &conn = *connections[done[i].fd];
+    conn.busy = false;
+    conn.out += done[i].output;
+    if (done[i].quit) {
+      conn.quit = true;
+    } else {
+      conn.out += prompt;
+    }
+    send_output(conn);
+    dispatch(conn);
+    update(conn);
+  }
+}
+
+// Sends as much pending output to a client as it takes.
+void Server::send_output(Connection &conn)
+{
+  size_t sent = 0;
+  while (sent < conn.out.size() && !conn.failed) {
+    ssize_t n = send(conn.fd, conn.out.data() + sent, conn.out.size() - sent, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        conn.failed = true;
+      }
+      break;
+    }
+    sent += n;
+  }
+  conn.out.erase(0, sent);
+  if (conn.failed) {
+    conn.out.clear();
+  }
+}
+
+// Updates the events a client is watched for, closing it if it is done.
+// Returns false if the client was closed.
+bool Server::update(Connection &conn)
+{
+  // a client is done once nothing of its is running or left to run; when
+  // the server stops, output it does not take at once is dropped
+  bool done = !conn.busy &&
+              (conn.failed || conn.quit || (conn.eof && conn.commands.empty()));
+  if (done && (conn.out.empty() || stopping)) {
+    if (conn.events != 0) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, NULL);
+    }
+    close(conn.fd);
+    ostringstream discard;
+    conn.session.out = conn.session.err = &discard;
+    filesys.end_session(conn.session);
+    connections.erase(conn.fd);
+    return false;
+  }
+
+  // a hung up socket keeps reporting it, so a client that is only waiting
+  // for a command to finish is left out of the event loop
+  unsigned int events = 0;
+  if (!conn.eof && !conn.quit && !conn.failed && !stopping &&
+      conn.commands.size() < MAX_QUEUED_COMMANDS && conn.out.size() < MAX_PENDING_OUTPUT) {
+    events |= EPOLLIN;
+  }
+  if (!conn.out.empty()) {
+    events |= EPOLLOUT;
+  }
+  if (events != conn.events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = conn.fd;
+    if (conn.events == 0) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.fd, &event);
+    } else if (events == 0) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, NULL);
+    } else {
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+    }
+    conn.events = events;
+  }
+  return true;
+}
+
+// Stops accepting clients and drops the commands not yet running.
+void Server::stop()
+{
+  if (stopping) {
+    return;
+  }
+  stopping = true;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+  close(listen_fd);
+  listen_fd = -1;
+
+  vector<int> fds;
+  for (map<int, unique_ptr<Connection> >::iterator it = connections.begin();
+       it != connections.end(); it++) {
+    fds.push_back(it->first);
+  }
+  for (size_t i = 0; i < fds.size(); i++) {
+    Connection &conn = *connections[fds[i]];
+    conn.commands.clear();
+    conn.eof = true;
+    update(conn);
+  }
+}
+
+// Runs queued commands until the server stops.
+void Server::work()
+{
+  while (true) {
+    Task task;
+    {
+      unique_lock<mutex> guard(task_lock);
+      while (tasks.empty() && !workers_done) {
+        task_ready.wait(guard);
+      }
+      if (tasks.empty()) {
+        return;
+      }
+      task = tasks.front();
+      tasks.pop_front();
+    }
+
+    // the output is gathered and sent by the event loop
+    ostringstream out;
+    task.session->out = task.session->err = &out;
+    Result result;
+    result.fd = task.fd;
+    result.quit = handler(*task.session, task.command);
+    result.output = out.str();
+    {
+      lock_guard<mutex> guard(result_lock);
+      results.push_back(result);
+    }
+
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+      cerr << "Failed to signal event loop" << endl;
+      exit(-1);
+    }
+  }
+}
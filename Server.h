@@ -0,0 +1,114 @@
+// Computing Systems: Server
+// Serves many clients of one mounted file system over a Unix domain
+// socket. An epoll event loop accepts clients and moves their bytes; the
+// command lines they send run in a pool of worker threads, each client in
+// a session of its own. A client may send commands without waiting for
+// replies: they run one at a time, in order, and their output comes back
+// in the same order, each reply followed by the prompt.
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "FileSys.h"
+
+class Server {
+
+  public:
+    // Creates a server running the command lines of its clients with
+    // handler, in sessions of filesys. prompt is sent to a client when it
+    // connects and after each of its commands.
+    Server(FileSys &filesys, const std::string &prompt, CommandHandler handler);
+
+    // Listens on the Unix domain socket socket_path and serves clients
+    // until the process is interrupted or terminated. Commands already
+    // running are finished first.
+    void run(const char *socket_path);
+
+  private:
+    // a connected client
+    struct Connection {
+      int fd;			// socket of the client
+      Session session;		// session the commands run in
+      std::string in;		// bytes received, not yet a whole line
+      std::deque<std::string> commands;	// lines waiting to run
+      std::string out;		// output waiting to be sent
+      bool busy;		// true while a command is running
+      bool eof;			// true once the client stopped sending
+      bool quit;		// true once the client quit
+      bool failed;		// true if the socket failed
+      unsigned int events;	// epoll events watched for (0 - not watched)
+    };
+
+    // a command line to run, handed to a worker
+    struct Task {
+      int fd;			// client the command came from
+      Session *session;		// session to run it in
+      std::string command;	// command line
+    };
+
+    // the output of a finished command, handed back to the event loop
+    struct Result {
+      int fd;			// client the command came from
+      std::string output;	// output of the command
+      bool quit;		// true if the client quit
+    };
+
+    FileSys &filesys;		// file system served
+    std::string prompt;		// prompt sent after each command
+    CommandHandler handler;	// runs command lines
+
+    int epoll_fd;		// event loop
+    int listen_fd;		// socket clients connect to
+    int event_fd;		// signalled when commands finish
+    int signal_fd;		// receives SIGINT and SIGTERM
+    bool stopping;		// true once the server is shutting down
+    std::map<int, std::unique_ptr<Connection> > connections; // clients by socket
+
+    std::vector<std::thread> workers;	// threads running commands
+    std::mutex task_lock;	// guards tasks and workers_done
+    std::condition_variable task_ready;	// signalled when a task is queued
+    std::deque<Task> tasks;	// commands waiting for a worker
+    bool workers_done;		// true when the workers should exit
+
+    std::mutex result_lock;	// guards results
+    std::vector<Result> results;	// finished commands
+
+    // Accepts every pending client.
+    void accept_clients();
+
+    // Reads what a client has sent and queues its complete lines.
+    void receive(Connection &conn);
+
+    // Hands the next command of a client to the workers if none is
+    // running.
+    void dispatch(Connection &conn);
+
+    // Adds the output of finished commands to their clients.
+    void collect_results();
+
+    // Sends as much pending output to a client as it takes.
+    void send_output(Connection &conn);
+
+    // Updates the events a client is watched for, closing it if it is
+    // done. Returns false if the client was closed.
+    bool update(Connection &conn);
+
+    // Stops accepting clients and drops the commands not yet running.
+    void stop();
+
+    // Runs queued commands until the server stops.
+    void work();
+
+    Server(const Server &);
+    Server &operator=(const Server &);
+};
+
+#endif
@@ -1,20 +1,177 @@
 // Computing Systems: Shell
 // Implements a basic shell (command line interface) for the file system
 
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <streambuf>
+#include <vector>
+#include <unordered_map>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 using namespace std;
 
 #include "Shell.h"
+#include "Server.h"
 
 static const string PROMPT_STRING = "FS> ";	// shell prompt
 
+// Bytes of output collected in batch mode before they are written
+static const size_t BATCH_OUTPUT_BYTES = 1 << 20;
+
+// Output buffer of batch mode. Output is written to a descriptor only
+// when the buffer fills or is drained: flushes (as by endl) are ignored.
+class BatchBuffer : public streambuf {
+  public:
+    BatchBuffer(int fd) : fd(fd), buffer(BATCH_OUTPUT_BYTES)
+    {
+      setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    ~BatchBuffer() { drain(); }
+
+    // Writes out everything buffered. Returns false if it could not be
+    // written.
+    bool drain()
+    {
+      bool ok = write_out(pbase(), pptr() - pbase());
+      setp(buffer.data(), buffer.data() + buffer.size());
+      return ok;
+    }
+
+  protected:
+    int overflow(int c)
+    {
+      if (!drain()) {
+        return traits_type::eof();
+      }
+      if (c != traits_type::eof()) {
+        *pptr() = c;
+        pbump(1);
+      }
+      return traits_type::not_eof(c);
+    }
+
+    streamsize xsputn(const char *s, streamsize n)
+    {
+      // large writes (file data) skip the buffer
+      if ((size_t) n > buffer.size() / 2) {
+        return (drain() && write_out(s, n)) ? n : 0;
+      }
+      return streambuf::xsputn(s, n);
+    }
+
+  private:
+    int fd;			// where the output goes
+    vector<char> buffer;	// output not yet written
+
+    // Writes the n bytes at s to fd. Returns false on an error.
+    bool write_out(const char *s, size_t n)
+    {
+      while (n > 0) {
+        ssize_t written = write(fd, s, n);
+        if (written == -1 && errno == EINTR) {
+          continue;
+        }
+        if (written <= 0) {
+          return false;
+        }
+        s += written;
+        n -= written;
+      }
+      return true;
+    }
+};
+
+// Converts str to a number in n. Returns false (after displaying an
+// error naming what to err) if str is not a valid number.
+static bool parse_number(ostream &err, const char *str, const char *what, unsigned int &n)
+{
+  errno = 0;
+  char *end;
+  unsigned long value = strtoul(str, &end, 0);
+  if (errno != 0 || *end != '\0' || str[0] == '-' || value > UINT_MAX) {
+    err << "Invalid command line: " << str;
+    err << " is not a valid " << what << endl;
+    return false;
+  }
+  n = value;
+  return true;
+}
+
+// Command table, in the order of CommandCode
+const Shell::CommandSpec Shell::commands[NUM_COMMANDS] = {
+  {"mkdir", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.mkdir(s, c.args[0]); }},
+  {"cd", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.cd(s, c.args[0]); }},
+  {"home", 0, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &) { fs.home(s); }},
+  {"rmdir", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.rmdir(s, c.args[0]); }},
+  {"ls", 0, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &) { fs.ls(s); }},
+  {"create", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.create(s, c.args[0]); }},
+  {"append", 2, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.append(s, c.args[0], c.args[1]); }},
+  {"cat", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.cat(s, c.args[0]); }},
+  {"tail", 2, {NULL, "number of bytes", NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.tail(s, c.args[0], c.nums[1]); }},
+  {"rm", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.rm(s, c.args[0]); }},
+  {"stat", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.stat(s, c.args[0]); }},
+  {"open", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.open(s, c.args[0]); }},
+  {"close", 1, {"file handle", NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.close(s, c.nums[0]); }},
+  {"read", 3, {"file handle", "offset", "number of bytes"},
+   [](FileSys &fs, Session &s, const Command &c) {
+     fs.read(s, c.nums[0], c.nums[1], c.nums[2]);
+   }},
+  {"write", 3, {"file handle", "offset", NULL},
+   [](FileSys &fs, Session &s, const Command &c) {
+     fs.write(s, c.nums[0], c.nums[1], c.args[2], c.sizes[2]);
+   }},
+  {"mksnap", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.mksnap(s, c.args[0]); }},
+  {"lssnap", 0, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &) { fs.lssnap(s); }},
+  {"rmsnap", 1, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.rmsnap(s, c.args[0]); }},
+  {"import", 2, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.import_file(s, c.args[0], c.args[1]); }},
+  {"export", 2, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &c) { fs.export_file(s, c.args[0], c.args[1]); }},
+  {"sync", 0, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &, const Command &) { fs.sync(); }},
+  {"cachestat", 0, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &) { fs.cachestat(s); }},
+  {"metrics", 0, {NULL, NULL, NULL},
+   [](FileSys &fs, Session &s, const Command &) { fs.metrics(s); }},
+  {"quit", 0, {NULL, NULL, NULL}, NULL}
+};
+
+// Creates a shell that mounts the file system with options.
+Shell::Shell(const MountOptions &options) : options(options)
+{
+  // the shell's own session runs the user's commands, which may reach
+  // host files
+  session.local = true;
+}
+
 // Executes the shell until the user quits.
 void Shell::run()
 {
   // mount the file system
-  filesys.mount();
+  filesys.mount(options);
+  filesys.start_session(session);
   
   // continue until the user quits
   bool user_quit = false;
@@ -26,15 +183,18 @@ void Shell::run()
     getline(cin, command_str);
 
     // execute the command
-    user_quit = execute_command(command_str);
+    user_quit = execute_command(session, command_str);
   }
 
   // unmount the file system
+  filesys.end_session(session);
   filesys.unmount();
 }
 
-// Execute a script.
-void Shell::run_script(char *file_name)
+// Execute a script. In batch mode the whole script is parsed before any
+// of it runs, lines are not echoed, output is buffered and sync commands
+// are put off until the end.
+void Shell::run_script(char *file_name, bool batch)
 {
   // open script file
   ifstream infile;
@@ -44,8 +204,15 @@ void Shell::run_script(char *file_name)
     return;
   }
 
+  if (batch) {
+    run_batch(infile);
+    infile.close();
+    return;
+  }
+
   // mount the file system
-  filesys.mount();
+  filesys.mount(options);
+  filesys.start_session(session);
 
   // execute each line in the script
   bool user_quit = false;
@@ -53,142 +220,239 @@ void Shell::run_script(char *file_name)
   getline(infile, command_str, '\n');
   while (!infile.eof() && !user_quit) {
     cout << PROMPT_STRING << command_str << endl;
-    user_quit = execute_command(command_str);
+    user_quit = execute_command(session, command_str);
     getline(infile, command_str);
   }
 
   // clean up
+  filesys.end_session(session);
   filesys.unmount();
   infile.close();
 }
 
-// Executes the command. Returns true for quit and false otherwise.
-bool Shell::execute_command(string command_str)
+// Runs the script read from infile in batch mode.
+void Shell::run_batch(istream &infile)
 {
-  // parse the command line
-  struct Command command = parse_command(command_str);
+  // read the whole script
+  ostringstream contents;
+  contents << infile.rdbuf();
+  string script = contents.str();
 
-  // look for the matching command
-  if (command.name == "") {
-    return false;
-  }
-  else if (command.name == "mkdir") {
-    filesys.mkdir(command.file_name.c_str());
-  }
-  else if (command.name == "cd") {
-    filesys.cd(command.file_name.c_str());
-  }
-  else if (command.name == "home") {
-    filesys.home();
-  }
-  else if (command.name == "rmdir") {
-    filesys.rmdir(command.file_name.c_str());
-  }
-  else if (command.name == "ls") {
-    filesys.ls();
+  // parse every line up to the first quit. As when running line by line,
+  // only lines ending in a newline count. Command line errors are
+  // displayed now.
+  vector<Command> parsed;
+  vector<string> lines;  // the lines themselves, if capturing
+  size_t start = 0;
+  size_t end;
+  while ((end = script.find('\n', start)) != string::npos) {
+    if (recorder.is_open()) {
+      lines.push_back(script.substr(start, end - start));
+    }
+    Command command;
+    parse_command(&script[start], end - start, command, cerr);
+    parsed.push_back(command);
+    if (command.code == CMD_QUIT) {
+      break;
+    }
+    start = end + 1;
   }
-  else if (command.name == "create") {
-    filesys.create(command.file_name.c_str());
+
+  // mount the file system, with output collected in a large buffer
+  filesys.mount(options);
+  filesys.start_session(session);
+  BatchBuffer buffer(STDOUT_FILENO);
+  ostream out(&buffer);
+  session.out = &out;
+  session.out_fd = -1;
+
+  // run the commands
+  bool synced = true;
+  for (size_t i = 0; i < parsed.size(); i++) {
+    const Command &command = parsed[i];
+    if (recorder.is_open()) {
+      recorder.record(session.id, lines[i]);
+    }
+    if (command.code == CMD_SYNC) {
+      synced = false;
+    }
+    else if (run_command(session, command)) {
+      break;
+    }
   }
-  else if (command.name == "append") {
-    filesys.append(command.file_name.c_str(), command.append_data.c_str());
+  if (!synced) {
+    filesys.sync();
   }
-  else if (command.name == "cat") {
-    filesys.cat(command.file_name.c_str());
+
+  // clean up
+  buffer.drain();
+  session.out = &cout;
+  session.out_fd = STDOUT_FILENO;
+  filesys.end_session(session);
+  filesys.unmount();
+}
+
+// Serves clients connecting to the Unix domain socket socket_path, each
+// in a session of its own, until interrupted.
+void Shell::serve(const char *socket_path)
+{
+  // mount the file system
+  filesys.mount(options);
+
+  // run every client's commands like the shell's own
+  Server server(filesys, PROMPT_STRING,
+                [this](Session &session, const string &command_str) {
+                  return execute_command(session, command_str);
+                });
+  server.run(socket_path);
+
+  // unmount the file system
+  filesys.unmount();
+}
+
+// Records every command line run from now on, with when and in which
+// session it started, to the trace file file_name. Returns false if the
+// file cannot be created.
+bool Shell::capture(const char *file_name)
+{
+  return recorder.open(file_name);
+}
+
+// Replays the trace in the file trace_name with options and reports
+// throughput and latency.
+void Shell::replay(const char *trace_name, const ReplayOptions &options)
+{
+  TraceReplayer replayer(filesys, [this](Session &session, const string &command_str) {
+                           return execute_command(session, command_str);
+                         });
+  if (!replayer.load(trace_name)) {
+    return;
   }
-  else if (command.name == "tail") {
-    errno = 0;
-    unsigned long n = strtoul(command.append_data.c_str(), NULL, 0);
-    if (0 == errno) {
-      filesys.tail(command.file_name.c_str(), n);
-    } else {
-      cerr << "Invalid command line: " << command.append_data;
-      cerr << " is not a valid number of bytes" << endl;
-      return false;
-    }
+
+  // mount the file system, replay and unmount
+  filesys.mount(this->options);
+  replayer.run(options, cout);
+  filesys.unmount();
+}
+
+// Writes the metrics gathered by the file system to the file file_name as
+// JSON.
+void Shell::write_metrics(const char *file_name)
+{
+  ofstream outfile(file_name);
+  if (outfile.fail()) {
+    cerr << "Could not open metrics file" << endl;
+    return;
   }
-  else if (command.name == "rm") {
-    filesys.rm(command.file_name.c_str());
+  filesys.write_metrics(outfile);
+}
+
+// Executes the command for session. Returns true for quit and false
+// otherwise.
+bool Shell::execute_command(Session &session, string command_str)
+{
+  if (recorder.is_open()) {
+    recorder.record(session.id, command_str);
   }
-  else if (command.name == "stat") {
-    filesys.stat(command.file_name.c_str());
+
+  // parse the command line, in place
+  Command command;
+  parse_command(&command_str[0], command_str.size(), command, *session.err);
+  return run_command(session, command);
+}
+
+// Runs the parsed command for session. Returns true for quit and false
+// otherwise.
+bool Shell::run_command(Session &session, const Command &command)
+{
+  if (command.code == CMD_NONE) {
+    return false;
   }
-  else if (command.name == "quit") {
+  const CommandSpec &spec = commands[command.code];
+  if (spec.run == NULL) {
     return true;
   }
-
+  spec.run(filesys, session, command);
   return false;
 }
 
-// Parses a command line into a command struct. Returned name is blank
-// for invalid command lines.
-Shell::Command Shell::parse_command(string command_str)
+// Parses the command line of len characters at line into command,
+// splitting it up in place, so line[len] must be writable. The code is
+// CMD_NONE for blank and invalid command lines, after displaying an error
+// to err for the latter.
+void Shell::parse_command(char *line, size_t len, Command &command, ostream &err)
 {
-  // empty command struct returned for errors
-  struct Command empty = {"", "", ""};
+  command.code = CMD_NONE;
 
-  // grab each of the tokens (if they exist)
-  struct Command command;
-  istringstream ss(command_str);
+  // find the tokens (if they exist), ending each with a NUL
+  const int max_tokens = MAX_ARGS + 1;
+  char *tokens[max_tokens];
+  unsigned int sizes[max_tokens];
   int num_tokens = 0;
-  if (ss >> command.name) {
-    num_tokens++;
-    if (ss >> command.file_name) {
+  char *p = line;
+  char *end = line + len;
+  while (true) {
+    while (p < end && isspace((unsigned char) *p)) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    if (num_tokens == max_tokens) {
+      // junk after the last argument
       num_tokens++;
-      if (ss >> command.append_data) {
-        num_tokens++;
-        string junk;
-        if (ss >> junk) {
-          num_tokens++;
-        }
-      }
+      break;
+    }
+    tokens[num_tokens] = p;
+    while (p < end && !isspace((unsigned char) *p)) {
+      p++;
+    }
+    sizes[num_tokens] = p - tokens[num_tokens];
+    num_tokens++;
+    if (*p != '\0') {
+      *p = '\0';
+    }
+    if (p < end) {
+      p++;
     }
   }
 
   // Check for empty command line
   if (num_tokens == 0) {
-    return empty;
+    return;
   }
-    
+
+  // look for the matching command, by name in a table built once
+  static const unordered_map<string, int> codes = [] {
+    unordered_map<string, int> table;
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+      table[commands[i].name] = i;
+    }
+    return table;
+  }();
+  const char *name = tokens[0];
+  unordered_map<string, int>::const_iterator found = codes.find(name);
+
   // Check for invalid command lines
-  if (command.name == "ls" ||
-      command.name == "home" ||
-      command.name == "quit")
-  {
-    if (num_tokens != 1) {
-      cerr << "Invalid command line: " << command.name;
-      cerr << " has improper number of arguments" << endl;
-      return empty;
-    }
-  }
-  else if (command.name == "mkdir" ||
-      command.name == "cd"    ||
-      command.name == "rmdir" ||
-      command.name == "create"||
-      command.name == "cat"   ||
-      command.name == "rm"    ||
-      command.name == "stat")
-  {
-    if (num_tokens != 2) {
-      cerr << "Invalid command line: " << command.name;
-      cerr << " has improper number of arguments" << endl;
-      return empty;
-    }
-  }
-  else if (command.name == "append" || command.name == "tail")
-  {
-    if (num_tokens != 3) {
-      cerr << "Invalid command line: " << command.name;
-      cerr << " has improper number of arguments" << endl;
-      return empty;
-    }
-  }
-  else {
-    cerr << "Invalid command line: " << command.name;
-    cerr << " is not a command" << endl; 
-    return empty;
-  } 
-
-  return command;
+  if (found == codes.end()) {
+    err << "Invalid command line: " << name;
+    err << " is not a command" << endl;
+    return;
+  }
+  int code = found->second;
+  const CommandSpec &spec = commands[code];
+  if (num_tokens != spec.num_args + 1) {
+    err << "Invalid command line: " << name;
+    err << " has improper number of arguments" << endl;
+    return;
+  }
+  for (int i = 0; i < spec.num_args; i++) {
+    command.args[i] = tokens[i + 1];
+    command.sizes[i] = sizes[i + 1];
+    if (spec.numbers[i] != NULL &&
+        !parse_number(err, command.args[i], spec.numbers[i], command.nums[i])) {
+      return;
+    }
+  }
+  command.code = (CommandCode) code;
 }
-
@@ -6,34 +6,96 @@
 
 #include <string>
 #include "FileSys.h"
+#include "Trace.h"
 
 // Shell
 class Shell {
 
   public:
+    // Creates a shell that mounts the file system with options.
+    Shell(const MountOptions &options = MountOptions());
+
     // Executes the shell until the user quits.
     void run();
 
-    // Execute a script.
-    void run_script(char *file_name);
+    // Execute a script. In batch mode the whole script is parsed before
+    // any of it runs, lines are not echoed, output is buffered and sync
+    // commands are put off until the end.
+    void run_script(char *file_name, bool batch = false);
+
+    // Serves clients connecting to the Unix domain socket socket_path,
+    // each in a session of its own, until interrupted.
+    void serve(const char *socket_path);
+
+    // Records every command line run from now on, with when and in which
+    // session it started, to the trace file file_name. Returns false if
+    // the file cannot be created.
+    bool capture(const char *file_name);
+
+    // Replays the trace in the file trace_name with options and reports
+    // throughput and latency.
+    void replay(const char *trace_name, const ReplayOptions &options);
+
+    // Writes the metrics gathered by the file system to the file
+    // file_name as JSON.
+    void write_metrics(const char *file_name);
 
   private:
     FileSys filesys;  // file system
+    Session session;  // current directory and file handles of the user
+    MountOptions options;  // settings used to mount the file system
+    TraceRecorder recorder;  // trace of the commands run (if capturing)
+
+    // commands of the shell, in the order of the command table
+    enum CommandCode {
+      CMD_MKDIR, CMD_CD, CMD_HOME, CMD_RMDIR, CMD_LS, CMD_CREATE, CMD_APPEND,
+      CMD_CAT, CMD_TAIL, CMD_RM, CMD_STAT, CMD_OPEN, CMD_CLOSE, CMD_READ,
+      CMD_WRITE, CMD_MKSNAP, CMD_LSSNAP, CMD_RMSNAP, CMD_IMPORT, CMD_EXPORT,
+      CMD_SYNC, CMD_CACHESTAT, CMD_METRICS, CMD_QUIT,
+      NUM_COMMANDS, CMD_NONE = NUM_COMMANDS
+    };
 
-    // data structure for command line
+    // most arguments a command takes
+    static const int MAX_ARGS = 3;
+
+    // a command line parsed into a compact record. The arguments point
+    // into the line, which is split up in place.
     struct Command
     {
-      string name;		// name of command
-      string file_name;		// name of file
-      string append_data;	// append data (append only)
+      CommandCode code;			// command (CMD_NONE - blank or invalid)
+      const char *args[MAX_ARGS];	// arguments, each NUL terminated
+      unsigned int sizes[MAX_ARGS];	// length of each argument
+      unsigned int nums[MAX_ARGS];	// value of each numeric argument
+    };
+
+    // entry of the command table
+    struct CommandSpec
+    {
+      const char *name;			// name of command
+      int num_args;			// number of arguments it takes
+      const char *numbers[MAX_ARGS];	// what each argument counts, if it
+					// is a number (NULL - not a number)
+      void (*run)(FileSys &, Session &, const Command &);	// runs it (NULL - quit)
     };
 
-    // Executes the command. Returns true for quit and false otherwise.
-    bool execute_command(string command_str);
+    static const CommandSpec commands[NUM_COMMANDS];	// table, by code
+
+    // Executes the command for session. Returns true for quit and false
+    // otherwise.
+    bool execute_command(Session &session, string command_str);
+
+    // Runs the script read from infile in batch mode.
+    void run_batch(std::istream &infile);
+
+    // Runs the parsed command for session. Returns true for quit and
+    // false otherwise.
+    bool run_command(Session &session, const Command &command);
 
-    // Parses a command line into a command struct. Returned name is blank
-    // for invalid command lines.
-    struct Command parse_command(string command_str);
+    // Parses the command line of len characters at line into command,
+    // splitting it up in place, so line[len] must be writable. The code
+    // is CMD_NONE for blank and invalid command lines, after displaying
+    // an error to err for the latter.
+    static void parse_command(char *line, size_t len, Command &command, std::ostream &err);
 };
 
 #endif
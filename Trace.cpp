@@ -0,0 +1,209 @@
+// Computing Systems: Trace
+// Captures the command lines run by the shell, with when and in which
+// session each one started, and replays such traces against the file
+// system, reporting throughput and latency.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+using namespace std;
+
+#include "Trace.h"
+
+// Returns the value below which the fraction p of the values in sorted
+// lie. sorted must not be empty.
+static double percentile(const vector<double> &sorted, double p)
+{
+  size_t rank = max((size_t) ceil(p * sorted.size()), (size_t) 1);
+  return sorted[min(rank, sorted.size()) - 1];
+}
+
+// Creates a recorder that records nothing until opened.
+TraceRecorder::TraceRecorder()
+{
+}
+
+// Starts writing the trace to file_name, timing commands from now.
+// Returns false if the file cannot be created.
+bool TraceRecorder::open(const char *file_name)
+{
+  out.open(file_name);
+  start = chrono::steady_clock::now();
+  return !out.fail();
+}
+
+// Records that session is starting command_line now.
+void TraceRecorder::record(int session, const string &command_line)
+{
+  unsigned long usecs = chrono::duration_cast<chrono::microseconds>(
+    chrono::steady_clock::now() - start).count();
+  lock_guard<mutex> guard(lock);
+  out << usecs << '\t' << session << '\t' << command_line << '\n';
+}
+
+// Creates a replayer running command lines with handler in sessions of
+// filesys.
+TraceReplayer::TraceReplayer(FileSys &filesys, CommandHandler handler)
+  : filesys(filesys), handler(handler)
+{
+}
+
+// Reads the trace in file_name. Returns false (after displaying an error)
+// if the file cannot be read or a line is not a trace entry.
+bool TraceReplayer::load(const char *file_name)
+{
+  ifstream infile(file_name);
+  if (infile.fail()) {
+    cerr << "Could not open trace file" << endl;
+    return false;
+  }
+
+  string line;
+  int line_num = 0;
+  while (getline(infile, line)) {
+    line_num++;
+    size_t tab1 = line.find('\t');
+    size_t tab2 = (tab1 == string::npos) ? string::npos : line.find('\t', tab1 + 1);
+    TraceEntry entry;
+    istringstream usecs(line.substr(0, tab1));
+    istringstream session(tab1 == string::npos ? "" : line.substr(tab1 + 1, tab2 - tab1 - 1));
+    if (tab2 == string::npos || !(usecs >> entry.usecs) || !(session >> entry.session)) {
+      cerr << "Invalid trace line " << line_num << endl;
+      return false;
+    }
+    entry.command = line.substr(tab2 + 1);
+    entries.push_back(entry);
+  }
+  return true;
+}
+
+// Replays the trace with options and writes a report of throughput and
+// latency to out. The output of the commands is discarded.
+void TraceReplayer::run(const ReplayOptions &options, ostream &out)
+{
+  // deal the commands to sessions
+  vector<Stream> streams;
+  if (options.sessions > 0) {
+    streams.resize(options.sessions);
+    for (size_t i = 0; i < entries.size(); i++) {
+      streams[i % options.sessions].entries.push_back(&entries[i]);
+    }
+  } else {
+    map<int, size_t> recorded;
+    for (size_t i = 0; i < entries.size(); i++) {
+      map<int, size_t>::iterator it = recorded.find(entries[i].session);
+      if (it == recorded.end()) {
+        it = recorded.insert(make_pair(entries[i].session, streams.size())).first;
+        streams.push_back(Stream());
+      }
+      streams[it->second].entries.push_back(&entries[i]);
+    }
+  }
+
+  // run every session at once
+  Clock::time_point start = Clock::now();
+  vector<thread> threads;
+  for (size_t i = 0; i < streams.size(); i++) {
+    threads.push_back(thread(&TraceReplayer::replay, this, ref(streams[i]), options.paced,
+                             start));
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+  // gather the latencies, overall and by command
+  vector<double> latencies;
+  vector<double> lags;
+  map<string, vector<double> > by_command;
+  unsigned long errors = 0;
+  for (size_t i = 0; i < streams.size(); i++) {
+    Stream &stream = streams[i];
+    for (size_t j = 0; j < stream.latencies.size(); j++) {
+      string name;
+      istringstream(stream.entries[j]->command) >> name;
+      by_command[name].push_back(stream.latencies[j]);
+    }
+    latencies.insert(latencies.end(), stream.latencies.begin(), stream.latencies.end());
+    lags.insert(lags.end(), stream.lags.begin(), stream.lags.end());
+    errors += stream.errors;
+  }
+
+  out << "Replayed " << latencies.size() << " of " << entries.size() << " commands in "
+      << streams.size() << " sessions in " << fixed << setprecision(3) << seconds << " s ("
+      << (options.paced ? "at the recorded pace" : "as fast as possible") << ")" << endl;
+  if (latencies.empty()) {
+    return;
+  }
+  sort(latencies.begin(), latencies.end());
+  out << setprecision(1);
+  out << "Throughput: " << latencies.size() / seconds << " commands/s" << endl;
+  out << "Latency us: p50 " << percentile(latencies, 0.5)
+      << ", p90 " << percentile(latencies, 0.9)
+      << ", p99 " << percentile(latencies, 0.99)
+      << ", max " << latencies.back() << endl;
+  if (options.paced) {
+    double total_lag = 0;
+    for (size_t i = 0; i < lags.size(); i++) {
+      total_lag += lags[i];
+    }
+    out << "Start lag us: mean " << total_lag / lags.size()
+        << ", max " << *max_element(lags.begin(), lags.end()) << endl;
+  }
+  out << "Errors: " << errors << endl;
+
+  out << left << setw(10) << "Command" << right << setw(10) << "Count"
+      << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "Max us" << endl;
+  for (map<string, vector<double> >::iterator it = by_command.begin();
+       it != by_command.end(); it++) {
+    vector<double> &times = it->second;
+    sort(times.begin(), times.end());
+    out << left << setw(10) << (it->first.empty() ? "(blank)" : it->first) << right
+        << setw(10) << times.size()
+        << setw(10) << percentile(times, 0.5) << setw(10) << percentile(times, 0.99)
+        << setw(10) << times.back() << endl;
+  }
+}
+
+// Runs the commands of stream in a new session, starting the clock of a
+// paced replay at start.
+void TraceReplayer::replay(Stream &stream, bool paced, Clock::time_point start)
+{
+  // output is thrown away, file data through a descriptor as in the shell
+  ofstream null_out("/dev/null");
+  int null_fd = ::open("/dev/null", O_WRONLY);
+  Session session;
+  session.out = &null_out;
+  session.err = &null_out;
+  session.out_fd = null_fd;
+  filesys.start_session(session);
+
+  for (size_t i = 0; i < stream.entries.size(); i++) {
+    const TraceEntry &entry = *stream.entries[i];
+    Clock::time_point begin = Clock::now();
+    if (paced) {
+      Clock::time_point due = start + chrono::microseconds(entry.usecs);
+      if (begin < due) {
+        this_thread::sleep_until(due);
+        begin = Clock::now();
+      }
+      stream.lags.push_back(chrono::duration<double, micro>(begin - due).count());
+    }
+
+    bool quit = handler(session, entry.command);
+    stream.latencies.push_back(chrono::duration<double, micro>(Clock::now() - begin).count());
+    if (quit) {
+      break;
+    }
+  }
+
+  filesys.end_session(session);
+  stream.errors = session.errors;
+  ::close(null_fd);
+}
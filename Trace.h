@@ -0,0 +1,94 @@
+// Computing Systems: Trace
+// Captures the command lines run by the shell, with when and in which
+// session each one started, and replays such traces against the file
+// system, reporting throughput and latency. A trace is a text file with
+// a line per command: microseconds since capture began, the session
+// number and the command line, separated by tabs.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include "FileSys.h"
+
+// One command line of a trace
+struct TraceEntry {
+  unsigned long usecs;		// when it started, after capture began
+  int session;			// session it ran in
+  std::string command;		// command line
+};
+
+// Writes the command lines run by any session to a trace. May be used by
+// several threads at once.
+class TraceRecorder {
+
+  public:
+    // Creates a recorder that records nothing until opened.
+    TraceRecorder();
+
+    // Starts writing the trace to file_name, timing commands from now.
+    // Returns false if the file cannot be created.
+    bool open(const char *file_name);
+
+    // Returns true if commands are being recorded.
+    bool is_open() const { return out.is_open(); }
+
+    // Records that session is starting command_line now.
+    void record(int session, const std::string &command_line);
+
+  private:
+    std::mutex lock;		// guards out
+    std::ofstream out;		// trace file
+    std::chrono::steady_clock::time_point start;	// when capture began
+};
+
+// How a trace is replayed
+struct ReplayOptions {
+  bool paced;			// start commands at their recorded times
+  int sessions;			// deal the commands round robin to this many
+				// sessions (0 - keep the recorded sessions)
+
+  ReplayOptions() : paced(false), sessions(0) {}
+};
+
+// Replays a trace, each session in a thread of its own
+class TraceReplayer {
+
+  public:
+    // Creates a replayer running command lines with handler in sessions of
+    // filesys.
+    TraceReplayer(FileSys &filesys, CommandHandler handler);
+
+    // Reads the trace in file_name. Returns false (after displaying an
+    // error) if the file cannot be read or a line is not a trace entry.
+    bool load(const char *file_name);
+
+    // Replays the trace with options and writes a report of throughput and
+    // latency to out. The output of the commands is discarded.
+    void run(const ReplayOptions &options, std::ostream &out);
+
+  private:
+    // the commands replayed by one session, and how they went
+    struct Stream {
+      std::vector<const TraceEntry *> entries;	// commands, in order
+      std::vector<double> latencies;	// microseconds each command took
+      std::vector<double> lags;		// microseconds each started late
+      unsigned long errors;		// errors the commands reported
+    };
+
+    FileSys &filesys;		// file system replayed against
+    CommandHandler handler;	// runs command lines
+    std::vector<TraceEntry> entries;	// the trace, in recorded order
+
+    typedef std::chrono::steady_clock Clock;
+
+    // Runs the commands of stream in a new session, starting the clock
+    // of a paced replay at start.
+    void replay(Stream &stream, bool paced, Clock::time_point start);
+};
+
+#endif
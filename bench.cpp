@@ -0,0 +1,311 @@
+// Computing Systems: Benchmark
+// Times the file system commands by driving FileSys directly, first on a
+// freshly formatted disk and then on one aged by a run of creates,
+// appends and removes. For each command it reports operations per second,
+// latency percentiles and the disk blocks read and written per operation.
+// The disk is created in a temporary directory that is removed at the end.
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "FileSys.h"
+
+// Settings of a benchmark run
+struct BenchOptions {
+  int ops;			// operations per timed phase
+  int age_ops;			// operations that age the disk
+  MountOptions mount;		// how the disk is mounted
+
+  BenchOptions() : ops(2000), age_ops(20000) {}
+};
+
+// Runs the timed phases on a mounted file system and prints a line for
+// each of them.
+class Bench {
+
+  public:
+    // Creates a benchmark of filesys, whose commands write their output
+    // to session.
+    Bench(FileSys &filesys, Session &session, const BenchOptions &options);
+
+    // Runs every phase in a new directory named dir.
+    void run(const string &dir);
+
+  private:
+    FileSys &filesys;		// file system measured
+    Session &session;		// session the commands run in
+    BenchOptions options;	// settings of the run
+
+    typedef chrono::steady_clock Clock;
+
+    // Times count calls of op (given the index of the call) and prints a
+    // line named name. Dirty blocks are synced after the last call so that
+    // the writes they cause are counted.
+    template <typename Op>
+    void phase(const string &name, int count, Op op);
+
+    // Prints the header of the result table.
+    void print_header();
+
+    // Unmounts and mounts the file system again, emptying the caches.
+    void remount();
+};
+
+// Creates a benchmark of filesys, whose commands write their output to
+// session.
+Bench::Bench(FileSys &filesys, Session &session, const BenchOptions &options)
+  : filesys(filesys), session(session), options(options)
+{
+}
+
+// Runs every phase in a new directory named dir.
+void Bench::run(const string &dir)
+{
+  int n = options.ops;
+  string base = "/" + dir;
+  filesys.mkdir(session, base.c_str());
+  filesys.cd(session, base.c_str());
+
+  // names of the files used by the phases
+  vector<string> files(n);
+  for (int i = 0; i < n; i++) {
+    files[i] = "f" + to_string(i);
+  }
+  string small(16, 's');
+  string medium(4 * BLOCK_SIZE, 'm');
+  string large(32 * BLOCK_SIZE, 'l');
+
+  print_header();
+  phase("create", n, [&](int i) { filesys.create(session, files[i].c_str()); });
+  phase("append-16", n, [&](int i) {
+    filesys.append(session, files[i].c_str(), small.c_str());
+  });
+  phase("append-" + to_string(medium.size()), n, [&](int i) {
+    filesys.append(session, files[i].c_str(), medium.c_str());
+  });
+  phase("append-" + to_string(large.size()), n, [&](int i) {
+    filesys.append(session, files[i].c_str(), large.c_str());
+  });
+  phase("cat", n, [&](int i) { filesys.cat(session, files[i].c_str()); });
+  remount();
+  filesys.cd(session, base.c_str());
+  phase("cat-cold", n, [&](int i) { filesys.cat(session, files[i].c_str()); });
+  phase("tail-64", n, [&](int i) { filesys.tail(session, files[i].c_str(), 64); });
+  phase("stat", n, [&](int i) { filesys.stat(session, files[i].c_str()); });
+  phase("ls", max(1, n / 20), [&](int) { filesys.ls(session); });
+
+  // a deep path, looked up from the root each time
+  const int depth = 32;
+  string path = base;
+  for (int i = 0; i < depth; i++) {
+    path += "/d" + to_string(i);
+    filesys.mkdir(session, path.c_str());
+  }
+  string deep_file = path + "/f";
+  filesys.create(session, deep_file.c_str());
+  phase("lookup-" + to_string(depth), n, [&](int) {
+    filesys.stat(session, deep_file.c_str());
+  });
+
+  phase("rm", n, [&](int i) { filesys.rm(session, files[i].c_str()); });
+  phase("mkdir", n, [&](int i) { filesys.mkdir(session, files[i].c_str()); });
+  phase("rmdir", n, [&](int i) { filesys.rmdir(session, files[i].c_str()); });
+  filesys.home(session);
+  cout << endl;
+}
+
+// Times count calls of op (given the index of the call) and prints a line
+// named name. Dirty blocks are synced after the last call so that the
+// writes they cause are counted.
+template <typename Op>
+void Bench::phase(const string &name, int count, Op op)
+{
+  const Disk &disk = filesys.basic().get_disk();
+  unsigned long reads = disk.blocks_read();
+  unsigned long writes = disk.blocks_written();
+
+  vector<double> latencies(count);
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < count; i++) {
+    Clock::time_point op_start = Clock::now();
+    op(i);
+    latencies[i] = chrono::duration<double, micro>(Clock::now() - op_start).count();
+  }
+  double seconds = chrono::duration<double>(Clock::now() - start).count();
+  session.out->flush();
+  filesys.sync();
+
+  sort(latencies.begin(), latencies.end());
+  double per_op = 1.0 / count;
+  cout << left << setw(14) << name << right << fixed
+       << setw(8) << count
+       << setw(12) << setprecision(0) << count / seconds
+       << setw(10) << setprecision(1) << latencies[count / 2]
+       << setw(10) << latencies[count * 90 / 100]
+       << setw(10) << latencies[count * 99 / 100]
+       << setw(10) << latencies[count - 1]
+       << setw(10) << setprecision(2) << (disk.blocks_read() - reads) * per_op
+       << setw(10) << (disk.blocks_written() - writes) * per_op << endl;
+}
+
+// Prints the header of the result table.
+void Bench::print_header()
+{
+  cout << left << setw(14) << "operation" << right
+       << setw(8) << "ops" << setw(12) << "ops/s"
+       << setw(10) << "p50 us" << setw(10) << "p90 us" << setw(10) << "p99 us"
+       << setw(10) << "max us" << setw(10) << "reads/op" << setw(10) << "writes/op"
+       << endl;
+}
+
+// Unmounts and mounts the file system again, emptying the caches.
+void Bench::remount()
+{
+  filesys.end_session(session);
+  filesys.unmount();
+  filesys.mount(options.mount);
+  filesys.start_session(session);
+}
+
+// Ages the file system: files in a few directories are created, appended
+// to in turn with random sizes and removed at random, leaving free space
+// scattered between the files that remain.
+static void age(FileSys &filesys, Session &session, int ops)
+{
+  mt19937 random(1);
+  const int num_dirs = 8;
+  const int num_files = 64;
+  for (int d = 0; d < num_dirs; d++) {
+    filesys.mkdir(session, ("/age" + to_string(d)).c_str());
+  }
+  vector<bool> exists(num_dirs * num_files, false);
+  for (int i = 0; i < ops; i++) {
+    int f = random() % exists.size();
+    string name = "/age" + to_string(f / num_files) + "/f" + to_string(f % num_files);
+    if (!exists[f]) {
+      filesys.create(session, name.c_str());
+      exists[f] = true;
+    } else if (random() % 4 == 0) {
+      filesys.rm(session, name.c_str());
+      exists[f] = false;
+    } else {
+      string data(1 + random() % (8 * BLOCK_SIZE), 'a');
+      filesys.append(session, name.c_str(), data.c_str());
+    }
+  }
+  filesys.sync();
+}
+
+int main(int argc, char **argv)
+{
+  static struct option long_options[] = {
+    {"ops", required_argument, NULL, 'o'},
+    {"age", required_argument, NULL, 'a'},
+    {"cache", required_argument, NULL, 'c'},
+    {"mmap", no_argument, NULL, 'm'},
+    {"blocks", required_argument, NULL, 'b'},
+    {"journal", required_argument, NULL, 'j'},
+    {"journal-data", no_argument, NULL, 'd'},
+    {"no-uring", no_argument, NULL, 'u'},
+    {NULL, 0, NULL, 0}
+  };
+
+  BenchOptions options;
+  options.mount.num_blocks = 1 << 20;
+  bool valid = true;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'o':
+        options.ops = atoi(optarg);
+        if (options.ops <= 0) valid = false;
+        break;
+      case 'a':
+        options.age_ops = atoi(optarg);
+        if (options.age_ops < 0) valid = false;
+        break;
+      case 'c':
+        options.mount.cache_blocks = atoi(optarg);
+        if (options.mount.cache_blocks < 0) valid = false;
+        break;
+      case 'm':
+        options.mount.disk_mode = DISK_MODE_MMAP;
+        break;
+      case 'b':
+        options.mount.num_blocks = atoi(optarg);
+        if (options.mount.num_blocks <= 0) valid = false;
+        break;
+      case 'j':
+        options.mount.journal_blocks = atoi(optarg);
+        if (options.mount.journal_blocks < 0) valid = false;
+        break;
+      case 'd':
+        options.mount.journal_data = true;
+        break;
+      case 'u':
+        options.mount.use_uring = false;
+        break;
+      default:
+        valid = false;
+    }
+  }
+  if (optind != argc || !valid) {
+    cerr << "Usage: ./fsbench [--ops <n>] [--age <ops>] [--cache <blocks>] [--mmap]";
+    cerr << " [--blocks <disk-blocks>] [--journal <blocks>] [--journal-data] [--no-uring]";
+    cerr << endl;
+    return 1;
+  }
+
+  // the disk lives in a directory of its own
+  char dir[] = "/tmp/fsbench.XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+    cerr << "Could not create a directory for the disk" << endl;
+    return 1;
+  }
+
+  // command output is thrown away, file data through writev as in the
+  // shell
+  ofstream null_out("/dev/null");
+  int null_fd = open("/dev/null", O_WRONLY);
+  Session session;
+  session.out = &null_out;
+  session.err = &null_out;
+  session.out_fd = null_fd;
+
+  FileSys filesys;
+  filesys.mount(options.mount);
+  filesys.start_session(session);
+  cout << "Disk I/O: " << filesys.basic().io_engine()
+       << ", cache " << options.mount.cache_blocks << " blocks"
+       << ", block size " << BLOCK_SIZE << endl << endl;
+
+  cout << "Fresh disk" << endl;
+  Bench bench(filesys, session, options);
+  bench.run("fresh");
+
+  cout << "Aged disk (" << options.age_ops << " operations)" << endl;
+  age(filesys, session, options.age_ops);
+  bench.run("aged");
+
+  filesys.end_session(session);
+  filesys.unmount();
+  ::close(null_fd);
+  unlink("DISK");
+  if (chdir("/") == 0) {
+    rmdir(dir);
+  }
+  return 0;
+}
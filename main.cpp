@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
+#include <getopt.h>
 using namespace std;
 
 #include "Shell.h"
@@ -14,24 +16,153 @@ int main(int argc, char **argv)
   // equal to the block size.
 #if 0
   cout << "superblock size: " << sizeof(struct superblock_t) << endl;
+  cout << "bitmapblock size: " << sizeof(struct bitmapblock_t) << endl;
   cout << "dirblock size: " << sizeof(struct dirblock_t) << endl;
+  cout << "dirindexblock size: " << sizeof(struct dirindexblock_t) << endl;
+  cout << "refcountblock size: " << sizeof(struct refcountblock_t) << endl;
   cout << "inode size: " <<  sizeof(struct inode_t) << endl;
+  cout << "extentblock size: " << sizeof(struct extentblock_t) << endl;
+  cout << "journalheader size: " << sizeof(struct journalheader_t) << endl;
+  cout << "journaldescblock size: " << sizeof(struct journaldescblock_t) << endl;
+  cout << "journalcommitblock size: " << sizeof(struct journalcommitblock_t) << endl;
   cout << "datablock size: " << sizeof(struct datablock_t) << endl;
 #endif
 
-  Shell shell;
+  static struct option long_options[] = {
+    {"cache", required_argument, NULL, 'c'},
+    {"mmap", no_argument, NULL, 'm'},
+    {"blocks", required_argument, NULL, 'b'},
+    {"journal", required_argument, NULL, 'j'},
+    {"journal-data", no_argument, NULL, 'd'},
+    {"commit", required_argument, NULL, 'g'},
+    {"serve", required_argument, NULL, 'v'},
+    {"no-uring", no_argument, NULL, 'u'},
+    {"metrics", required_argument, NULL, 'x'},
+    {"capture", required_argument, NULL, 'k'},
+    {"replay", required_argument, NULL, 'r'},
+    {"pace", no_argument, NULL, 'p'},
+    {"sessions", required_argument, NULL, 'n'},
+    {"batch", no_argument, NULL, 'a'},
+    {"snapshot", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0}
+  };
 
-  if (argc == 1) {
-    shell.run();
-  }
-  else if (argc == 3 && strcmp(argv[1], "-s") == 0) {
-    shell.run_script(argv[2]);
+  MountOptions options;
+  char *script_name = NULL;
+  char *socket_path = NULL;
+  char *metrics_file = NULL;
+  char *capture_file = NULL;
+  char *trace_file = NULL;
+  ReplayOptions replay_options;
+  bool replay_option = false;
+  bool batch = false;
+  bool valid = true;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        script_name = optarg;
+        break;
+      case 'c':
+        options.cache_blocks = atoi(optarg);
+        if (options.cache_blocks < 0) valid = false;
+        break;
+      case 'm':
+        options.disk_mode = DISK_MODE_MMAP;
+        break;
+      case 'b':
+        options.num_blocks = atoi(optarg);
+        if (options.num_blocks <= 0) valid = false;
+        break;
+      case 'j':
+        options.journal_blocks = atoi(optarg);
+        if (options.journal_blocks < 0) valid = false;
+        break;
+      case 'd':
+        options.journal_data = true;
+        break;
+      case 'g':
+        options.commit_ops = atoi(optarg);
+        if (options.commit_ops <= 0) valid = false;
+        break;
+      case 'v':
+        socket_path = optarg;
+        break;
+      case 'u':
+        options.use_uring = false;
+        break;
+      case 'x':
+        metrics_file = optarg;
+        break;
+      case 'k':
+        capture_file = optarg;
+        break;
+      case 'r':
+        trace_file = optarg;
+        break;
+      case 'p':
+        replay_options.paced = true;
+        replay_option = true;
+        break;
+      case 'n':
+        replay_options.sessions = atoi(optarg);
+        if (replay_options.sessions <= 0) valid = false;
+        replay_option = true;
+        break;
+      case 'a':
+        batch = true;
+        break;
+      case 'S':
+        options.snapshot = optarg;
+        break;
+      default:
+        valid = false;
+    }
   }
-  else {
+  if (optind != argc) valid = false;
+  if ((script_name != NULL) + (socket_path != NULL) + (trace_file != NULL) > 1) valid = false;
+  if (replay_option && trace_file == NULL) valid = false;
+  if (capture_file != NULL && trace_file != NULL) valid = false;
+  if (batch && script_name == NULL) valid = false;
+
+  if (!valid) {
     cerr << "Invalid command line" << endl;
     cerr << "Usage (one of the following): " << endl;
-    cerr << "./filesys" << endl;
-    cerr << "./filesys -s <script-name> " << endl;
+    cerr << "./filesys [--cache <blocks>] [--mmap] [--blocks <disk-blocks>] [--no-uring]";
+    cerr << " [--journal <blocks>] [--journal-data] [--commit <ops>] [--metrics <file>]" << endl;
+    cerr << "./filesys [--cache <blocks>] [--mmap] [--blocks <disk-blocks>] [--no-uring]";
+    cerr << " [--journal <blocks>] [--journal-data] [--commit <ops>] [--metrics <file>] -s <script-name> [--batch] " << endl;
+    cerr << "./filesys [--cache <blocks>] [--mmap] [--blocks <disk-blocks>] [--no-uring]";
+    cerr << " [--journal <blocks>] [--journal-data] [--commit <ops>] [--metrics <file>] --serve <socket> " << endl;
+    cerr << "./filesys [--cache <blocks>] [--mmap] [--blocks <disk-blocks>] [--no-uring]";
+    cerr << " [--journal <blocks>] [--journal-data] [--commit <ops>] [--metrics <file>]";
+    cerr << " --replay <trace> [--pace] [--sessions <n>] " << endl;
+    cerr << "Any of the first three also takes --capture <trace>." << endl;
+    cerr << "Any of them also takes --snapshot <name>, mounting that snapshot read-only." << endl;
+    return 0;
+  }
+
+  Shell shell(options);
+  if (capture_file != NULL && !shell.capture(capture_file)) {
+    cerr << "Could not create trace file" << endl;
+    return 0;
+  }
+
+  if (trace_file != NULL) {
+    shell.replay(trace_file, replay_options);
+  }
+  else if (socket_path != NULL) {
+    shell.serve(socket_path);
+  }
+  else if (script_name == NULL) {
+    shell.run();
+  }
+  else {
+    shell.run_script(script_name, batch);
+  }
+
+  if (metrics_file != NULL) {
+    shell.write_metrics(metrics_file);
   }
 
   return 0;